@@ -0,0 +1,74 @@
+#define _DEFAULT_SOURCE
+#include "gfarena.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// transparent huge page size on x86-64 and most arm64 kernels
+#define GFARENA_HUGE_PAGE ((size_t)2 << 20)
+
+struct gfarena {
+    char *base;
+    size_t size;
+    size_t used;
+};
+
+gfarena_t gfarena_create(size_t capacity, int huge) {
+    gfarena_t arena = calloc(1, sizeof(struct gfarena));
+    if (!arena)
+        return NULL;
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t size = (capacity + page - 1) / page * page;
+    if (!size)
+        size = page;
+    huge = huge && size >= GFARENA_HUGE_PAGE;
+    // over-map by one huge page and trim both ends, so the arena starts on
+    // a huge page boundary and the kernel can back it with huge pages
+    size_t span = huge ? size + GFARENA_HUGE_PAGE : size;
+    char *map = mmap(NULL, span, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) {
+        free(arena);
+        return NULL;
+    }
+    char *base = map;
+    if (huge) {
+        base = (char *)(((uintptr_t)map + GFARENA_HUGE_PAGE - 1) & ~(uintptr_t)(GFARENA_HUGE_PAGE - 1));
+        if (base > map)
+            munmap(map, base - map);
+        if (map + span > base + size)
+            munmap(base + size, map + span - (base + size));
+#ifdef MADV_HUGEPAGE
+        // only a hint: without THP support the arena works on small pages
+        madvise(base, size, MADV_HUGEPAGE);
+#endif
+    }
+    arena->base = base;
+    arena->size = size;
+    return(arena);
+}
+
+void gfarena_free(gfarena_t arena) {
+    if (!arena)
+        return;
+    munmap(arena->base, arena->size);
+    free(arena);
+}
+
+void *gfarena_alloc(gfarena_t arena, size_t size) {
+    size_t bytes = GFARENA_ROUND(size);
+    if (bytes < size || bytes > arena->size - arena->used)
+        return NULL;
+    void *p = arena->base + arena->used;
+    arena->used += bytes;
+    return( p );
+}
+
+void gfarena_discard(gfarena_t arena, void *p, size_t size) {
+    (void)arena;
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t start = ((uintptr_t)p + page - 1) & ~(page - 1);
+    uintptr_t end = ((uintptr_t)p + size) & ~(page - 1);
+    if (end > start)
+        madvise((void *)start, end - start, MADV_DONTNEED);
+}
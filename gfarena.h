@@ -0,0 +1,31 @@
+#ifndef GFARENA_H_INCLUDED
+#define GFARENA_H_INCLUDED
+
+#include <stddef.h>
+
+// A fixed-size region of anonymous memory that hands out zeroed, 64-byte
+// aligned buffers in order and is released as a whole. Nothing is touched
+// until it is used, so pages end up on the NUMA node of the thread that
+// first writes them. Large arenas are aligned to and advised for
+// transparent huge pages.
+
+#define GFARENA_ALIGN 64
+
+// bytes an allocation of size takes out of an arena
+#define GFARENA_ROUND(size) (((size) + GFARENA_ALIGN - 1) & ~(size_t)(GFARENA_ALIGN - 1))
+
+typedef struct gfarena *gfarena_t;
+
+// huge != 0 asks for transparent huge pages if the arena spans at least one
+gfarena_t gfarena_create(size_t capacity, int huge);
+
+void gfarena_free(gfarena_t arena);
+
+// returns NULL once the arena is exhausted
+void *gfarena_alloc(gfarena_t arena, size_t size);
+
+// Gives the whole pages inside [p, p+size) back to the kernel; they read as
+// zero and take no memory until written again.
+void gfarena_discard(gfarena_t arena, void *p, size_t size);
+
+#endif
@@ -0,0 +1,220 @@
+// Headless benchmark suite.
+//
+// Runs a fixed set of scenes at a range of square sizes and reports
+// throughput in MLUPS (million lattice updates per second) for the whole
+// fused step and, from an unfused run, for stream, collide, cleanup and
+// get_properties separately. Phase times come from the solver's own event
+// callback. Results are printed as a table and written as JSON.
+//
+//     gfbench [-i] [-s scene] [-m min] [-n max] [-u updates] [-t threads] [-o file]
+//
+// -i streams the lattice in place rather than into a second copy.
+// -u is the number of lattice updates to time per run; the step count is
+// derived from it so small and large grids take roughly the same time.
+// The solver goes unstable after a few hundred steps on most of these
+// scenes, so long runs are split into rounds, each on a freshly built scene.
+
+#define _POSIX_C_SOURCE 200809L
+#include "gridfluid.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ROUND_STEPS 32
+
+typedef void (*scene_fn)(gridfluid_t gf, size_t w, size_t h);
+
+typedef struct {
+    const char *name;
+    scene_fn build;
+} scene_t;
+
+typedef struct {
+    uint64_t ns[GF_PHASE_COLLIDE + 1];
+} phase_times_t;
+
+// column of water against the left wall, the classic dam break
+static void scene_dam(gridfluid_t gf, size_t w, size_t h) {
+    gridfluid_fill_rect(gf, 1, h/4, w/3 - 1, h-1 - h/4, GF_FLUID);
+}
+
+// the interactive demo's scene, scaled: a block of water poured onto a shelf
+static void scene_shelf(gridfluid_t gf, size_t w, size_t h) {
+    gridfluid_fill_rect(gf, w/4, h*3/5, w-1 - w/4, 1, GF_OBSTACLE);
+    gridfluid_fill_rect(gf, w/10, h/8, w/6 + 1 - w/10, h/2 - h/8, GF_FLUID);
+    gridfluid_fill_rect(gf, w/10, h/8, w/2 - w/10, h/4 - h/8, GF_FLUID);
+}
+
+// every interior cell fluid: all bulk, no interface
+static void scene_full(gridfluid_t gf, size_t w, size_t h) {
+    gridfluid_fill_rect(gf, 1, 1, w-2, h-2, GF_FLUID);
+}
+
+// a single small drop in an otherwise empty box
+static void scene_sparse(gridfluid_t gf, size_t w, size_t h) {
+    size_t r = w/16 ? w/16 : 1;
+    gridfluid_fill_rect(gf, w/2 - r/2, h/4, r, r, GF_FLUID);
+}
+
+static const scene_t scenes[] = {
+    { "dam", scene_dam },
+    { "shelf", scene_shelf },
+    { "full", scene_full },
+    { "sparse", scene_sparse }
+};
+
+static const char *phase_names[] = {
+    [GF_PHASE_STREAM_COLLIDE] = "stream_collide",
+    [GF_PHASE_CLEANUP] = "cleanup",
+    [GF_PHASE_PROPERTIES] = "properties",
+    [GF_PHASE_STREAM] = "stream",
+    [GF_PHASE_COLLIDE] = "collide"
+};
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return( ts.tv_sec + ts.tv_nsec * 1e-9 );
+}
+
+static void on_event(const gridfluid_event_t *ev, void *user) {
+    phase_times_t *times = user;
+    if (ev->type == GF_EVENT_PHASE)
+        times->ns[ev->phase] += ev->nanoseconds;
+}
+
+// Steps the scene, rebuilding it every ROUND_STEPS steps, and returns the
+// time spent stepping. Unfused, get_properties is called after every step
+// and the solver's phase timings are added to times.
+static double run(const scene_t *scene, size_t size, size_t threads, int inplace, size_t steps,
+                  int fused, phase_times_t *times) {
+    double total = 0;
+    while (steps) {
+        size_t n = steps < ROUND_STEPS ? steps : ROUND_STEPS;
+        gridfluid_t gf = gridfluid_create_empty_scene(size, size);
+        gridfluid_set_threads(gf, threads);
+        gridfluid_set_inplace(gf, inplace);
+        scene->build(gf, size, size);
+        // one step first so setup work is not timed
+        gridfluid_step(gf);
+        gridfluid_set_fused(gf, fused);
+        if (!fused)
+            gridfluid_set_event_callback(gf, on_event, times);
+        double t = now();
+        for (size_t s = 0; s < n; s++) {
+            gridfluid_step(gf);
+            if (!fused)
+                gridfluid_get_properties(gf);
+        }
+        total += now() - t;
+        gridfluid_free(gf);
+        steps -= n;
+    }
+    return( total );
+}
+
+static double mlups(size_t cells, size_t steps, double seconds) {
+    return( seconds > 0 ? cells * (double)steps / seconds / 1e6 : 0 );
+}
+
+static double mlups_ns(size_t cells, size_t steps, uint64_t ns) {
+    return( mlups(cells, steps, ns * 1e-9) );
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-i] [-s scene] [-m min] [-n max] [-u updates] [-t threads] [-o file]\n", prog);
+    fprintf(stderr, "scenes:");
+    for (size_t i = 0; i < sizeof(scenes)/sizeof(scenes[0]); i++)
+        fprintf(stderr, " %s", scenes[i].name);
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    const char *only = NULL;
+    const char *out = NULL;
+    size_t min_size = 64;
+    size_t max_size = 4096;
+    double updates = 1e8;
+    size_t threads = 1;
+    int inplace = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "is:m:n:u:t:o:")) != -1) {
+        switch (opt) {
+            case 'i': inplace = 1; break;
+            case 's': only = optarg; break;
+            case 'm': min_size = strtoul(optarg, NULL, 10); break;
+            case 'n': max_size = strtoul(optarg, NULL, 10); break;
+            case 'u': updates = strtod(optarg, NULL); break;
+            case 't': threads = strtoul(optarg, NULL, 10); break;
+            case 'o': out = optarg; break;
+            default: usage(argv[0]);
+        }
+    }
+    if (min_size < 16 || max_size < min_size || updates <= 0)
+        usage(argv[0]);
+
+    FILE *json = NULL;
+    if (out) {
+        json = fopen(out, "w");
+        if (!json) {
+            perror(out);
+            return 1;
+        }
+        fprintf(json, "[");
+    }
+
+    printf("df storage: %s%s\n", gridfluid_df_format(), inplace ? ", streamed in place" : "");
+    printf("%-8s %6s %6s %10s %10s %10s %10s %10s\n",
+           "scene", "size", "steps", "step", "stream", "collide", "cleanup", "props");
+    int first = 1;
+    size_t matched = 0;
+    for (size_t i = 0; i < sizeof(scenes)/sizeof(scenes[0]); i++) {
+        const scene_t *scene = &scenes[i];
+        if (only && strcmp(only, scene->name))
+            continue;
+        matched++;
+        for (size_t size = min_size; size <= max_size; size *= 2) {
+            size_t cells = size * size;
+            size_t steps = updates / cells;
+            if (steps < 2)
+                steps = 2;
+
+            phase_times_t times;
+            memset(&times, 0, sizeof(times));
+            double step_mlups = mlups(cells, steps, run(scene, size, threads, inplace, steps, 1, NULL));
+            // the same run again unfused, with the phases timed by the solver
+            run(scene, size, threads, inplace, steps, 0, &times);
+
+            printf("%-8s %6zu %6zu %10.2f %10.2f %10.2f %10.2f %10.2f\n",
+                   scene->name, size, steps, step_mlups,
+                   mlups_ns(cells, steps, times.ns[GF_PHASE_STREAM]),
+                   mlups_ns(cells, steps, times.ns[GF_PHASE_COLLIDE]),
+                   mlups_ns(cells, steps, times.ns[GF_PHASE_CLEANUP]),
+                   mlups_ns(cells, steps, times.ns[GF_PHASE_PROPERTIES]));
+            fflush(stdout);
+            if (json) {
+                fprintf(json, "%s\n  {\"scene\": \"%s\", \"width\": %zu, \"height\": %zu, "
+                        "\"threads\": %zu, \"df\": \"%s\", \"inplace\": %s, \"steps\": %zu, "
+                        "\"mlups\": {\"step\": %.3f",
+                        first ? "" : ",", scene->name, size, size, threads,
+                        gridfluid_df_format(), inplace ? "true" : "false", steps, step_mlups);
+                for (int p = GF_PHASE_CLEANUP; p <= GF_PHASE_COLLIDE; p++) {
+                    fprintf(json, ", \"%s\": %.3f", phase_names[p],
+                            mlups_ns(cells, steps, times.ns[p]));
+                }
+                fprintf(json, "}}");
+                first = 0;
+            }
+        }
+    }
+    if (json) {
+        fprintf(json, "\n]\n");
+        fclose(json);
+    }
+    if (!matched)
+        usage(argv[0]);
+    return 0;
+}
@@ -0,0 +1,834 @@
+// Consistency checks for make check.
+//
+// Steps the interactive demo's scene every way the solver can walk it, on
+// each side setting, and checks each run comes out bit for bit as the
+// plain one: scalar, one thread, fused, untiled, two lattices. Between them
+// the variants take every collide kernel, the bulk kernels, the worklist
+// cleanup and the neighbour masks. The plain run also checks after every
+// step that the cleanup left no fluid cell next to an empty one, and at
+// the end that its mass drifted no further than the storage format allows.
+//
+// The other checks each hold one part of the library to a plain use of it:
+//     ring          items pushed on one thread come off another once each,
+//                   in order, and a full or empty ring refuses
+//     triple        items published on one thread and taken on another
+//                   never tear or go back, and the last one gets through
+//     pnm           images of each Netpbm format read back as the masks
+//                   they draw, and malformed ones are refused with EINVAL
+//     ensemble      scenes stepped together, and rebatched halfway, end as
+//                   the plain run does
+//     partition     the plain run split over 2 and 3 processes ends as it
+//                   does in each one's rows, and none of them saves
+//     checkpoint    the plain run saved halfway, loaded and stepped on
+//                   ends as the uninterrupted run does
+//     sleep         the plain run with a sleep threshold of 0 ends as it
+//                   does, and a tank at rest sleeps until edited
+//     recording     frames read back from a recording, in order and by
+//                   seeking, are the snapshots recorded, as quantized
+//     fold          max_velocity over steps that fill cells, with another
+//                   gravity put on between collide and cleanup, is the
+//                   plain run's
+//
+//     gfcheck [-n steps]
+//
+// Prints a line per check and exits 1 if any failed. Files go to $TMPDIR,
+// or /tmp. make check builds the tool for fp32, fp16 and bf16 storage and
+// runs each.
+
+#define _POSIX_C_SOURCE 200809L
+#include "gridfluid.h"
+#include "gfpnm.h"
+#include "gfrec.h"
+#include "gfring.h"
+#include "gftriple.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/wait.h>
+
+#define SCENE_X 40
+#define SCENE_Y 20
+// items the checks handing items between threads pass over
+#define HANDOFF_ITEMS 1000000
+// relative mass drift allowed: some for the splash the run starts with,
+// then some per step, as the free surface scheme gains a little mass as it
+// goes; the 16-bit formats round the distributions the exchange between
+// cells is computed from
+#define DRIFT_START 5e-3
+#define DRIFT_FP32 5e-5
+#define DRIFT_16BIT 1e-4
+
+typedef struct variant {
+    const char *name;
+    gridfluid_simd simd;
+    size_t threads;
+    size_t tile_x;
+    size_t tile_y;
+    int unfused;
+    int inplace;
+    // built with gridfluid_fill_rect instead of the setters
+    int bulk;
+} variant_t;
+
+static const variant_t variants[] = {
+    { "sse2",                    GF_SIMD_SSE2,   1, 0,  0, 0, 0, 0 },
+    { "avx2",                    GF_SIMD_AVX2,   1, 0,  0, 0, 0, 0 },
+    { "avx512",                  GF_SIMD_AVX512, 1, 0,  0, 0, 0, 0 },
+    { "unfused",                 GF_SIMD_SCALAR, 1, 0,  0, 1, 0, 0 },
+    { "tiled 8x4",               GF_SIMD_SCALAR, 1, 8,  4, 0, 0, 0 },
+    { "tiled 16x16",             GF_SIMD_AUTO,   1, 16, 16, 0, 0, 0 },
+    { "in place",                GF_SIMD_SCALAR, 1, 0,  0, 0, 1, 0 },
+    { "in place, unfused",       GF_SIMD_AUTO,   1, 0,  0, 1, 1, 0 },
+    { "2 threads",               GF_SIMD_SCALAR, 2, 0,  0, 0, 0, 0 },
+    { "3 threads",               GF_SIMD_AUTO,   3, 0,  0, 0, 0, 0 },
+    { "4 threads, tiled",        GF_SIMD_AUTO,   4, 8,  4, 0, 0, 0 },
+    { "3 threads, in place",     GF_SIMD_AUTO,   3, 0,  0, 0, 1, 0 },
+    { "3 threads, unfused",      GF_SIMD_AUTO,   3, 0,  0, 1, 0, 0 },
+    { "bulk edits",              GF_SIMD_SCALAR, 1, 0,  0, 0, 0, 1 },
+    { "bulk edits, 2 threads",   GF_SIMD_AUTO,   2, 8,  4, 0, 1, 1 },
+};
+
+static const char *sides[] = { "wwww", "ppww", "oowo" };
+
+static int failures;
+
+static void report(const char *what, const char *detail, int ok) {
+    printf("%-4s %s%s%s\n", ok ? "ok" : "FAIL", what, detail ? ": " : "", detail ? detail : "");
+    if (!ok)
+        failures++;
+}
+
+static void set_sides(gridfluid_t gf, const char *letters) {
+    static const char types[] = "wpo";
+    for (size_t i = 0; i < 4; i++) {
+        gridfluid_set_boundary(gf, i, strchr(types, letters[i]) - types);
+    }
+}
+
+// Fills the part of a block of the domain that falls on the scene, whose
+// row 0 is row origin of the domain.
+static void demo_rect(gridfluid_t gf, size_t origin, size_t x, size_t y, size_t w, size_t h, gridfluid_state state) {
+    size_t rows = gridfluid_get_properties(gf)->y;
+    size_t y0 = y > origin ? y : origin;
+    size_t y1 = y + h < origin + rows ? y + h : origin + rows;
+    if (y0 < y1)
+        gridfluid_fill_rect(gf, x, y0 - origin, w, y1 - y0, state);
+}
+
+// The demo scene's settings and blocks, for a scene holding the domain's
+// rows from origin on.
+static void demo_blocks(gridfluid_t gf, const char *letters, size_t origin) {
+    set_sides(gf, letters);
+    gridfluid_set_gravity(gf, 0.01);
+    demo_rect(gf, origin, 9, 12, 31, 1, GF_OBSTACLE);
+    demo_rect(gf, origin, 4, 3, 3, 7, GF_FLUID);
+    demo_rect(gf, origin, 4, 3, 16, 2, GF_FLUID);
+}
+
+// The scene of test.c, cell by cell or in blocks.
+static gridfluid_t demo_scene(const char *letters, int bulk) {
+    gridfluid_t gf = gridfluid_create_empty_scene(SCENE_X, SCENE_Y);
+    if (!gf)
+        abort();
+    if (bulk) {
+        demo_blocks(gf, letters, 0);
+        return( gf );
+    }
+    set_sides(gf, letters);
+    gridfluid_set_gravity(gf, 0.01);
+    for (size_t x = 9; x < 40; x++) {
+        gridfluid_set_obstacle(gf, x, 12);
+    }
+    for (size_t y = 3; y < 10; y++) {
+        for (size_t x = 4; x < 7; x++) {
+            gridfluid_set_fluid(gf, x, y);
+        }
+    }
+    for (size_t y = 3; y < 5; y++) {
+        for (size_t x = 4; x < 20; x++) {
+            gridfluid_set_fluid(gf, x, y);
+        }
+    }
+    return( gf );
+}
+
+// Returns NULL, with the reason in why, if rows [y0, y1) of a differ from
+// rows origin + y of b in any cell type, or in the pressure or mass of a
+// fluid or interface cell. Cells are named by their row in b.
+static const char *compare_rows(gridfluid_t a, gridfluid_t b, size_t y0, size_t y1, size_t origin, char *why, size_t len) {
+    gridfluid_properties_t *pa = gridfluid_get_properties(a);
+    gridfluid_properties_t *pb = gridfluid_get_properties(b);
+    for (size_t y = y0; y < y1; y++) {
+        for (size_t x = 0; x < pa->x; x++) {
+            uint8_t type = gridfluid_get_type(a, x, y);
+            size_t i = x + y*pa->x;
+            size_t j = x + (origin + y)*pb->x;
+            const char *what = NULL;
+            if (type != gridfluid_get_type(b, x, origin + y))
+                what = "type";
+            else if ((type == GF_FLUID || type == GF_INTERFACE)
+                     && memcmp(&pa->pressure[i], &pb->pressure[j], sizeof(float)))
+                what = "pressure";
+            else if ((type == GF_FLUID || type == GF_INTERFACE)
+                     && memcmp(&pa->mass[i], &pb->mass[j], sizeof(float)))
+                what = "mass";
+            if (what) {
+                snprintf(why, len, "%s of cell (%zu, %zu)", what, x, origin + y);
+                return( why );
+            }
+        }
+    }
+    return( NULL );
+}
+
+// Returns NULL, with the reason in why, if a and b differ in any cell type,
+// in the pressure or mass of a fluid or interface cell, in the step count
+// or in the diagnostics. total_mass is a float sum that tiles and bands
+// add up in their own order, so it only has to agree to rounding.
+static const char *compare(gridfluid_t a, gridfluid_t b, char *why, size_t len) {
+    gridfluid_properties_t *pa = gridfluid_get_properties(a);
+    gridfluid_properties_t *pb = gridfluid_get_properties(b);
+    if (pa->x != pb->x || pa->y != pb->y)
+        return( "scene size" );
+    if (gridfluid_get_step(a) != gridfluid_get_step(b))
+        return( "step count" );
+    const char *diff = compare_rows(a, b, 0, pa->y, 0, why, len);
+    if (diff)
+        return( diff );
+    if (fabsf(pa->total_mass - pb->total_mass) > 1e-5 * fabsf(pb->total_mass)
+        || memcmp(&pa->min_pressure, &pb->min_pressure, sizeof(float))
+        || memcmp(&pa->max_pressure, &pb->max_pressure, sizeof(float))
+        || memcmp(&pa->max_velocity, &pb->max_velocity, sizeof(float)))
+        return( "diagnostics" );
+    return( NULL );
+}
+
+// Where the neighbour at c + d of a row or column of n cells lies, across
+// a periodic side; the ghost copies are only refreshed by the next step.
+// Returns 0 for a ghost cell of any other side.
+static int neighbour(size_t c, int d, size_t n, int periodic, size_t *to) {
+    size_t k = c + d;
+    if (k == 0 || k == n-1) {
+        if (!periodic)
+            return( 0 );
+        k = k ? 1 : n-2;
+    }
+    *to = k;
+    return( 1 );
+}
+
+// Returns 0 if a fluid cell has an empty one among its eight neighbours,
+// which the cleanup after each step must turn into interface cells.
+static int surface_closed(gridfluid_t gf) {
+    gridfluid_properties_t *props = gridfluid_get_properties(gf);
+    int wrap_x = gridfluid_get_boundary(gf, GF_SIDE_LEFT) == GF_BOUNDARY_PERIODIC;
+    int wrap_y = gridfluid_get_boundary(gf, GF_SIDE_TOP) == GF_BOUNDARY_PERIODIC;
+    for (size_t y = 1; y+1 < props->y; y++) {
+        for (size_t x = 1; x+1 < props->x; x++) {
+            if (gridfluid_get_type(gf, x, y) != GF_FLUID)
+                continue;
+            for (int dy = -1; dy <= 1; dy++) {
+                for (int dx = -1; dx <= 1; dx++) {
+                    size_t nx, ny;
+                    if (neighbour(x, dx, props->x, wrap_x, &nx) && neighbour(y, dy, props->y, wrap_y, &ny)
+                        && gridfluid_get_type(gf, nx, ny) == GF_EMPTY)
+                        return( 0 );
+                }
+            }
+        }
+    }
+    return( 1 );
+}
+
+// Sums the mass of the fluid and interface cells; total_mass in the
+// properties reads zero before the first step.
+static double scene_mass(gridfluid_t gf) {
+    gridfluid_properties_t *props = gridfluid_get_properties(gf);
+    double mass = 0;
+    for (size_t y = 0; y < props->y; y++) {
+        for (size_t x = 0; x < props->x; x++) {
+            uint8_t type = gridfluid_get_type(gf, x, y);
+            if (type == GF_FLUID || type == GF_INTERFACE)
+                mass += props->mass[x + y*props->x];
+        }
+    }
+    return( mass );
+}
+
+static void check_variants(const char *letters, gridfluid_t ref, unsigned long steps) {
+    char what[128];
+    char why[128];
+    for (size_t v = 0; v < sizeof(variants) / sizeof(variants[0]); v++) {
+        const variant_t *var = &variants[v];
+        snprintf(what, sizeof(what), "%s %s", letters, var->name);
+        gridfluid_t gf = demo_scene(letters, var->bulk);
+        if (!gridfluid_set_simd(gf, var->simd)) {
+            printf("%-4s %s: not supported here\n", "skip", what);
+            gridfluid_free(gf);
+            continue;
+        }
+        if (!gridfluid_set_threads(gf, var->threads))
+            abort();
+        gridfluid_set_tiling(gf, var->tile_x, var->tile_y);
+        gridfluid_set_fused(gf, !var->unfused);
+        gridfluid_set_inplace(gf, var->inplace);
+        for (unsigned long s = 0; s < steps; s++) {
+            gridfluid_step(gf);
+        }
+        const char *diff = compare(gf, ref, why, sizeof(why));
+        report(what, diff, !diff);
+        gridfluid_free(gf);
+    }
+}
+
+static void check_ensemble(const char *letters, gridfluid_t ref, unsigned long steps) {
+    char what[128];
+    char why[128];
+    snprintf(what, sizeof(what), "%s ensemble", letters);
+    gridfluid_ensemble_t ens = gridfluid_ensemble_create(3);
+    if (!ens)
+        abort();
+    // a scene of another shape shares the batches
+    for (size_t i = 0; i < 7; i++) {
+        gridfluid_t gf = i == 3 ? gridfluid_create_empty_scene(SCENE_Y, SCENE_X) : demo_scene(letters, 0);
+        if (!gf || !gridfluid_ensemble_add(ens, gf))
+            abort();
+    }
+    // stepped in two goes so the scenes are rebatched and moved in between
+    gridfluid_ensemble_step(ens, steps / 2);
+    if (!gridfluid_ensemble_add(ens, demo_scene(letters, 0)))
+        abort();
+    gridfluid_ensemble_step(ens, steps - steps / 2);
+    const char *diff = NULL;
+    for (size_t i = 0; i < 7 && !diff; i++) {
+        if (i != 3)
+            diff = compare(gridfluid_ensemble_scene(ens, i), ref, why, sizeof(why));
+    }
+    report(what, diff, !diff);
+    gridfluid_ensemble_free(ens);
+}
+
+// Between a scene's collide and its cleanup, puts a gravity on it that the
+// collide never saw, and counts the cells that fill.
+typedef struct fold_watch {
+    gridfluid_t gf;
+    size_t filled;
+} fold_watch_t;
+
+static void fold_event(const gridfluid_event_t *event, void *user) {
+    fold_watch_t *watch = user;
+    if (event->type == GF_EVENT_FILLED)
+        watch->filled++;
+    else if (event->type == GF_EVENT_PHASE && event->phase == GF_PHASE_STREAM_COLLIDE)
+        gridfluid_set_gravity(watch->gf, 1);
+}
+
+// max_velocity leaves the gravity forcing out, for the cells the cleanup
+// adds as for the ones the sweep collided, so what gravity the cleanup
+// sees may not show in it.
+static void check_fold(const char *letters, unsigned long steps) {
+    char what[128];
+    char why[128];
+    snprintf(what, sizeof(what), "%s max_velocity across fills", letters);
+    gridfluid_t ref = demo_scene(letters, 0);
+    gridfluid_t gf = demo_scene(letters, 0);
+    fold_watch_t watch = { gf, 0 };
+    gridfluid_set_event_callback(gf, fold_event, &watch);
+    const char *diff = NULL;
+    for (unsigned long s = 0; s < steps && !diff; s++) {
+        gridfluid_step(ref);
+        gridfluid_step(gf);
+        diff = compare(gf, ref, why, sizeof(why));
+        gridfluid_set_gravity(gf, gridfluid_get_properties(ref)->gravity);
+    }
+    if (!diff && !watch.filled)
+        diff = "no cell filled";
+    report(what, diff, !diff);
+    gridfluid_free(gf);
+    gridfluid_free(ref);
+}
+
+// A threshold of 0 keeps every tile awake, whatever the steps.
+static void check_sleep_off(const char *letters, gridfluid_t ref, unsigned long steps) {
+    char what[128];
+    char why[128];
+    snprintf(what, sizeof(what), "%s sleep with threshold 0", letters);
+    gridfluid_t gf = demo_scene(letters, 0);
+    gridfluid_set_sleep(gf, 0, 16);
+    for (unsigned long s = 0; s < steps; s++) {
+        gridfluid_step(gf);
+    }
+    const char *diff = compare(gf, ref, why, sizeof(why));
+    report(what, diff, !diff);
+    gridfluid_free(gf);
+}
+
+// A tank closed by a lid under empty air, without gravity, over several
+// tiles each way: nothing in it moves, so once the tiles have been still
+// long enough they sleep, and an edit wakes them.
+static void check_sleep_rest(void) {
+    const char *what = "sleep at rest";
+    char detail[64];
+    gridfluid_t gf = gridfluid_create_empty_scene(130, 98);
+    if (!gf)
+        abort();
+    gridfluid_set_gravity(gf, 0);
+    gridfluid_fill_rect(gf, 1, 49, 128, 1, GF_OBSTACLE);
+    gridfluid_fill_rect(gf, 1, 50, 128, 47, GF_FLUID);
+    gridfluid_set_sleep(gf, 1e-4, 8);
+    size_t area = gridfluid_get_awake(gf);
+    for (size_t s = 0; s < 40; s++) {
+        gridfluid_step(gf);
+    }
+    size_t awake = gridfluid_get_awake(gf);
+    gridfluid_set_empty(gf, 1, 1);
+    size_t woken = gridfluid_get_awake(gf);
+    snprintf(detail, sizeof(detail), "%zu of %zu cells awake, %zu after an edit", awake, area, woken);
+    report(what, detail, awake < area && woken == area);
+    gridfluid_free(gf);
+}
+
+// A file of this run's to scribble on, named after what it holds.
+static void tmp_path(char *path, size_t len, const char *what) {
+    const char *dir = getenv("TMPDIR");
+    snprintf(path, len, "%s/gfcheck-%ld.%s", dir ? dir : "/tmp", (long)getpid(), what);
+}
+
+// One rank of the demo scene split over nranks processes: builds its strip,
+// checks it cannot be saved, steps it and compares the rows it owns with
+// the same rows of ref. Returns NULL or the reason.
+static const char *partition_rank(const char *letters, gridfluid_t ref, unsigned long steps, const char *name, size_t rank, size_t nranks, char *why, size_t len) {
+    size_t origin, y0, y1;
+    gridfluid_t gf = gridfluid_create_partition(SCENE_X, SCENE_Y, name, rank, nranks);
+    if (!gf) {
+        snprintf(why, len, "create: %s", strerror(errno));
+        return( why );
+    }
+    gridfluid_get_partition(gf, &origin, &y0, &y1);
+    demo_blocks(gf, letters, origin);
+    char path[4096];
+    tmp_path(path, sizeof(path), "part");
+    errno = 0;
+    if (gridfluid_save(gf, path) || errno != EINVAL) {
+        unlink(path);
+        return( "saved" );
+    }
+    for (unsigned long s = 0; s < steps; s++) {
+        gridfluid_step(gf);
+    }
+    if (gridfluid_get_step(gf) != gridfluid_get_step(ref))
+        return( "step count" );
+    return( compare_rows(gf, ref, y0, y1, origin, why, len) );
+}
+
+// Each rank runs in a process of its own and writes why it failed to a
+// pipe; a line that short goes through whole.
+static void check_partition(const char *letters, gridfluid_t ref, unsigned long steps, size_t nranks) {
+    char what[128];
+    char name[64];
+    char detail[128] = "";
+    int fds[2];
+    snprintf(what, sizeof(what), "%s %zu ranks", letters, nranks);
+    snprintf(name, sizeof(name), "/gfcheck-%ld-%zu", (long)getpid(), nranks);
+    if (pipe(fds))
+        abort();
+    fflush(stdout);
+    for (size_t r = 0; r < nranks; r++) {
+        pid_t pid = fork();
+        if (pid < 0)
+            abort();
+        if (pid)
+            continue;
+        char why[128];
+        char line[160];
+        close(fds[0]);
+        const char *diff = partition_rank(letters, ref, steps, name, r, nranks, why, sizeof(why));
+        if (!diff)
+            _exit(0);
+        int n = snprintf(line, sizeof(line), "rank %zu: %s\n", r, diff);
+        if (write(fds[1], line, n) < 0)
+            _exit(2);
+        _exit(1);
+    }
+    close(fds[1]);
+    int ok = 1;
+    int status;
+    while (wait(&status) > 0) {
+        ok = ok && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    }
+    ssize_t n = read(fds[0], detail, sizeof(detail) - 1);
+    close(fds[0]);
+    detail[n > 0 ? n : 0] = 0;
+    detail[strcspn(detail, "\n")] = 0;
+    report(what, ok ? NULL : detail[0] ? detail : "a rank died", ok);
+}
+
+static void check_checkpoint(const char *letters, gridfluid_t ref, unsigned long steps, const char *path) {
+    char what[128];
+    char why[128];
+    snprintf(what, sizeof(what), "%s save, load and step on", letters);
+    gridfluid_t gf = demo_scene(letters, 0);
+    for (unsigned long s = 0; s < steps / 2; s++) {
+        gridfluid_step(gf);
+    }
+    if (!gridfluid_save(gf, path)) {
+        perror(path);
+        report(what, "save failed", 0);
+        gridfluid_free(gf);
+        return;
+    }
+    gridfluid_free(gf);
+    gf = gridfluid_load(path);
+    unlink(path);
+    if (!gf) {
+        perror(path);
+        report(what, "load failed", 0);
+        return;
+    }
+    for (unsigned long s = steps / 2; s < steps; s++) {
+        gridfluid_step(gf);
+    }
+    const char *diff = compare(gf, ref, why, sizeof(why));
+    report(what, diff, !diff);
+    gridfluid_free(gf);
+}
+
+// What the recording should give back for a value of a fluid or interface
+// cell, as gfrec.c quantizes it.
+static float recorded(float v) {
+    float q = roundf(v * GFREC_SCALE);
+    if (q > INT16_MAX)
+        q = INT16_MAX;
+    if (q < INT16_MIN)
+        q = INT16_MIN;
+    if (q != q)
+        q = 0;
+    return( (int16_t)q / (float)GFREC_SCALE );
+}
+
+typedef struct frame_copy {
+    uint64_t step;
+    float max_velocity;
+    uint8_t flags[SCENE_X*SCENE_Y];
+    float pressure[SCENE_X*SCENE_Y];
+    float mass[SCENE_X*SCENE_Y];
+} frame_copy_t;
+
+static int frame_matches(const gfrec_frame_t *frame, const frame_copy_t *want) {
+    if (!frame || frame->step != want->step || frame->max_velocity != want->max_velocity)
+        return( 0 );
+    for (size_t i = 0; i < SCENE_X*SCENE_Y; i++) {
+        if (frame->flags[i] != want->flags[i] || frame->pressure[i] != want->pressure[i]
+            || frame->mass[i] != want->mass[i])
+            return( 0 );
+    }
+    return( 1 );
+}
+
+static void check_recording(unsigned long steps, const char *path) {
+    const char *what = "recording read back";
+    frame_copy_t *want = calloc(steps, sizeof(frame_copy_t));
+    if (!want)
+        abort();
+    gridfluid_t gf = demo_scene("wwww", 0);
+    gfrec_t rec = gfrec_open(path, SCENE_X, SCENE_Y);
+    if (!rec) {
+        perror(path);
+        report(what, "open failed", 0);
+        free(want);
+        gridfluid_free(gf);
+        return;
+    }
+    // a snapshot the writer had no room for is dropped, not recorded
+    size_t frames = 0;
+    for (unsigned long s = 0; s < steps; s++) {
+        gridfluid_step(gf);
+        if (!gfrec_record(rec, gf))
+            continue;
+        gridfluid_properties_t *props = gridfluid_get_properties(gf);
+        frame_copy_t *copy = &want[frames++];
+        copy->step = gridfluid_get_step(gf);
+        copy->max_velocity = props->max_velocity;
+        for (size_t i = 0; i < SCENE_X*SCENE_Y; i++) {
+            uint8_t type = gridfluid_get_type(gf, i % SCENE_X, i / SCENE_X);
+            int live = type == GF_FLUID || type == GF_INTERFACE;
+            copy->flags[i] = type;
+            copy->pressure[i] = live ? recorded(props->pressure[i]) : 0;
+            copy->mass[i] = live ? recorded(props->mass[i]) : 0;
+        }
+    }
+    gridfluid_free(gf);
+    int ok = gfrec_close(rec);
+    gfrec_reader_t rd = ok ? gfrec_reader_open(path) : NULL;
+    unlink(path);
+    const char *diff = NULL;
+    if (!rd) {
+        diff = "reopen failed";
+    } else if (gfrec_reader_x(rd) != SCENE_X || gfrec_reader_y(rd) != SCENE_Y
+               || gfrec_reader_frames(rd) != frames) {
+        diff = "header or frame count";
+    } else {
+        // in order, then jumps back and forth across keyframes
+        for (size_t f = 0; f < frames && !diff; f++) {
+            if (!frame_matches(gfrec_reader_seek(rd, f), &want[f]))
+                diff = "frame read in order";
+        }
+        for (size_t k = 0; k < 64 && frames && !diff; k++) {
+            size_t f = (k * 7919 + k * k * 31) % frames;
+            if (!frame_matches(gfrec_reader_seek(rd, f), &want[f]))
+                diff = "frame read by seeking";
+        }
+        if (!diff && gfrec_reader_seek(rd, frames))
+            diff = "frame past the end";
+    }
+    report(what, diff, !diff);
+    gfrec_reader_close(rd);
+    free(want);
+}
+
+typedef struct handoff {
+    gfring_t ring;
+    gftriple_t triple;
+} handoff_t;
+
+static void *ring_producer(void *arg) {
+    handoff_t *h = arg;
+    for (uint64_t i = 1; i <= HANDOFF_ITEMS; i++) {
+        while (!gfring_push(h->ring, &i))
+            sched_yield();
+    }
+    return NULL;
+}
+
+static void check_ring(void) {
+    const char *what = "ring";
+    const char *diff = NULL;
+    handoff_t h;
+    uint64_t item;
+    // capacity is rounded up to a power of two
+    h.ring = gfring_create(sizeof(uint64_t), 5);
+    if (!h.ring)
+        abort();
+    for (uint64_t i = 0; i < 8 && !diff; i++) {
+        if (!gfring_push(h.ring, &i))
+            diff = "push before full";
+    }
+    if (!diff && gfring_push(h.ring, &item))
+        diff = "push when full";
+    for (uint64_t i = 0; i < 8 && !diff; i++) {
+        if (!gfring_pop(h.ring, &item) || item != i)
+            diff = "pop in order";
+    }
+    if (!diff && gfring_pop(h.ring, &item))
+        diff = "pop when empty";
+    gfring_free(h.ring);
+
+    h.ring = gfring_create(sizeof(uint64_t), 64);
+    pthread_t producer;
+    if (!h.ring || pthread_create(&producer, NULL, ring_producer, &h))
+        abort();
+    for (uint64_t want = 1; want <= HANDOFF_ITEMS; ) {
+        if (!gfring_pop(h.ring, &item)) {
+            sched_yield();
+            continue;
+        }
+        if (item != want && !diff)
+            diff = "item across threads lost or out of order";
+        want++;
+    }
+    pthread_join(producer, NULL);
+    gfring_free(h.ring);
+    report(what, diff, !diff);
+}
+
+// Both halves of an item are written apart, so a torn one shows.
+typedef struct triple_item {
+    uint64_t a;
+    char pad[256];
+    uint64_t b;
+} triple_item_t;
+
+static void *triple_producer(void *arg) {
+    handoff_t *h = arg;
+    for (uint64_t i = 1; i <= HANDOFF_ITEMS; i++) {
+        triple_item_t *item = gftriple_back(h->triple);
+        item->a = i;
+        item->b = i;
+        gftriple_publish(h->triple);
+    }
+    return NULL;
+}
+
+static void check_triple(void) {
+    const char *what = "triple buffer";
+    const char *diff = NULL;
+    triple_item_t items[3];
+    memset(items, 0, sizeof(items));
+    handoff_t h;
+    h.triple = gftriple_create(&items[0], &items[1], &items[2]);
+    if (!h.triple)
+        abort();
+    if (gftriple_unread(h.triple) || gftriple_latest(h.triple) != &items[2])
+        diff = "state before the first publish";
+    pthread_t producer;
+    if (pthread_create(&producer, NULL, triple_producer, &h))
+        abort();
+    // the consumer may skip items, but never goes back or sees one torn
+    uint64_t seen = 0;
+    while (seen < HANDOFF_ITEMS) {
+        const triple_item_t *item = gftriple_latest(h.triple);
+        if ((item->a != item->b || item->a < seen) && !diff)
+            diff = "item torn or older than one already taken";
+        seen = item->a;
+    }
+    pthread_join(producer, NULL);
+    if (!diff && gftriple_unread(h.triple))
+        diff = "last item still unread after it was taken";
+    gftriple_free(h.triple);
+    report(what, diff, !diff);
+}
+
+// An image's bytes and the mask gfpnm_read should make of it, a letter a
+// cell: o for obstacle, f for fluid, e for empty. A NULL mask means the
+// image must be refused.
+typedef struct pnm_case {
+    const char *name;
+    const char *data;
+    size_t len;
+    size_t w;
+    size_t h;
+    const char *mask;
+} pnm_case_t;
+
+#define PNM_CASE(name, data, w, h, mask) { name, data, sizeof(data) - 1, w, h, mask }
+
+static const pnm_case_t pnm_cases[] = {
+    PNM_CASE("P1", "P1\n# a comment\n4 3\n1 0 0 1\n0 1 1 0\n1111\n", 4, 3, "oeeoeooeoooo"),
+    PNM_CASE("P2", "P2 4 3 9\n0 3 6 9\n9 6 3 0\n2 4 7 8\n", 4, 3, "ofeeeefoofee"),
+    PNM_CASE("P4", "P4\n4 3\n\x90\x60\xf0", 4, 3, "oeeoeooeoooo"),
+    PNM_CASE("P5", "P5\n4 3\n255\n\x00\x55\xaa\xff\xff\xaa\x55\x00\x54\x56\xa9\xab", 4, 3, "ofeeeefooffe"),
+    PNM_CASE("16-bit P5", "P5\n3 3\n1000\n\x00\x00\x01\x4d\x01\x4e\x02\x9a\x02\x9b\x03\xe8\x00\x00\x00\x00\x00\x00", 3, 3, "ooffeeooo"),
+    PNM_CASE("empty file", "", 0, 0, NULL),
+    PNM_CASE("P3", "P3\n3 3\n255\n0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0\n", 0, 0, NULL),
+    PNM_CASE("no height", "P1\n4\n", 0, 0, NULL),
+    PNM_CASE("2x2", "P1\n2 2\n1 0 0 1\n", 0, 0, NULL),
+    PNM_CASE("maxval 0", "P2\n3 3\n0\n0 0 0 0 0 0 0 0 0\n", 0, 0, NULL),
+    PNM_CASE("grey over maxval", "P2\n3 3\n9\n0 0 0 0 10 0 0 0 0\n", 0, 0, NULL),
+    PNM_CASE("header cut short", "P4\n4 3", 0, 0, NULL),
+    PNM_CASE("pixels cut short", "P5\n4 3\n255\n\x00\x00", 0, 0, NULL),
+    PNM_CASE("size overflows", "P4\n99999999999999999999 3\n", 0, 0, NULL),
+};
+
+// Each image in pnm_cases written out and read back.
+static void check_pnm(const char *path) {
+    char what[128];
+    char detail[64];
+    for (size_t i = 0; i < sizeof(pnm_cases) / sizeof(pnm_cases[0]); i++) {
+        const pnm_case_t *c = &pnm_cases[i];
+        snprintf(what, sizeof(what), "pnm %s", c->name);
+        FILE *f = fopen(path, "wb");
+        if (!f || fwrite(c->data, 1, c->len, f) != c->len || fclose(f)) {
+            perror(path);
+            report(what, "write failed", 0);
+            continue;
+        }
+        size_t w = 0;
+        size_t h = 0;
+        errno = 0;
+        uint8_t *mask = gfpnm_read(path, &w, &h);
+        int err = errno;
+        unlink(path);
+        const char *diff = NULL;
+        if (!c->mask) {
+            if (mask)
+                diff = "read";
+            else if (err != EINVAL)
+                diff = strerror(err);
+        } else if (!mask) {
+            diff = strerror(err);
+        } else if (w != c->w || h != c->h) {
+            diff = "size";
+        } else {
+            for (size_t k = 0; k < w*h && !diff; k++) {
+                uint8_t want = c->mask[k] == 'o' ? GF_OBSTACLE : c->mask[k] == 'f' ? GF_FLUID : GF_EMPTY;
+                if (mask[k] != want) {
+                    snprintf(detail, sizeof(detail), "cell (%zu, %zu)", k % w, k / w);
+                    diff = detail;
+                }
+            }
+        }
+        free(mask);
+        report(what, diff, !diff);
+    }
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-n steps]\n", prog);
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    unsigned long steps = 300;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        switch (opt) {
+            case 'n': steps = strtoul(optarg, NULL, 10); break;
+            default: usage(argv[0]);
+        }
+    }
+    if (optind != argc || steps < 2)
+        usage(argv[0]);
+    char ckpt[4096];
+    char recording[4096];
+    char image[4096];
+    tmp_path(ckpt, sizeof(ckpt), "ckpt");
+    tmp_path(recording, sizeof(recording), "rec");
+    tmp_path(image, sizeof(image), "pnm");
+    printf("# df %s, demo scene, %lu steps\n", gridfluid_df_format(), steps);
+
+    for (size_t i = 0; i < sizeof(sides) / sizeof(sides[0]); i++) {
+        char what[128];
+        gridfluid_t ref = demo_scene(sides[i], 0);
+        if (!gridfluid_set_simd(ref, GF_SIMD_SCALAR))
+            abort();
+        double mass0 = scene_mass(ref);
+        int closed = 1;
+        for (unsigned long s = 0; s < steps; s++) {
+            gridfluid_step(ref);
+            closed = closed && surface_closed(ref);
+        }
+        snprintf(what, sizeof(what), "%s surface closed after every step", sides[i]);
+        report(what, NULL, closed);
+        // open sides let mass out, so only the closed scenes must keep it
+        if (!strchr(sides[i], 'o')) {
+            double bound = DRIFT_START + steps * (strcmp(gridfluid_df_format(), "fp32") ? DRIFT_16BIT : DRIFT_FP32);
+            double drift = fabs(scene_mass(ref) - mass0) / mass0;
+            char detail[64];
+            snprintf(detail, sizeof(detail), "%.3e, bound %.3e", drift, bound);
+            snprintf(what, sizeof(what), "%s mass drift", sides[i]);
+            report(what, detail, drift <= bound);
+        }
+        check_variants(sides[i], ref, steps);
+        check_ensemble(sides[i], ref, steps);
+        check_partition(sides[i], ref, steps, 2);
+        check_partition(sides[i], ref, steps, 3);
+        check_checkpoint(sides[i], ref, steps, ckpt);
+        check_sleep_off(sides[i], ref, steps);
+        check_fold(sides[i], steps);
+        gridfluid_free(ref);
+    }
+
+    check_sleep_rest();
+    check_recording(steps, recording);
+    check_ring();
+    check_triple();
+    check_pnm(image);
+
+    if (failures)
+        printf("%d check%s failed\n", failures, failures == 1 ? "" : "s");
+    return( failures ? 1 : 0 );
+}
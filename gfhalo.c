@@ -0,0 +1,252 @@
+#define _DEFAULT_SOURCE
+#include "gfhalo.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+// waits this many times round a loop before sleeping: a neighbour that is
+// nearly done is cheaper to spin for than to be woken by
+#define GFHALO_SPIN 1000
+
+// how long a wait sleeps before checking the neighbour is still alive
+#define GFHALO_CHECK_SECONDS 1
+
+// how long the other ranks look for rank 0's object before giving up, and
+// how often
+#define GFHALO_OPEN_SECONDS 60
+#define GFHALO_OPEN_NAP_MS 1
+
+// seq counts the messages sent and ack those taken; both only grow, and a
+// channel is full while they differ
+typedef struct gfhalo_channel {
+    uint32_t seq __attribute__((aligned(64)));
+    uint32_t ack __attribute__((aligned(64)));
+} gfhalo_channel_t;
+
+// The object: this header, the pid of every rank, then for boundary b
+// (between ranks b and b+1) the channel down from b and the one up from
+// b+1, each followed by its message buffer.
+typedef struct gfhalo_header {
+    uint32_t attached __attribute__((aligned(64)));
+    // set by rank 0 once the object is sized and its pid recorded
+    uint32_t ready;
+} gfhalo_header_t;
+
+struct gfhalo {
+    char *base;
+    size_t size;
+    size_t rank;
+    size_t nranks;
+    // offset of the first channel and the distance between channels
+    size_t channels;
+    size_t stride;
+    int32_t *pids;
+    // messages this rank sent and took, per direction
+    uint32_t sent[2];
+    uint32_t taken[2];
+};
+
+static void futex_wait(uint32_t *word, uint32_t value) {
+#ifdef __linux__
+    struct timespec timeout = { GFHALO_CHECK_SECONDS, 0 };
+    syscall(SYS_futex, word, FUTEX_WAIT, value, &timeout, NULL, 0);
+#else
+    (void)word;
+    (void)value;
+    sched_yield();
+#endif
+}
+
+static void futex_wake(uint32_t *word) {
+#ifdef __linux__
+    syscall(SYS_futex, word, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0);
+#else
+    (void)word;
+#endif
+}
+
+// Returns once *word no longer holds value. Only the neighbour in dir can
+// change it; should that have died, so does this process, rather than wait
+// for it forever.
+static void wait_change(gfhalo_t halo, int dir, uint32_t *word, uint32_t value) {
+    for (int i = 0; i < GFHALO_SPIN; i++) {
+        if (__atomic_load_n(word, __ATOMIC_ACQUIRE) != value)
+            return;
+    }
+    size_t neighbour = dir == GFHALO_DOWN ? halo->rank + 1 : halo->rank - 1;
+    for (;;) {
+        futex_wait(word, value);
+        // the neighbour may well have exited after its last change
+        if (__atomic_load_n(word, __ATOMIC_ACQUIRE) != value)
+            return;
+        pid_t pid = __atomic_load_n(&halo->pids[neighbour], __ATOMIC_ACQUIRE);
+        if (pid && kill(pid, 0) && errno == ESRCH)
+            abort();
+    }
+}
+
+static gfhalo_channel_t *channel(gfhalo_t halo, size_t boundary, int dir) {
+    return( (gfhalo_channel_t *)(halo->base + halo->channels + (2*boundary + dir) * halo->stride) );
+}
+
+// the channel this rank sends to dir on
+static gfhalo_channel_t *outbound(gfhalo_t halo, int dir) {
+    if (dir == GFHALO_DOWN)
+        return( channel(halo, halo->rank, 0) );
+    return( channel(halo, halo->rank - 1, 1) );
+}
+
+// the channel this rank receives from dir on
+static gfhalo_channel_t *inbound(gfhalo_t halo, int dir) {
+    if (dir == GFHALO_DOWN)
+        return( channel(halo, halo->rank, 1) );
+    return( channel(halo, halo->rank - 1, 0) );
+}
+
+// Rank 0 creates the object afresh, removing any a crashed run left
+// behind under the name, with its stale sequence numbers.
+static int create_object(const char *name, size_t size) {
+    for (int tries = 0; tries < 2; tries++) {
+        int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd >= 0) {
+            if (!ftruncate(fd, size))
+                return fd;
+            int err = errno;
+            close(fd);
+            shm_unlink(name);
+            errno = err;
+            return -1;
+        }
+        if (errno != EEXIST)
+            return -1;
+        shm_unlink(name);
+    }
+    return -1;
+}
+
+static char *map_object(int fd, size_t size) {
+    char *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    int err = errno;
+    close(fd);
+    errno = err;
+    return base;
+}
+
+// whether rank 0 has readied the object at base and is still running
+static int object_live(const char *base) {
+    gfhalo_header_t *header = (gfhalo_header_t *)base;
+    int32_t *pids = (int32_t *)(header + 1);
+    if (!__atomic_load_n(&header->ready, __ATOMIC_ACQUIRE))
+        return 0;
+    pid_t pid = __atomic_load_n(&pids[0], __ATOMIC_ACQUIRE);
+    return( !(kill(pid, 0) && errno == ESRCH) );
+}
+
+// The other ranks wait for rank 0's object. They open the name afresh each
+// time round, so they move on from a stale object once rank 0 replaces it.
+static char *attach_object(const char *name, size_t size) {
+    const struct timespec nap = { 0, GFHALO_OPEN_NAP_MS * 1000000L };
+    for (long i = 0; i < GFHALO_OPEN_SECONDS * 1000L / GFHALO_OPEN_NAP_MS; i++) {
+        int fd = shm_open(name, O_RDWR, 0);
+        if (fd < 0 && errno != ENOENT)
+            return MAP_FAILED;
+        struct stat st;
+        if (fd >= 0 && (fstat(fd, &st) || (size_t)st.st_size != size)) {
+            close(fd);
+            fd = -1;
+        }
+        if (fd >= 0) {
+            char *base = map_object(fd, size);
+            if (base == MAP_FAILED)
+                return MAP_FAILED;
+            if (object_live(base))
+                return base;
+            munmap(base, size);
+        }
+        nanosleep(&nap, NULL);
+    }
+    errno = ETIMEDOUT;
+    return MAP_FAILED;
+}
+
+gfhalo_t gfhalo_open(const char *name, size_t rank, size_t nranks, size_t bytes) {
+    if (rank >= nranks) {
+        errno = EINVAL;
+        return NULL;
+    }
+    gfhalo_t halo = calloc(1, sizeof(struct gfhalo));
+    if (!halo)
+        return NULL;
+    halo->rank = rank;
+    halo->nranks = nranks;
+    halo->channels = sizeof(gfhalo_header_t) + (nranks*sizeof(int32_t) + 63) / 64 * 64;
+    halo->stride = sizeof(gfhalo_channel_t) + (bytes + 63) / 64 * 64;
+    halo->size = halo->channels + 2*(nranks-1) * halo->stride;
+    if (rank == 0) {
+        int fd = create_object(name, halo->size);
+        halo->base = fd < 0 ? MAP_FAILED : map_object(fd, halo->size);
+    } else {
+        halo->base = attach_object(name, halo->size);
+    }
+    if (halo->base == MAP_FAILED) {
+        int err = errno;
+        if (rank == 0)
+            shm_unlink(name);
+        free(halo);
+        errno = err;
+        return NULL;
+    }
+    gfhalo_header_t *header = (gfhalo_header_t *)halo->base;
+    halo->pids = (int32_t *)(header + 1);
+    __atomic_store_n(&halo->pids[rank], getpid(), __ATOMIC_RELEASE);
+    if (rank == 0)
+        __atomic_store_n(&header->ready, 1, __ATOMIC_RELEASE);
+    if (__atomic_add_fetch(&header->attached, 1, __ATOMIC_ACQ_REL) == nranks)
+        shm_unlink(name);
+    return(halo);
+}
+
+void gfhalo_close(gfhalo_t halo) {
+    if (!halo)
+        return;
+    munmap(halo->base, halo->size);
+    free(halo);
+}
+
+void *gfhalo_send_begin(gfhalo_t halo, int dir) {
+    gfhalo_channel_t *ch = outbound(halo, dir);
+    uint32_t sent = halo->sent[dir];
+    uint32_t ack;
+    while ((ack = __atomic_load_n(&ch->ack, __ATOMIC_ACQUIRE)) != sent)
+        wait_change(halo, dir, &ch->ack, ack);
+    return( ch + 1 );
+}
+
+void gfhalo_send_end(gfhalo_t halo, int dir) {
+    gfhalo_channel_t *ch = outbound(halo, dir);
+    __atomic_store_n(&ch->seq, ++halo->sent[dir], __ATOMIC_RELEASE);
+    futex_wake(&ch->seq);
+}
+
+const void *gfhalo_recv_begin(gfhalo_t halo, int dir) {
+    gfhalo_channel_t *ch = inbound(halo, dir);
+    wait_change(halo, dir, &ch->seq, halo->taken[dir]);
+    return( ch + 1 );
+}
+
+void gfhalo_recv_end(gfhalo_t halo, int dir) {
+    gfhalo_channel_t *ch = inbound(halo, dir);
+    __atomic_store_n(&ch->ack, ++halo->taken[dir], __ATOMIC_RELEASE);
+    futex_wake(&ch->ack);
+}
@@ -0,0 +1,40 @@
+#ifndef GFHALO_H_INCLUDED
+#define GFHALO_H_INCLUDED
+
+#include <stddef.h>
+
+// Message channels between the processes of a partitioned scene, kept in
+// one POSIX shared memory object. Ranks are strips of rows, so each has at
+// most two neighbours: rank-1 above and rank+1 below. Every boundary has a
+// channel each way, and a channel holds one message: a sender waits until
+// the receiver has taken the previous one, a receiver until the next one
+// arrives. Both wait on a futex, so a process with nothing to do sleeps.
+// A process whose neighbour has died aborts rather than wait forever.
+
+typedef struct gfhalo *gfhalo_t;
+
+enum {
+    GFHALO_UP,      // to or from rank-1
+    GFHALO_DOWN     // to or from rank+1
+};
+
+// Every rank opens the same name with the same nranks and bytes, the most
+// one message can hold. Rank 0 creates the object, replacing one a crashed
+// run may have left under the name; the others wait up to a minute for it
+// (ETIMEDOUT) and the last to attach removes the name. Two runs must not
+// share a name at the same time. Returns NULL with errno set on failure.
+gfhalo_t gfhalo_open(const char *name, size_t rank, size_t nranks, size_t bytes);
+
+void gfhalo_close(gfhalo_t halo);
+
+// Waits until the neighbour in dir has taken the last message and returns
+// the buffer for the next; gfhalo_send_end hands it over.
+void *gfhalo_send_begin(gfhalo_t halo, int dir);
+void gfhalo_send_end(gfhalo_t halo, int dir);
+
+// Waits for the next message from the neighbour in dir; gfhalo_recv_end
+// gives its buffer back.
+const void *gfhalo_recv_begin(gfhalo_t halo, int dir);
+void gfhalo_recv_end(gfhalo_t halo, int dir);
+
+#endif
@@ -0,0 +1,191 @@
+#include "gfpnm.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+typedef struct gfpnm_input {
+    const unsigned char *p;
+    const unsigned char *end;
+} gfpnm_input_t;
+
+static int is_space(int c) {
+    return( c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f' );
+}
+
+// skips whitespace and, in the header, comments running to the end of line
+static void skip_space(gfpnm_input_t *in, int comments) {
+    while (in->p < in->end) {
+        if (comments && *in->p == '#') {
+            while (in->p < in->end && *in->p != '\n')
+                in->p++;
+        } else if (is_space(*in->p)) {
+            in->p++;
+        } else {
+            return;
+        }
+    }
+}
+
+// Reads a decimal of at most max. Returns 0 if there is none.
+static int read_number(gfpnm_input_t *in, int comments, size_t max, size_t *value) {
+    skip_space(in, comments);
+    if (in->p == in->end || *in->p < '0' || *in->p > '9')
+        return( 0 );
+    size_t v = 0;
+    while (in->p < in->end && *in->p >= '0' && *in->p <= '9') {
+        v = v*10 + (*in->p++ - '0');
+        if (v > max)
+            return( 0 );
+    }
+    *value = v;
+    return( 1 );
+}
+
+static unsigned char *read_file(const char *path, size_t *len) {
+    FILE *f = fopen(path, "rb");
+    if (!f)
+        return( NULL );
+    unsigned char *data = NULL;
+    size_t size = 0;
+    *len = 0;
+    for (;;) {
+        if (*len == size) {
+            size = size ? size*2 : 65536;
+            data = realloc(data, size);
+            if (!data)
+                abort();
+        }
+        size_t n = fread(data + *len, 1, size - *len, f);
+        *len += n;
+        if (n == 0)
+            break;
+    }
+    int err = ferror(f) ? errno : 0;
+    fclose(f);
+    if (err) {
+        free(data);
+        errno = err;
+        return( NULL );
+    }
+    return( data );
+}
+
+// the state a grey level stands for, by thirds of maxval
+static uint8_t grey_state(size_t v, size_t maxval) {
+    if (v*3 < maxval)
+        return( GF_OBSTACLE );
+    if (v*3 < 2*maxval)
+        return( GF_FLUID );
+    return( GF_EMPTY );
+}
+
+static int read_pixels(gfpnm_input_t *in, char format, size_t maxval, uint8_t *mask, size_t w, size_t h) {
+    size_t n = w*h;
+    size_t v;
+    switch (format) {
+        case '1':
+            for (size_t i = 0; i < n; i++) {
+                skip_space(in, 0);
+                if (in->p == in->end || (*in->p != '0' && *in->p != '1'))
+                    return( 0 );
+                mask[i] = *in->p++ == '1' ? GF_OBSTACLE : GF_EMPTY;
+            }
+            return( 1 );
+        case '2':
+            for (size_t i = 0; i < n; i++) {
+                if (!read_number(in, 0, maxval, &v))
+                    return( 0 );
+                mask[i] = grey_state(v, maxval);
+            }
+            return( 1 );
+        case '4': {
+            size_t stride = (w + 7) / 8;
+            for (size_t y = 0; y < h; y++, in->p += stride) {
+                for (size_t x = 0; x < w; x++)
+                    mask[y*w + x] = in->p[x/8] & (0x80 >> (x%8)) ? GF_OBSTACLE : GF_EMPTY;
+            }
+            return( 1 );
+        }
+        case '5': {
+            size_t bytes = maxval > 255 ? 2 : 1;
+            for (size_t i = 0; i < n; i++, in->p += bytes) {
+                v = bytes == 2 ? (size_t)in->p[0] << 8 | in->p[1] : in->p[0];
+                if (v > maxval)
+                    return( 0 );
+                mask[i] = grey_state(v, maxval);
+            }
+            return( 1 );
+        }
+    }
+    return( 0 );
+}
+
+// Whether what is left of the input can hold w*h pixels: raw formats need
+// their exact size and plain ones at least a byte a pixel, so a header
+// claiming more than the file has fails before the mask is allocated.
+static int fits(const gfpnm_input_t *in, char format, size_t maxval, size_t w, size_t h) {
+    size_t left = in->end - in->p;
+    switch (format) {
+        case '4':
+            return( left / ((w + 7) / 8) >= h );
+        case '5':
+            return( left / (maxval > 255 ? 2 : 1) >= w*h );
+    }
+    return( left >= w*h );
+}
+
+// Returns the mask of the image in data, or NULL if it is not a valid one.
+static uint8_t *parse(gfpnm_input_t *in, size_t *w, size_t *h) {
+    char format = in->end - in->p >= 2 && in->p[0] == 'P' ? in->p[1] : 0;
+    size_t maxval = 1;
+    if (format < '1' || format == '3' || format > '5')
+        return( NULL );
+    in->p += 2;
+    if (!read_number(in, 1, SIZE_MAX, w) || !read_number(in, 1, SIZE_MAX, h))
+        return( NULL );
+    if (format != '1' && format != '4' && (!read_number(in, 1, 65535, &maxval) || !maxval))
+        return( NULL );
+    if (*w < 3 || *h < 3 || *h > SIZE_MAX / *w)
+        return( NULL );
+    // raw pixels start after exactly one whitespace character
+    if (format == '4' || format == '5') {
+        if (in->p == in->end || !is_space(*in->p))
+            return( NULL );
+        in->p++;
+    }
+    if (!fits(in, format, maxval, *w, *h))
+        return( NULL );
+    uint8_t *mask = malloc(*w * *h);
+    if (!mask)
+        abort();
+    if (!read_pixels(in, format, maxval, mask, *w, *h)) {
+        free(mask);
+        return( NULL );
+    }
+    return( mask );
+}
+
+uint8_t *gfpnm_read(const char *path, size_t *w, size_t *h) {
+    size_t len;
+    unsigned char *data = read_file(path, &len);
+    if (!data)
+        return( NULL );
+    gfpnm_input_t in = { data, data + len };
+    uint8_t *mask = parse(&in, w, h);
+    free(data);
+    if (!mask)
+        errno = EINVAL;
+    return( mask );
+}
+
+gridfluid_t gfpnm_load(const char *path) {
+    size_t w, h;
+    uint8_t *mask = gfpnm_read(path, &w, &h);
+    if (!mask)
+        return( NULL );
+    gridfluid_t gf = gridfluid_create_empty_scene(w, h);
+    if (gf)
+        gridfluid_apply_mask(gf, 0, 0, w, h, mask);
+    free(mask);
+    return( gf );
+}
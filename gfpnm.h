@@ -0,0 +1,26 @@
+#ifndef GFPNM_H_INCLUDED
+#define GFPNM_H_INCLUDED
+
+#include "gridfluid.h"
+
+#pragma GCC visibility push(default)
+
+// Scenes from Netpbm images, one pixel per cell, read in one pass and built
+// with gridfluid_apply_mask. Plain and raw PBM (P1, P4) and PGM (P2, P5)
+// are understood. A PBM's black pixels are obstacles and the rest empty. A
+// PGM's grey levels split in thirds: dark is obstacle, mid-grey fluid and
+// light empty. As with any scene, the outer ring of pixels is the ghost
+// layer and is ignored.
+//
+// gfpnm_load returns a scene of the image's size with wall boundaries, or
+// NULL with errno set: EINVAL if the file is not such an image or is
+// smaller than 3x3.
+gridfluid_t gfpnm_load(const char *path);
+
+// The mask gfpnm_load builds, w*h bytes for gridfluid_apply_mask, which the
+// caller frees. For setting boundaries or threads before filling.
+uint8_t *gfpnm_read(const char *path, size_t *w, size_t *h);
+
+#pragma GCC visibility pop
+
+#endif
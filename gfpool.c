@@ -0,0 +1,112 @@
+#define _POSIX_C_SOURCE 200809L
+#include "gfpool.h"
+#include <stdlib.h>
+#include <pthread.h>
+
+typedef struct gfpool_worker {
+    gfpool_t pool;
+    size_t index;
+    pthread_t thread;
+} gfpool_worker_t;
+
+struct gfpool {
+    size_t nworkers;
+    gfpool_worker_t *workers;
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    unsigned long generation;
+    size_t pending;
+    gfpool_fn fn;
+    void *ctx;
+    int shutdown;
+};
+
+static void *gfpool_main(void *arg) {
+    gfpool_worker_t *worker = arg;
+    gfpool_t pool = worker->pool;
+    // generation is 0 at creation; reading it here instead would race with
+    // a gfpool_run issued before this thread got scheduled
+    unsigned long seen = 0;
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (pool->generation == seen && !pool->shutdown)
+            pthread_cond_wait(&pool->start, &pool->lock);
+        if (pool->shutdown)
+            break;
+        seen = pool->generation;
+        gfpool_fn fn = pool->fn;
+        void *ctx = pool->ctx;
+        pthread_mutex_unlock(&pool->lock);
+        fn(ctx, worker->index, pool->nworkers);
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->pending == 0)
+            pthread_cond_signal(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+gfpool_t gfpool_create(size_t nworkers) {
+    if (nworkers == 0)
+        return NULL;
+    gfpool_t pool = calloc(1, sizeof(struct gfpool));
+    if (!pool)
+        return NULL;
+    pool->nworkers = nworkers;
+    pool->workers = calloc(nworkers, sizeof(gfpool_worker_t));
+    if (!pool->workers) {
+        free(pool);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    for (size_t i = 1; i < nworkers; i++) {
+        gfpool_worker_t *worker = &pool->workers[i];
+        worker->pool = pool;
+        worker->index = i;
+        if (pthread_create(&worker->thread, NULL, gfpool_main, worker) != 0) {
+            // run with the threads we got
+            pool->nworkers = i;
+            break;
+        }
+    }
+    return(pool);
+}
+
+void gfpool_free(gfpool_t pool) {
+    if (!pool)
+        return;
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+    for (size_t i = 1; i < pool->nworkers; i++) {
+        pthread_join(pool->workers[i].thread, NULL);
+    }
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->start);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->workers);
+    free(pool);
+}
+
+size_t gfpool_size(gfpool_t pool) {
+    return( pool->nworkers );
+}
+
+void gfpool_run(gfpool_t pool, gfpool_fn fn, void *ctx) {
+    pthread_mutex_lock(&pool->lock);
+    pool->fn = fn;
+    pool->ctx = ctx;
+    pool->pending = pool->nworkers - 1;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+    fn(ctx, 0, pool->nworkers);
+    pthread_mutex_lock(&pool->lock);
+    while (pool->pending)
+        pthread_cond_wait(&pool->done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
@@ -0,0 +1,23 @@
+#ifndef GFPOOL_H_INCLUDED
+#define GFPOOL_H_INCLUDED
+
+#include <stddef.h>
+
+// A persistent pool of worker threads. gfpool_run hands the same function to
+// every worker (the calling thread acts as worker 0) and returns once all of
+// them have finished, so each run is a complete phase with an implicit
+// barrier at the end. Work is split by the callee from its worker index.
+
+typedef struct gfpool *gfpool_t;
+
+typedef void (*gfpool_fn)(void *ctx, size_t worker, size_t nworkers);
+
+gfpool_t gfpool_create(size_t nworkers);
+
+void gfpool_free(gfpool_t pool);
+
+size_t gfpool_size(gfpool_t pool);
+
+void gfpool_run(gfpool_t pool, gfpool_fn fn, void *ctx);
+
+#endif
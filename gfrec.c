@@ -0,0 +1,475 @@
+#define _POSIX_C_SOURCE 200809L
+#include "gfrec.h"
+#include "gfring.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+// File layout: a gfrec_file_header_t, then frames back to back, each a
+// gfrec_frame_header_t followed by its payload. The payload holds the
+// flags, pressure and mass planes in that order, each as the cell-wise
+// difference from the previous frame (from zero for a keyframe), run-length
+// coded: a varint count of unchanged cells, a varint count of changed
+// cells, then that many zigzag varint differences, repeated until the
+// plane is covered. No index is written; a reader finds the frames by
+// walking their headers, which also makes a file cut short by a crash
+// readable up to its last whole frame.
+
+#define GFREC_MAGIC "GFREC\r\n"
+#define GFREC_VERSION 1
+#define GFREC_FRAME_MAGIC 0x46524647u
+// snapshots in flight between the solver and the writer
+#define GFREC_BUFFERS 4
+// flags, pressure, mass; all coded as int16
+#define GFREC_PLANES 3
+
+typedef struct gfrec_file_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t key_interval;
+    uint64_t x;
+    uint64_t y;
+    uint32_t scale;
+    uint32_t reserved;
+} gfrec_file_header_t;
+
+typedef struct gfrec_frame_header {
+    uint32_t magic;
+    uint32_t bytes;
+    uint64_t step;
+    uint32_t key;
+    float total_mass;
+    float min_pressure;
+    float max_pressure;
+    float max_velocity;
+    uint32_t reserved;
+} gfrec_frame_header_t;
+
+typedef struct gfrec_buf {
+    uint8_t *data;
+    size_t len;
+    size_t cap;
+} gfrec_buf_t;
+
+struct gfrec {
+    size_t x;
+    size_t y;
+    FILE *file;
+    gfrec_frame_t snaps[GFREC_BUFFERS];
+    // free snapshots go from the writer back to the solver, filled ones
+    // from the solver to the writer; a NULL tells the writer to finish
+    gfring_t free_snaps;
+    gfring_t full_snaps;
+    sem_t pending;
+    pthread_t writer;
+    size_t dropped;
+    // writer side
+    uint64_t frames;
+    int16_t *prev[GFREC_PLANES];
+    int16_t *cur[GFREC_PLANES];
+    gfrec_buf_t out;
+    int failed;
+};
+
+struct gfrec_reader {
+    size_t x;
+    size_t y;
+    FILE *file;
+    size_t nframes;
+    long *offsets;
+    uint8_t *keys;
+    size_t current;  // frame held in state, nframes if none
+    int16_t *state[GFREC_PLANES];
+    gfrec_buf_t payload;
+    gfrec_frame_t frame;
+};
+
+static void buf_reserve(gfrec_buf_t *buf, size_t n) {
+    if (buf->len + n <= buf->cap)
+        return;
+    size_t cap = buf->cap ? buf->cap : 65536;
+    while (cap < buf->len + n)
+        cap *= 2;
+    uint8_t *data = realloc(buf->data, cap);
+    if (!data)
+        abort();
+    buf->data = data;
+    buf->cap = cap;
+}
+
+static void put_varint(gfrec_buf_t *buf, uint64_t v) {
+    buf_reserve(buf, 10);
+    while (v >= 0x80) {
+        buf->data[buf->len++] = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    buf->data[buf->len++] = v;
+}
+
+static int get_varint(const uint8_t **p, const uint8_t *end, uint64_t *v) {
+    uint64_t r = 0;
+    for (int shift = 0; shift < 64 && *p < end; shift += 7) {
+        uint8_t b = *(*p)++;
+        r |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            *v = r;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static uint32_t zigzag(int32_t v) {
+    return( ((uint32_t)v << 1) ^ (uint32_t)(v >> 31) );
+}
+
+static int32_t unzigzag(uint32_t v) {
+    return( (int32_t)(v >> 1) ^ -(int32_t)(v & 1) );
+}
+
+static int16_t quantize(float v) {
+    float q = roundf(v * GFREC_SCALE);
+    if (q > INT16_MAX)
+        q = INT16_MAX;
+    if (q < INT16_MIN)
+        q = INT16_MIN;
+    if (q != q)
+        q = 0;
+    return( q );
+}
+
+// Run-length codes one plane's differences from prev, or from zero if prev
+// is NULL.
+static void encode_plane(gfrec_buf_t *buf, const int16_t *cur, const int16_t *prev, size_t n) {
+    size_t i = 0;
+    while (i < n) {
+        size_t z = i;
+        while (z < n && cur[z] == (prev ? prev[z] : 0))
+            z++;
+        size_t l = z;
+        while (l < n && cur[l] != (prev ? prev[l] : 0))
+            l++;
+        put_varint(buf, z - i);
+        put_varint(buf, l - z);
+        for (size_t k = z; k < l; k++) {
+            put_varint(buf, zigzag((int32_t)cur[k] - (prev ? prev[k] : 0)));
+        }
+        i = l;
+    }
+}
+
+// Adds one run-length coded plane of differences onto state.
+static int decode_plane(const uint8_t **p, const uint8_t *end, int16_t *state, size_t n) {
+    size_t i = 0;
+    while (i < n) {
+        uint64_t z, l, d;
+        if (!get_varint(p, end, &z) || !get_varint(p, end, &l)
+            || z > n - i || l > n - i - z || (!z && !l))
+            return 0;
+        i += z;
+        for (uint64_t k = 0; k < l; k++, i++) {
+            if (!get_varint(p, end, &d))
+                return 0;
+            state[i] = (int16_t)(state[i] + unzigzag(d));
+        }
+    }
+    return 1;
+}
+
+static void encode_frame(gfrec_t rec, const gfrec_frame_t *snap) {
+    size_t n = rec->x * rec->y;
+    int key = rec->frames % GFREC_KEY_INTERVAL == 0;
+    for (size_t i = 0; i < n; i++) {
+        int live = snap->flags[i] == GF_FLUID || snap->flags[i] == GF_INTERFACE;
+        rec->cur[0][i] = snap->flags[i];
+        rec->cur[1][i] = live ? quantize(snap->pressure[i]) : 0;
+        rec->cur[2][i] = live ? quantize(snap->mass[i]) : 0;
+    }
+    rec->out.len = 0;
+    for (size_t k = 0; k < GFREC_PLANES; k++) {
+        encode_plane(&rec->out, rec->cur[k], key ? NULL : rec->prev[k], n);
+    }
+
+    gfrec_frame_header_t h;
+    memset(&h, 0, sizeof(h));
+    h.magic = GFREC_FRAME_MAGIC;
+    h.bytes = rec->out.len;
+    h.step = snap->step;
+    h.key = key;
+    h.total_mass = snap->total_mass;
+    h.min_pressure = snap->min_pressure;
+    h.max_pressure = snap->max_pressure;
+    h.max_velocity = snap->max_velocity;
+    if (fwrite(&h, sizeof(h), 1, rec->file) != 1
+        || fwrite(rec->out.data, 1, rec->out.len, rec->file) != rec->out.len)
+        rec->failed = 1;
+
+    for (size_t k = 0; k < GFREC_PLANES; k++) {
+        int16_t *tmp = rec->prev[k];
+        rec->prev[k] = rec->cur[k];
+        rec->cur[k] = tmp;
+    }
+    rec->frames++;
+}
+
+static void *gfrec_writer(void *arg) {
+    gfrec_t rec = arg;
+    for (;;) {
+        gfrec_frame_t *snap;
+        while (sem_wait(&rec->pending))
+            ;
+        if (!gfring_pop(rec->full_snaps, &snap) || !snap)
+            break;
+        encode_frame(rec, snap);
+        gfring_push(rec->free_snaps, &snap);
+    }
+    return NULL;
+}
+
+static void gfrec_free(gfrec_t rec) {
+    if (rec->file)
+        fclose(rec->file);
+    gfring_free(rec->free_snaps);
+    gfring_free(rec->full_snaps);
+    for (size_t i = 0; i < GFREC_BUFFERS; i++) {
+        free(rec->snaps[i].flags);
+        free(rec->snaps[i].pressure);
+        free(rec->snaps[i].mass);
+    }
+    for (size_t k = 0; k < GFREC_PLANES; k++) {
+        free(rec->prev[k]);
+        free(rec->cur[k]);
+    }
+    free(rec->out.data);
+    free(rec);
+}
+
+gfrec_t gfrec_open(const char *path, size_t x, size_t y) {
+    size_t n = x * y;
+    gfrec_t rec = calloc(1, sizeof(struct gfrec));
+    if (!rec)
+        return NULL;
+    rec->x = x;
+    rec->y = y;
+    rec->file = fopen(path, "wb");
+    rec->free_snaps = gfring_create(sizeof(gfrec_frame_t *), GFREC_BUFFERS);
+    rec->full_snaps = gfring_create(sizeof(gfrec_frame_t *), GFREC_BUFFERS + 1);
+    int ok = rec->file && rec->free_snaps && rec->full_snaps;
+    for (size_t i = 0; ok && i < GFREC_BUFFERS; i++) {
+        gfrec_frame_t *snap = &rec->snaps[i];
+        snap->flags = malloc(n);
+        snap->pressure = malloc(n * sizeof(float));
+        snap->mass = malloc(n * sizeof(float));
+        ok = snap->flags && snap->pressure && snap->mass;
+        if (ok)
+            gfring_push(rec->free_snaps, &snap);
+    }
+    for (size_t k = 0; k < GFREC_PLANES; k++) {
+        rec->prev[k] = calloc(n, sizeof(int16_t));
+        rec->cur[k] = calloc(n, sizeof(int16_t));
+        ok = ok && rec->prev[k] && rec->cur[k];
+    }
+
+    gfrec_file_header_t h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, GFREC_MAGIC, sizeof(h.magic));
+    h.version = GFREC_VERSION;
+    h.key_interval = GFREC_KEY_INTERVAL;
+    h.x = x;
+    h.y = y;
+    h.scale = GFREC_SCALE;
+    ok = ok && fwrite(&h, sizeof(h), 1, rec->file) == 1;
+    if (!ok || sem_init(&rec->pending, 0, 0)) {
+        gfrec_free(rec);
+        return NULL;
+    }
+    if (pthread_create(&rec->writer, NULL, gfrec_writer, rec)) {
+        sem_destroy(&rec->pending);
+        gfrec_free(rec);
+        return NULL;
+    }
+    return rec;
+}
+
+int gfrec_record(gfrec_t rec, gridfluid_t gf) {
+    gfrec_frame_t *snap;
+    if (!gfring_pop(rec->free_snaps, &snap)) {
+        rec->dropped++;
+        return 0;
+    }
+    gridfluid_properties_t *props = gridfluid_get_properties(gf);
+    size_t n = rec->x * rec->y;
+    snap->step = gridfluid_get_step(gf);
+    snap->total_mass = props->total_mass;
+    snap->min_pressure = props->min_pressure;
+    snap->max_pressure = props->max_pressure;
+    snap->max_velocity = props->max_velocity;
+    for (size_t y = 0; y < rec->y; y++) {
+        for (size_t x = 0; x < rec->x; x++) {
+            snap->flags[x + y*rec->x] = gridfluid_get_type(gf, x, y);
+        }
+    }
+    memcpy(snap->pressure, props->pressure, n * sizeof(float));
+    memcpy(snap->mass, props->mass, n * sizeof(float));
+    gfring_push(rec->full_snaps, &snap);
+    sem_post(&rec->pending);
+    return 1;
+}
+
+size_t gfrec_dropped(gfrec_t rec) {
+    return( rec->dropped );
+}
+
+int gfrec_close(gfrec_t rec) {
+    gfrec_frame_t *end = NULL;
+    gfring_push(rec->full_snaps, &end);
+    sem_post(&rec->pending);
+    pthread_join(rec->writer, NULL);
+    sem_destroy(&rec->pending);
+    int ok = !rec->failed && !fflush(rec->file);
+    ok = !fclose(rec->file) && ok;
+    rec->file = NULL;
+    gfrec_free(rec);
+    return ok;
+}
+
+void gfrec_reader_close(gfrec_reader_t rd) {
+    if (!rd)
+        return;
+    if (rd->file)
+        fclose(rd->file);
+    free(rd->offsets);
+    free(rd->keys);
+    for (size_t k = 0; k < GFREC_PLANES; k++) {
+        free(rd->state[k]);
+    }
+    free(rd->payload.data);
+    free(rd->frame.flags);
+    free(rd->frame.pressure);
+    free(rd->frame.mass);
+    free(rd);
+}
+
+gfrec_reader_t gfrec_reader_open(const char *path) {
+    gfrec_reader_t rd = calloc(1, sizeof(struct gfrec_reader));
+    if (!rd)
+        return NULL;
+    gfrec_file_header_t h;
+    rd->file = fopen(path, "rb");
+    if (!rd->file || fread(&h, sizeof(h), 1, rd->file) != 1
+        || memcmp(h.magic, GFREC_MAGIC, sizeof(h.magic)) || h.version != GFREC_VERSION
+        || h.scale != GFREC_SCALE || !h.x || !h.y || (h.x * h.y) / h.x != h.y) {
+        gfrec_reader_close(rd);
+        return NULL;
+    }
+    rd->x = h.x;
+    rd->y = h.y;
+    size_t n = rd->x * rd->y;
+
+    if (fseek(rd->file, 0, SEEK_END)) {
+        gfrec_reader_close(rd);
+        return NULL;
+    }
+    long size = ftell(rd->file);
+    size_t cap = 0;
+    long off = sizeof(h);
+    gfrec_frame_header_t fh;
+    // a frame cut short by a crash ends the file
+    while (off + (long)sizeof(fh) <= size && !fseek(rd->file, off, SEEK_SET)
+           && fread(&fh, sizeof(fh), 1, rd->file) == 1 && fh.magic == GFREC_FRAME_MAGIC
+           && off + (long)sizeof(fh) + (long)fh.bytes <= size) {
+        if (rd->nframes == cap) {
+            cap = cap ? cap*2 : 256;
+            rd->offsets = realloc(rd->offsets, cap * sizeof(long));
+            rd->keys = realloc(rd->keys, cap);
+            if (!rd->offsets || !rd->keys)
+                abort();
+        }
+        rd->offsets[rd->nframes] = off;
+        rd->keys[rd->nframes] = fh.key;
+        rd->nframes++;
+        off += sizeof(fh) + fh.bytes;
+    }
+    rd->current = rd->nframes;
+    int ok = 1;
+    for (size_t k = 0; k < GFREC_PLANES; k++) {
+        rd->state[k] = calloc(n, sizeof(int16_t));
+        ok = ok && rd->state[k];
+    }
+    rd->frame.flags = calloc(n, 1);
+    rd->frame.pressure = calloc(n, sizeof(float));
+    rd->frame.mass = calloc(n, sizeof(float));
+    if (!ok || !rd->frame.flags || !rd->frame.pressure || !rd->frame.mass) {
+        gfrec_reader_close(rd);
+        return NULL;
+    }
+    return rd;
+}
+
+size_t gfrec_reader_x(gfrec_reader_t rd) {
+    return( rd->x );
+}
+
+size_t gfrec_reader_y(gfrec_reader_t rd) {
+    return( rd->y );
+}
+
+size_t gfrec_reader_frames(gfrec_reader_t rd) {
+    return( rd->nframes );
+}
+
+static int decode_frame(gfrec_reader_t rd, size_t f) {
+    size_t n = rd->x * rd->y;
+    gfrec_frame_header_t h;
+    if (fseek(rd->file, rd->offsets[f], SEEK_SET) || fread(&h, sizeof(h), 1, rd->file) != 1)
+        return 0;
+    rd->payload.len = 0;
+    buf_reserve(&rd->payload, h.bytes);
+    if (fread(rd->payload.data, 1, h.bytes, rd->file) != h.bytes)
+        return 0;
+    const uint8_t *p = rd->payload.data;
+    const uint8_t *end = p + h.bytes;
+    for (size_t k = 0; k < GFREC_PLANES; k++) {
+        if (h.key)
+            memset(rd->state[k], 0, n * sizeof(int16_t));
+        if (!decode_plane(&p, end, rd->state[k], n))
+            return 0;
+    }
+    rd->frame.step = h.step;
+    rd->frame.total_mass = h.total_mass;
+    rd->frame.min_pressure = h.min_pressure;
+    rd->frame.max_pressure = h.max_pressure;
+    rd->frame.max_velocity = h.max_velocity;
+    rd->current = f;
+    return 1;
+}
+
+const gfrec_frame_t *gfrec_reader_seek(gfrec_reader_t rd, size_t n) {
+    if (n >= rd->nframes)
+        return NULL;
+    size_t f = n;
+    while (f > 0 && !rd->keys[f])
+        f--;
+    // a file always starts with a keyframe; anything else is damaged
+    if (!rd->keys[f])
+        return NULL;
+    // the state already holds a frame between that keyframe and n
+    if (rd->current < rd->nframes && rd->current >= f && rd->current <= n)
+        f = rd->current + 1;
+    for (; f <= n; f++) {
+        if (!decode_frame(rd, f)) {
+            rd->current = rd->nframes;
+            return NULL;
+        }
+    }
+    size_t cells = rd->x * rd->y;
+    for (size_t i = 0; i < cells; i++) {
+        rd->frame.flags[i] = rd->state[0][i];
+        rd->frame.pressure[i] = (float)rd->state[1][i] / GFREC_SCALE;
+        rd->frame.mass[i] = (float)rd->state[2][i] / GFREC_SCALE;
+    }
+    return &rd->frame;
+}
@@ -0,0 +1,68 @@
+#ifndef GFREC_H_INCLUDED
+#define GFREC_H_INCLUDED
+
+#include <stdint.h>
+#include <stddef.h>
+#include "gridfluid.h"
+
+#pragma GCC visibility push(default)
+
+// Recording of a run for later replay. After each step gfrec_record takes a
+// snapshot of the cell types, pressure and mass; a background thread
+// quantizes it, delta-encodes it against the previous frame and appends it
+// to the file, so the solver never waits on the disk. Every
+// GFREC_KEY_INTERVAL frames is a keyframe encoded against nothing, which is
+// where seeking starts from.
+//
+// Pressure and mass are stored as 16-bit fixed point with a resolution of
+// 1/GFREC_SCALE, clamped to +/-32768/GFREC_SCALE. Cells that are neither
+// fluid nor interface are stored as zero.
+
+#define GFREC_KEY_INTERVAL 64
+#define GFREC_SCALE 4096
+
+typedef struct gfrec *gfrec_t;
+typedef struct gfrec_reader *gfrec_reader_t;
+
+// One decoded frame; the arrays hold x*y row-major cells.
+typedef struct gfrec_frame {
+    uint64_t step;
+    float total_mass;
+    float min_pressure;
+    float max_pressure;
+    float max_velocity;
+    uint8_t *flags;
+    float *pressure;
+    float *mass;
+} gfrec_frame_t;
+
+gfrec_t gfrec_open(const char *path, size_t x, size_t y);
+
+// Queues a snapshot of gf for writing. If the writer has fallen behind the
+// snapshot is dropped instead and 0 returned.
+int gfrec_record(gfrec_t rec, gridfluid_t gf);
+
+size_t gfrec_dropped(gfrec_t rec);
+
+// Writes out everything queued and closes the file. Returns 0 if any write
+// failed.
+int gfrec_close(gfrec_t rec);
+
+gfrec_reader_t gfrec_reader_open(const char *path);
+
+void gfrec_reader_close(gfrec_reader_t rd);
+
+size_t gfrec_reader_x(gfrec_reader_t rd);
+
+size_t gfrec_reader_y(gfrec_reader_t rd);
+
+size_t gfrec_reader_frames(gfrec_reader_t rd);
+
+// Decodes frame n. The returned frame is owned by the reader and valid
+// until the next call. Stepping forward one frame at a time costs one
+// delta; a jump replays from the nearest keyframe at or before n.
+const gfrec_frame_t *gfrec_reader_seek(gfrec_reader_t rd, size_t n);
+
+#pragma GCC visibility pop
+
+#endif
@@ -0,0 +1,57 @@
+#include "gfring.h"
+#include <stdlib.h>
+#include <string.h>
+
+struct gfring {
+    size_t item_size;
+    size_t mask;
+    char *items;
+    // head is written only by the producer and tail only by the consumer;
+    // they sit on separate cache lines so the two sides do not contend
+    size_t head __attribute__((aligned(64)));
+    size_t tail __attribute__((aligned(64)));
+};
+
+gfring_t gfring_create(size_t item_size, size_t capacity) {
+    size_t size = 1;
+    while (size < capacity)
+        size <<= 1;
+    gfring_t ring = calloc(1, sizeof(struct gfring));
+    if (!ring)
+        return NULL;
+    ring->items = calloc(size, item_size);
+    if (!ring->items) {
+        free(ring);
+        return NULL;
+    }
+    ring->item_size = item_size;
+    ring->mask = size - 1;
+    return(ring);
+}
+
+void gfring_free(gfring_t ring) {
+    if (!ring)
+        return;
+    free(ring->items);
+    free(ring);
+}
+
+int gfring_push(gfring_t ring, const void *item) {
+    size_t head = ring->head;
+    size_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (head - tail > ring->mask)
+        return 0;
+    memcpy(ring->items + (head & ring->mask) * ring->item_size, item, ring->item_size);
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+int gfring_pop(gfring_t ring, void *item) {
+    size_t tail = ring->tail;
+    size_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    if (tail == head)
+        return 0;
+    memcpy(item, ring->items + (tail & ring->mask) * ring->item_size, ring->item_size);
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    return 1;
+}
@@ -0,0 +1,21 @@
+#ifndef GFRING_H_INCLUDED
+#define GFRING_H_INCLUDED
+
+#include <stddef.h>
+
+// A bounded lock-free ring of fixed-size items for exactly one producer
+// thread and one consumer thread. Neither side ever blocks: push fails when
+// the ring is full and pop fails when it is empty.
+
+typedef struct gfring *gfring_t;
+
+// capacity is rounded up to a power of two
+gfring_t gfring_create(size_t item_size, size_t capacity);
+
+void gfring_free(gfring_t ring);
+
+int gfring_push(gfring_t ring, const void *item);
+
+int gfring_pop(gfring_t ring, void *item);
+
+#endif
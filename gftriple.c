@@ -0,0 +1,53 @@
+#include "gftriple.h"
+#include <stdint.h>
+#include <stdlib.h>
+
+// set in middle while the item there was published and not taken yet
+#define GFTRIPLE_FRESH 4
+
+struct gftriple {
+    void *items[3];
+    // index of the item changing hands; back is only touched by the
+    // producer and front by the consumer, each on its own cache line
+    uint32_t middle __attribute__((aligned(64)));
+    uint32_t back __attribute__((aligned(64)));
+    uint32_t front __attribute__((aligned(64)));
+};
+
+gftriple_t gftriple_create(void *a, void *b, void *c) {
+    gftriple_t triple = calloc(1, sizeof(struct gftriple));
+    if (!triple)
+        return NULL;
+    triple->items[0] = a;
+    triple->items[1] = b;
+    triple->items[2] = c;
+    triple->back = 0;
+    triple->middle = 1;
+    triple->front = 2;
+    return(triple);
+}
+
+void gftriple_free(gftriple_t triple) {
+    free(triple);
+}
+
+void *gftriple_back(gftriple_t triple) {
+    return( triple->items[triple->back] );
+}
+
+void gftriple_publish(gftriple_t triple) {
+    uint32_t old = __atomic_exchange_n(&triple->middle, triple->back | GFTRIPLE_FRESH, __ATOMIC_ACQ_REL);
+    triple->back = old & ~GFTRIPLE_FRESH;
+}
+
+int gftriple_unread(gftriple_t triple) {
+    return( (__atomic_load_n(&triple->middle, __ATOMIC_ACQUIRE) & GFTRIPLE_FRESH) != 0 );
+}
+
+void *gftriple_latest(gftriple_t triple) {
+    if (__atomic_load_n(&triple->middle, __ATOMIC_RELAXED) & GFTRIPLE_FRESH) {
+        uint32_t old = __atomic_exchange_n(&triple->middle, triple->front, __ATOMIC_ACQ_REL);
+        triple->front = old & ~GFTRIPLE_FRESH;
+    }
+    return( triple->items[triple->front] );
+}
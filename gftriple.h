@@ -0,0 +1,31 @@
+#ifndef GFTRIPLE_H_INCLUDED
+#define GFTRIPLE_H_INCLUDED
+
+// A lock-free triple buffer handing the latest of a stream of items from
+// exactly one producer thread to one consumer thread. The producer fills
+// its back item and publishes it; the consumer takes whichever item was
+// published last, skipping any it was too slow for. Neither side blocks or
+// copies: each always owns one of the three items, and the third changes
+// hands on every publish and take.
+
+typedef struct gftriple *gftriple_t;
+
+// The caller owns the items, which must outlive the buffer. The producer
+// starts out with a, and the consumer with c, which it gets from
+// gftriple_latest until the first publish.
+gftriple_t gftriple_create(void *a, void *b, void *c);
+
+void gftriple_free(gftriple_t triple);
+
+// producer: the item to fill next, its own until it publishes it
+void *gftriple_back(gftriple_t triple);
+
+void gftriple_publish(gftriple_t triple);
+
+// producer: whether the last item published has not been taken yet
+int gftriple_unread(gftriple_t triple);
+
+// consumer: the item published last, its own until the next call
+void *gftriple_latest(gftriple_t triple);
+
+#endif
@@ -0,0 +1,133 @@
+// Terminal viewer for recordings made with gfrec (gfbatch -R).
+//
+//     gfview recording
+//
+// l / h step one frame forward / back, L / H jump a keyframe interval,
+// g / G go to the first / last frame, space plays and pauses, q quits.
+
+#define _POSIX_C_SOURCE 200809L
+#include "npraises.h"
+#include "gfrec.h"
+#include <stdio.h>
+#include <stdbool.h>
+#include <time.h>
+
+static void render(const gfrec_frame_t *f, size_t w, size_t h, frame_t fb) {
+    float maxp = f->max_pressure;
+    float minp = f->min_pressure;
+    uint8_t c;
+    for (size_t y = 0; y < h; y++) {
+        for (size_t x = 0; x < w; x++) {
+            size_t i = x + y*w;
+            switch (f->flags[i]) {
+                case GF_OBSTACLE:
+                    frame_put(fb, x, y, "█", rgb_f(1,1,1), rgb_f(1,1,1));
+                    break;
+                case GF_EMPTY:
+                    frame_put(fb, x, y, " ", rgb_f(0,0,0), rgb_f(0,0,0));
+                    break;
+                case GF_FLUID:
+                    c = rgb_f(0,0,0.2 + 0.8*(f->pressure[i]-minp)/(maxp-minp));
+                    frame_put(fb, x, y, " ", c, c);
+                    break;
+                case GF_INTERFACE:
+                    c = rgb_f(0,0,0.2 + 0.8*(f->pressure[i]-minp)/(maxp-minp));
+                    frame_put(fb, x, y, "I", c, rgb_f(0,0,0));
+                    break;
+            }
+        }
+    }
+    frame_flush(fb);
+}
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s recording\n", argv[0]);
+        return 1;
+    }
+    gfrec_reader_t rd = gfrec_reader_open(argv[1]);
+    if (!rd) {
+        perror(argv[1]);
+        return 1;
+    }
+    size_t frames = gfrec_reader_frames(rd);
+    size_t w = gfrec_reader_x(rd);
+    size_t h = gfrec_reader_y(rd);
+    if (!frames) {
+        fprintf(stderr, "%s: no frames\n", argv[1]);
+        gfrec_reader_close(rd);
+        return 1;
+    }
+    if (!setup_screen()) {
+        printf("Failed to setup screen; exiting\n");
+        gfrec_reader_close(rd);
+        return 1;
+    }
+    frame_t fb = frame_create(w, h);
+
+    const struct timespec tick = { 0, 20000000 };
+    size_t current = 0;
+    size_t shown = frames;
+    bool playing = false;
+    bool running = true;
+    while (running) {
+        if (current != shown) {
+            const gfrec_frame_t *f = gfrec_reader_seek(rd, current);
+            if (f) {
+                render(f, w, h, fb);
+                set_fg(rgb_f(1,1,1));
+                set_bg(rgb_f(0,0,0));
+                curs_xy(0, h + 1);
+                printf("frame %zu/%zu  step %llu  total mass %f  max velocity %f     ",
+                       current + 1, frames, (unsigned long long)f->step,
+                       f->total_mass, f->max_velocity);
+                fflush(stdout);
+            }
+            shown = current;
+        }
+        if (playing) {
+            if (current + 1 < frames)
+                current++;
+            else
+                playing = false;
+        }
+        unsigned char key;
+        ssize_t len = read(0, &key, 1);
+        if (len == 1) {
+            switch (key) {
+                case 3:
+                case 'q':
+                    running = false;
+                    break;
+                case 'l':
+                    if (current + 1 < frames)
+                        current++;
+                    break;
+                case 'h':
+                    if (current > 0)
+                        current--;
+                    break;
+                case 'L':
+                    current = current + GFREC_KEY_INTERVAL < frames ? current + GFREC_KEY_INTERVAL : frames - 1;
+                    break;
+                case 'H':
+                    current = current > GFREC_KEY_INTERVAL ? current - GFREC_KEY_INTERVAL : 0;
+                    break;
+                case 'g':
+                    current = 0;
+                    break;
+                case 'G':
+                    current = frames - 1;
+                    break;
+                case ' ':
+                    playing = !playing;
+                    break;
+            }
+        }
+        nanosleep(&tick, NULL);
+    }
+    cleanup_screen();
+    frame_free(fb);
+    gfrec_reader_close(rd);
+    return 0;
+}
@@ -1,21 +1,77 @@
+#define _POSIX_C_SOURCE 200809L
 #include "gridfluid.h"
 #include <stdlib.h>
 #include <math.h>
 #include <string.h>
 #include <stdio.h>
 #include <assert.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "gfarena.h"
+#include "gfhalo.h"
+#include "gfpool.h"
+#include "gfring.h"
 
-//#define check_valid(cell) assert(cell->flags == GF_EMPTY || cell->flags == GF_OBSTACLE || ( cell->mass > 0 && cell->fluid > 0))
+#if defined(__x86_64__) || defined(__i386__)
+#define GF_HAVE_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+// Storage format of the distribution planes, chosen at build time:
+// GF_DF_FP16 or GF_DF_BF16 keep them as 16-bit floats, halving the lattice,
+// while everything else stays fp32. Arithmetic is always done in fp32; the
+// 16-bit formats store each distribution minus its rest weight, the value
+// it has in still fluid at unit density, so the bits go to the deviation
+// from rest instead of the weight itself.
+#if defined(GF_DF_FP16) && defined(GF_DF_BF16)
+#error "GF_DF_FP16 and GF_DF_BF16 are exclusive"
+#endif
+#if defined(GF_DF_FP16) || defined(GF_DF_BF16)
+#define GF_DF_SHIFTED 1
+typedef uint16_t gf_df_t;
+#else
+typedef float gf_df_t;
+#endif
+
+// The vector kernels need F16C for fp16 conversions.
+#ifdef GF_DF_FP16
+#define GF_DF_TARGET ",f16c"
+#else
+#define GF_DF_TARGET ""
+#endif
+
+//#define check_valid(gf,lat,c) assert(gf->flags[c] == GF_EMPTY || gf->flags[c] == GF_OBSTACLE || ( (lat)->mass[c] > 0 && (lat)->fluid[c] > 0))
 
 // negative mass is fine sometimes (emptied interface cells)
-#define check_valid(cell) assert(cell->flags == GF_EMPTY || cell->flags == GF_OBSTACLE || 1 || ( cell->mass > 0 && cell->fluid > 0))
+#define check_valid(gf,lat,c) assert(gf->flags[c] == GF_EMPTY || gf->flags[c] == GF_OBSTACLE || 1 || ( (lat)->mass[c] > 0 && (lat)->fluid[c] > 0))
 
-typedef struct gridfluid_cell {
-    float df[9];
-    gridfluid_state flags;
-    float mass;
-    float fluid;
-} gridfluid_cell_t;
+// One copy of the lattice state, stored as structure-of-arrays: each
+// distribution direction, the mass and the fluid fraction live in their own
+// contiguous plane so kernels touching one quantity stream through memory
+// with unit stride. All planes share a single allocation rooted at df[0],
+// which is either heap memory or, for a loaded checkpoint, a private
+// mapping of the file.
+typedef struct gridfluid_lattice {
+    gf_df_t *df[9];
+    float *mass;
+    float *fluid;
+    size_t mapped;  // bytes mapped at df[0], 0 if heap
+} gridfluid_lattice_t;
+
+#define GF_LATTICE_PLANES 11
+
+// Distance between the starts of two planes of n cells of size bytes: a
+// whole, odd number of cache lines. Packed planes of a power-of-two grid
+// would all start at the same offset within a huge page and so compete
+// for the same cache sets; the odd line staggers them.
+#define GF_PLANE_LINES(n,size) (((n)*(size) + 63) / 64)
+#define GF_PLANE_BYTES(n,size) ((GF_PLANE_LINES(n,size) | 1) * 64)
+#define GF_DF_BYTES(n) (9*GF_PLANE_BYTES(n, sizeof(gf_df_t)))
+#define GF_LATTICE_BYTES(n) (GF_DF_BYTES(n) + 2*GF_PLANE_BYTES(n, sizeof(float)))
 
 typedef enum e_gridfluid_change_flag {
     GF_CHANGE_NONE,
@@ -23,21 +79,150 @@ typedef enum e_gridfluid_change_flag {
     GF_CHANGE_FILLED
 } gridfluid_change_flag;
 
+// growable list of cell indices
+typedef struct gridfluid_list {
+    size_t *items;
+    size_t len;
+    size_t cap;
+} gridfluid_list_t;
+
+// Per-worker slice of a step: the rows it owns and its partial reductions,
+// which are combined in band order so results only depend on the number of
+// bands, never on thread timing.
+typedef struct gridfluid_band {
+    size_t y0;
+    size_t y1;
+    float total_mass;
+    size_t filled;
+    size_t emptied;
+    float max_pressure;
+    float min_pressure;
+    float max_usqr;
+    // largest change of a cell's density since the step before, see
+    // sleep_update
+    float max_change;
+    // cells this band flagged as filled or emptied, in row-major order
+    gridfluid_list_t changed;
+    // in-place mode: streamed rows not yet written back, see band_row
+    gridfluid_lattice_t *rows;
+    size_t nrows;
+    // keep neighbouring workers' counters off each other's cache lines
+    char pad[64];
+} gridfluid_band_t;
+
+// One row of a sleeping tile's cells: how active they were in the step
+// being swept and, while the tile sleeps, what they add to the band's
+// diagnostics in place of being swept. See sleep_update.
+typedef struct gridfluid_sleep_row {
+    float activity;
+    float mass;
+    float max_pressure;
+    float min_pressure;
+    float max_usqr;
+} gridfluid_sleep_row_t;
+
+typedef void (*gridfluid_collide_fn)(struct gridfluid *gf, gridfluid_band_t *band, gridfluid_lattice_t *lat, size_t begin, size_t end);
+
 struct gridfluid {
     size_t x;
     size_t y;
     float gravity;
     float atmosphere;
-    gridfluid_cell_t *grid;
-    gridfluid_cell_t *nextgrid;
+    // BGK relaxation rate
+    float omega;
+    // distance from a cell's index to its neighbour's in each direction of
+    // velocities
+    ptrdiff_t offset[9];
+    // per gridfluid_side; ghost holds a (ghost cell, source) pair for every
+    // ghost cell of a side that is not a wall, see ghost_fill
+    gridfluid_boundary boundary[4];
+    gridfluid_list_t ghost;
+    // cell flags are not touched by streaming, so one plane serves both lattices
+    uint8_t *flags;
+    // neighbour-state masks, see GF_NMASK; kept in step with flags by set_flag
+    uint32_t *nmask;
+    gridfluid_lattice_t grid;
+    // in in-place mode, where the step streams grid onto itself, its pages
+    // are given back to the kernel
+    gridfluid_lattice_t nextgrid;
+    int inplace;
+    // every per-cell plane is carved from the arena, see gridfluid_storage_t;
+    // grid and nextgrid are bound to its two lattice blocks unless a loaded
+    // checkpoint is mapped in place of one
+    gfarena_t arena;
+    void *lattice_block[2];
+    // worker count whose threads first touched the arena, 0 for none
+    size_t placed;
     gridfluid_properties_t *props;
-    gridfluid_change_flag *changeflags;
+    gridfluid_properties_t properties;
+    // gridfluid_change_flag per cell; GF_CHANGE_NONE outside of cleanup
+    uint8_t *changeflags;
+    // cells flagged by the last sweep, all bands concatenated in order
+    gridfluid_list_t changed;
+    // cells that turned into interface cells during the current cleanup
+    gridfluid_list_t fresh;
     size_t filled;
     size_t emptied;
+    gridfluid_simd simd;
+    gridfluid_collide_fn collide;
+    // the same kernel for runs of bulk cells, see GF_BULK
+    gridfluid_collide_fn collide_bulk;
+    gfpool_t pool;
+    size_t nbands;
+    gridfluid_band_t *bands;
+    // rows the step advances; all of them except in a partition, where the
+    // rest are copies of the neighbouring strips' edges
+    size_t row0;
+    size_t row1;
+    // partitioned mode: the global row of row 0, and the channels to the
+    // processes stepping the neighbouring strips
+    size_t origin;
+    gfhalo_t halo;
+    // cache blocking of the sweep; tile_x == 0 walks whole rows
+    size_t tile_x;
+    size_t tile_y;
+    int fused;
+    // sleeping tiles of GF_SLEEP_TILE cells square, sleep_nx by sleep_ny of
+    // them over the rows the step advances; sleep_steps == 0 keeps every
+    // tile awake. sleep_rows has sleep_nx entries per row of the scene.
+    float sleep_threshold;
+    unsigned sleep_steps;
+    size_t sleep_nx;
+    size_t sleep_ny;
+    uint8_t *asleep;
+    uint8_t *active;
+    unsigned *quiet;
+    gridfluid_sleep_row_t *sleep_rows;
+    // set when something other than the step changed the lattice, so every
+    // tile has to wake before the next one
+    int sleep_wake;
+    // set when the scene was edited since the last step, so the diagnostics
+    // gathered by the sweep no longer describe it
+    int props_dirty;
+    uint64_t step;
+    // event sinks; tracing is set while either is attached and is the only
+    // thing the solver checks when nothing listens
+    int tracing;
+    gridfluid_event_cb event_cb;
+    void *event_user;
+    gfring_t events;
+    size_t dropped_events;
 };
 
 static const float change_fudge = 0.0001;
 
+// cells streamed ahead of the collide kernel in the fused pass; a span of
+// all eleven lattice planes stays well inside L1
+#define GF_SPAN 256
+
+// bulk runs shorter than this go through the general kernels, which is
+// cheaper than splitting the span around them
+#define GF_BULK_RUN 8
+
+// side of a sleeping tile: small enough that the active area is not
+// rounded up by much, wide enough that the spans it cuts stay vectorized
+#define GF_SLEEP_TILE 32
+
 static const float weights[9] = { 4./9., 1./9., 1./9., 1./9., 1./9.,
                              1./36., 1./36., 1./36., 1./36. };
 
@@ -51,45 +236,405 @@ static const uint8_t rindex[9] = {
     0,3,4,1,2,7,8,5,6
 };
 
-#define GF_CELL(gf,cx,cy) (gf->grid[(cx) + (cy)*gf->x])
-#define GF_NEXTCELL(gf,cx,cy) (gf->nextgrid[(cx) + (cy)*gf->x])
+#define GF_IDX(gf,cx,cy) ((cx) + (cy)*gf->x)
+
+// The outer ring of cells is the ghost layer. The step advances and the
+// setters edit only the cells inside it, so c + gf->offset[i] is in the
+// grid for every cell the kernels visit, and they need no edge tests. The
+// ghost cells stand in for whatever lies beyond each side; see ghost_fill.
+
+// Every cell caches which of its eight neighbours are in each state: byte s
+// of nmask[c] is the mask of neighbours whose flags are s. Bit k of a mask
+// is the neighbour in direction scan_dir[k]; that is the dx-major order the
+// 3x3 loops have always visited neighbours in, so walking set bits from the
+// bottom up keeps every order-dependent sum unchanged.
+#define GF_NMASK(gf,c,state) ((uint8_t)((gf)->nmask[c] >> (8*(state))))
+
+// A bulk cell is a fluid cell whose eight neighbours are all fluid: it
+// streams from every direction and exchanges mass unweighted, so the sweep
+// runs it through kernels with no flag tests.
+#define GF_BULK(gf,c) ((gf)->flags[c] == GF_FLUID && GF_NMASK(gf,c,GF_FLUID) == 0xff)
+
+static const uint8_t scan_dir[8] = {
+    7,3,6,4,2,8,1,5
+};
+
+static const uint8_t dir_bit[9] = {
+    0, 1<<6, 1<<4, 1<<1, 1<<3, 1<<7, 1<<2, 1<<0, 1<<5
+};
+
+
+#if defined(GF_DF_FP16) && defined(__F16C__)
+static float df_widen(uint16_t h) {
+    return( _cvtsh_ss(h) );
+}
+
+static uint16_t df_narrow(float f) {
+    return( _cvtss_sh(f, _MM_FROUND_TO_NEAREST_INT) );
+}
+#elif defined(GF_DF_FP16)
+static float df_widen(uint16_t h) {
+    uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+    uint32_t exp = (h >> 10) & 0x1f;
+    uint32_t man = h & 0x3ff;
+    uint32_t bits;
+    float f;
+    if (!exp) {
+        f = man * 0x1p-24f;
+        return( sign ? -f : f );
+    }
+    if (exp == 0x1f)
+        bits = sign | 0x7f800000 | man << 13;
+    else
+        bits = sign | (exp + 112) << 23 | man << 13;
+    memcpy(&f, &bits, sizeof(f));
+    return( f );
+}
+
+// rounds to nearest even, like the F16C instructions the vector kernels use
+static uint16_t df_narrow(float f) {
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    uint16_t sign = (bits >> 16) & 0x8000;
+    uint32_t a = bits & 0x7fffffff;
+    if (a > 0x7f800000)
+        return( sign | 0x7e00 | (a >> 13) );
+    if (a >= 0x477ff000)
+        return( sign | 0x7c00 );
+    if (a < 0x38800000) {
+        float v;
+        memcpy(&v, &a, sizeof(v));
+        return( sign | (uint16_t)lrintf(v * 0x1p24f) );
+    }
+    a += 0xfff + ((a >> 13) & 1);
+    return( sign | (uint16_t)((a - 0x38000000) >> 13) );
+}
+#elif defined(GF_DF_BF16)
+static float df_widen(uint16_t h) {
+    uint32_t bits = (uint32_t)h << 16;
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return( f );
+}
+
+static uint16_t df_narrow(float f) {
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    bits += 0x7fff + ((bits >> 16) & 1);
+    return( bits >> 16 );
+}
+#endif
+
+static inline float df_get(const gridfluid_lattice_t *lat, size_t i, size_t c) {
+#ifdef GF_DF_SHIFTED
+    return( df_widen(lat->df[i][c]) + weights[i] );
+#else
+    return( lat->df[i][c] );
+#endif
+}
+
+static inline void df_put(gridfluid_lattice_t *lat, size_t i, size_t c, float f) {
+#ifdef GF_DF_SHIFTED
+    lat->df[i][c] = df_narrow(f - weights[i]);
+#else
+    lat->df[i][c] = f;
+#endif
+}
+
+static void load_df(const gridfluid_lattice_t *lat, size_t c, float df[9]) {
+    for (size_t i = 0; i<9; i++) {
+        df[i] = df_get(lat, i, c);
+    }
+}
 
+static void store_df(gridfluid_lattice_t *lat, size_t c, const float df[9]) {
+    for (size_t i = 0; i<9; i++) {
+        df_put(lat, i, c, df[i]);
+    }
+}
 
-static void update_cell(gridfluid_cell_t *cell, float df[9], gridfluid_state flags, float mass, float fluid) {
+static void update_cell(gridfluid_t gf, gridfluid_lattice_t *lat, size_t c, float df[9], float mass, float fluid) {
     /*
-    check_valid(cell);
+    check_valid(gf,lat,c);
     for (size_t i = 0; i<9; i++) {
         assert(df[i] >= 0);
     }
     */
-    memcpy(cell->df, df, 9*sizeof(float));
-    cell->flags = flags;
-    cell->mass = mass;
-    cell->fluid = fluid;
-    check_valid(cell);
+    store_df(lat, c, df);
+    lat->mass[c] = mass;
+    lat->fluid[c] = fluid;
+    check_valid(gf,lat,c);
+}
+
+static void lattice_bind(gridfluid_lattice_t *lat, void *planes, size_t n) {
+    for (size_t i = 0; i<9; i++) {
+        lat->df[i] = (gf_df_t *)((char *)planes + i*GF_PLANE_BYTES(n, sizeof(gf_df_t)));
+    }
+    lat->mass = (float *)((char *)planes + GF_DF_BYTES(n));
+    lat->fluid = (float *)((char *)lat->mass + GF_PLANE_BYTES(n, sizeof(float)));
+}
+
+static int lattice_alloc(gridfluid_lattice_t *lat, size_t n) {
+    void *planes = calloc(GF_LATTICE_BYTES(n), 1);
+    if (!planes)
+        return 0;
+    lattice_bind(lat, planes, n);
+    lat->mapped = 0;
+    return 1;
+}
+
+static void lattice_free(gridfluid_lattice_t *lat) {
+    if (lat->mapped)
+        munmap(lat->df[0], lat->mapped);
+    else
+        free(lat->df[0]);
+}
+
+// The per-cell planes of a scene, in the order they are carved from its
+// arena. Each lattice stays one block so a checkpoint maps straight onto it.
+typedef struct gridfluid_storage {
+    gfarena_t arena;
+    uint8_t *flags;
+    uint32_t *nmask;
+    uint8_t *changeflags;
+    float *pressure;
+    float *mass;
+    void *lattice[2];
+} gridfluid_storage_t;
+
+static int storage_alloc(gridfluid_storage_t *st, size_t n) {
+    size_t capacity = 2*GFARENA_ROUND(n) + GFARENA_ROUND(n*sizeof(uint32_t))
+        + 2*GFARENA_ROUND(n*sizeof(float)) + 2*GFARENA_ROUND(GF_LATTICE_BYTES(n));
+    st->arena = gfarena_create(capacity, 1);
+    if (!st->arena)
+        return 0;
+    st->flags = gfarena_alloc(st->arena, n);
+    st->nmask = gfarena_alloc(st->arena, n*sizeof(uint32_t));
+    st->changeflags = gfarena_alloc(st->arena, n);
+    st->pressure = gfarena_alloc(st->arena, n*sizeof(float));
+    st->mass = gfarena_alloc(st->arena, n*sizeof(float));
+    st->lattice[0] = gfarena_alloc(st->arena, GF_LATTICE_BYTES(n));
+    st->lattice[1] = gfarena_alloc(st->arena, GF_LATTICE_BYTES(n));
+    return 1;
+}
+
+static void storage_bind(gridfluid_t gf, const gridfluid_storage_t *st) {
+    size_t n = gf->x * gf->y;
+    gf->arena = st->arena;
+    gf->flags = st->flags;
+    gf->nmask = st->nmask;
+    gf->changeflags = st->changeflags;
+    gf->props->pressure = st->pressure;
+    gf->props->mass = st->mass;
+    for (size_t i = 0; i < 2; i++) {
+        gf->lattice_block[i] = st->lattice[i];
+    }
+    lattice_bind(&gf->grid, st->lattice[0], n);
+    gf->grid.mapped = 0;
+    lattice_bind(&gf->nextgrid, st->lattice[1], n);
+    gf->nextgrid.mapped = 0;
+}
+
+static void storage_free(gridfluid_t gf) {
+    if (gf->grid.mapped)
+        lattice_free(&gf->grid);
+    if (gf->nextgrid.mapped)
+        lattice_free(&gf->nextgrid);
+    gfarena_free(gf->arena);
 }
 
-float omega=0.50;
+// the lattice block of the arena that grid is not bound to
+static void *lattice_spare(gridfluid_t gf) {
+    return( (void *)gf->grid.df[0] == gf->lattice_block[0] ? gf->lattice_block[1] : gf->lattice_block[0] );
+}
+
+static void list_push(gridfluid_list_t *list, size_t item) {
+    if (list->len == list->cap) {
+        size_t cap = list->cap ? list->cap*2 : 64;
+        size_t *items = realloc(list->items, cap*sizeof(size_t));
+        if (!items)
+            abort();
+        list->items = items;
+        list->cap = cap;
+    }
+    list->items[list->len++] = item;
+}
+
+static void list_free(gridfluid_list_t *list) {
+    free(list->items);
+    list->items = NULL;
+    list->len = list->cap = 0;
+}
+
+// Changes the state of cell c and patches the masks of its neighbours.
+// All flag changes after creation go through here, ghost cells' included,
+// so unlike the kernels it checks for the edges of the grid.
+static void set_flag(gridfluid_t gf, size_t c, gridfluid_state state) {
+    gridfluid_state old = gf->flags[c];
+    if (old == state)
+        return;
+    gf->flags[c] = state;
+    size_t x = c % gf->x;
+    size_t y = c / gf->x;
+    for (size_t i=1; i<9; i++) {
+        int dx = velocities[i][0];
+        int dy = velocities[i][1];
+        if ((dx < 0 && x == 0) || (dx > 0 && x+1 == gf->x) ||
+            (dy < 0 && y == 0) || (dy > 0 && y+1 == gf->y))
+            continue;
+        // seen from the neighbour, c lies in the opposite direction
+        uint32_t bit = dir_bit[rindex[i]];
+        gf->nmask[c + gf->offset[i]] ^= (bit << (8*old)) | (bit << (8*state));
+    }
+}
+
+// The mask of cell (x, y), checking for the edges of the grid.
+static uint32_t nmask_edge(gridfluid_t gf, size_t x, size_t y) {
+    size_t c = GF_IDX(gf,x,y);
+    uint32_t mask = 0;
+    for (size_t i=1; i<9; i++) {
+        int dx = velocities[i][0];
+        int dy = velocities[i][1];
+        if ((dx < 0 && x == 0) || (dx > 0 && x+1 == gf->x) ||
+            (dy < 0 && y == 0) || (dy > 0 && y+1 == gf->y))
+            continue;
+        mask |= dir_bit[i] << (8*gf->flags[c + gf->offset[i]]);
+    }
+    return( mask );
+}
+
+// Recomputes the masks of the cells in [x0,x1) x [y0,y1). Only cells on
+// the edges of the grid need the checks.
+static void nmask_rebuild_rect(gridfluid_t gf, size_t x0, size_t y0, size_t x1, size_t y1) {
+    if (x0 >= x1)
+        return;
+    for (size_t y = y0; y < y1; y++) {
+        if (y == 0 || y+1 == gf->y) {
+            for (size_t x = x0; x < x1; x++)
+                gf->nmask[GF_IDX(gf,x,y)] = nmask_edge(gf, x, y);
+            continue;
+        }
+        size_t i0 = x0 ? x0 : 1;
+        size_t i1 = x1 < gf->x ? x1 : gf->x - 1;
+        if (x0 < i0)
+            gf->nmask[GF_IDX(gf,x0,y)] = nmask_edge(gf, x0, y);
+        for (size_t c = GF_IDX(gf,i0,y); c < GF_IDX(gf,i1,y); c++) {
+            uint32_t mask = 0;
+            for (size_t i=1; i<9; i++)
+                mask |= dir_bit[i] << (8*gf->flags[c + gf->offset[i]]);
+            gf->nmask[c] = mask;
+        }
+        if (i1 < x1)
+            gf->nmask[GF_IDX(gf,i1,y)] = nmask_edge(gf, i1, y);
+    }
+}
+
+static void nmask_rebuild(gridfluid_t gf) {
+    nmask_rebuild_rect(gf, 0, 0, gf->x, gf->y);
+}
+
+// Whether row y is a ghost row. In a partition only the domain's first and
+// last rows are; the rows past a strip's own are its neighbours' edges.
+static int ghost_row(gridfluid_t gf, size_t y) {
+    return( (y == 0 && gf->row0 == 1) || (y + 1 == gf->y && gf->row1 == y) );
+}
+
+static int is_ghost(gridfluid_t gf, size_t x, size_t y) {
+    return( x == 0 || x + 1 == gf->x || ghost_row(gf, y) );
+}
+
+// Where a ghost at coordinate v of an axis of len cells takes its state
+// from: across the domain for a periodic side, next to it for an open one.
+static size_t ghost_axis(gridfluid_boundary b, size_t v, size_t len) {
+    if (b == GF_BOUNDARY_PERIODIC)
+        return( v ? 1 : len - 2 );
+    return( v ? len - 2 : 1 );
+}
+
+// The interior cell ghost cell c mirrors, or SIZE_MAX if it lies on a wall.
+static size_t ghost_source(gridfluid_t gf, size_t c) {
+    size_t x = c % gf->x;
+    size_t y = c / gf->x;
+    if (x == 0 || x + 1 == gf->x) {
+        gridfluid_boundary b = gf->boundary[x ? GF_SIDE_RIGHT : GF_SIDE_LEFT];
+        if (b == GF_BOUNDARY_WALL)
+            return( SIZE_MAX );
+        x = ghost_axis(b, x, gf->x);
+    }
+    if (ghost_row(gf, y)) {
+        gridfluid_boundary b = gf->boundary[y ? GF_SIDE_BOTTOM : GF_SIDE_TOP];
+        if (b == GF_BOUNDARY_WALL)
+            return( SIZE_MAX );
+        y = ghost_axis(b, y, gf->y);
+    }
+    return( GF_IDX(gf,x,y) );
+}
+
+// The cell that converting neighbour n should change: n itself, or for a
+// ghost of a periodic side the cell across the domain it mirrors. Ghosts of
+// open sides give SIZE_MAX; the next ghost_fill overwrites them anyway.
+static size_t ghost_target(gridfluid_t gf, size_t n) {
+    if (!gf->ghost.len)
+        return( n );
+    size_t x = n % gf->x;
+    size_t y = n / gf->x;
+    if ((x == 0 || x + 1 == gf->x) && gf->boundary[x ? GF_SIDE_RIGHT : GF_SIDE_LEFT] != GF_BOUNDARY_PERIODIC)
+        return( SIZE_MAX );
+    if (ghost_row(gf, y) && gf->boundary[y ? GF_SIDE_BOTTOM : GF_SIDE_TOP] != GF_BOUNDARY_PERIODIC)
+        return( SIZE_MAX );
+    return( is_ghost(gf, x, y) ? ghost_source(gf, n) : n );
+}
+
+// Copies every ghost cell of a side that is not a wall from its source, so
+// the kernels see across periodic sides and a zero gradient at open ones
+// without testing for either. Flags go first, through set_flag so the
+// cells next to the ghosts see them; the masks are copied after, since
+// set_flag on one ghost disturbs those of the ghosts next to it. Runs
+// before the sweep and again before cleanup.
+static void ghost_fill(gridfluid_t gf) {
+    const gridfluid_list_t *ghost = &gf->ghost;
+    gridfluid_lattice_t *lat = &gf->grid;
+    for (size_t k = 0; k < ghost->len; k += 2) {
+        set_flag(gf, ghost->items[k], gf->flags[ghost->items[k+1]]);
+    }
+    for (size_t k = 0; k < ghost->len; k += 2) {
+        size_t g = ghost->items[k];
+        size_t s = ghost->items[k+1];
+        for (size_t i = 0; i<9; i++) {
+            lat->df[i][g] = lat->df[i][s];
+        }
+        lat->mass[g] = lat->mass[s];
+        lat->fluid[g] = lat->fluid[s];
+        gf->nmask[g] = gf->nmask[s];
+    }
+}
 
-static void neighcount(gridfluid_t gf, size_t x, size_t y, size_t *empty, size_t *fluid) {
-    *fluid = 0;
-    *empty = 0;
-    for (int dx = -1; dx <= 1; dx++) {
-        for (int dy = -1; dy <= 1; dy++) {
-            if (dx == 0 && dx == dy)
+// Lists the ghost cells ghost_fill copies and turns the rest, those on
+// walls, into empty obstacles.
+static void ghost_build(gridfluid_t gf) {
+    gf->ghost.len = 0;
+    for (size_t y = 0; y < gf->y; y++) {
+        int row = ghost_row(gf, y);
+        for (size_t x = 0; x < gf->x; x += row || x + 1 == gf->x ? 1 : gf->x - 1) {
+            size_t c = GF_IDX(gf,x,y);
+            size_t s = ghost_source(gf, c);
+            if (s != SIZE_MAX) {
+                list_push(&gf->ghost, c);
+                list_push(&gf->ghost, s);
                 continue;
-            switch(GF_CELL(gf, x+dx, y+dy).flags) {
-                case GF_FLUID:
-                    *fluid = *fluid+1;
-                    break;
-                case GF_EMPTY:
-                    *empty = *empty+1;
-                    break;
-                default:
-                    break;
             }
+            set_flag(gf, c, GF_OBSTACLE);
+            gf->grid.mass[c] = gf->grid.fluid[c] = 0;
+            if (!gf->inplace)
+                gf->nextgrid.mass[c] = gf->nextgrid.fluid[c] = 0;
         }
     }
+    ghost_fill(gf);
+}
+
+static void neighcount(gridfluid_t gf, size_t c, size_t *empty, size_t *fluid) {
+    *fluid = __builtin_popcount(GF_NMASK(gf, c, GF_FLUID));
+    *empty = __builtin_popcount(GF_NMASK(gf, c, GF_EMPTY));
 }
 
 static void gridfluid_cell_macro(float *df, float *pressure, float *ux, float *uy) {
@@ -104,9 +649,10 @@ static void gridfluid_cell_macro(float *df, float *pressure, float *ux, float *u
     }
 }
 
-static void gridfluid_cell_normal(gridfluid_t gf, size_t x, size_t y, float *ux, float *uy) {
-    *ux = (GF_CELL(gf,x-1,y).fluid - GF_CELL(gf,x+1,y).fluid)/2;
-    *uy = (GF_CELL(gf,x,y-1).fluid - GF_CELL(gf,x,y+1).fluid)/2;
+static void gridfluid_cell_normal(gridfluid_t gf, size_t c, float *ux, float *uy) {
+    const float *fluid = gf->grid.fluid;
+    *ux = (fluid[c-1] - fluid[c+1])/2;
+    *uy = (fluid[c - gf->x] - fluid[c + gf->x])/2;
 }
 
 static float dot2f(float ax, float ay, float bx, float by) {
@@ -127,419 +673,2216 @@ static void gridfluid_eq(float pressure, float ux, float uy, float *eq) {
     }
 }
 
-static void gridfluid_stream(gridfluid_t gf) {
-    for (size_t x = 0; x < gf->x; x++) {
-        for (size_t y = 0; y < gf->y; y++) {
-            gridfluid_cell_t *source = &GF_CELL(gf,x,y);
-            gridfluid_state flags = source->flags;
-            float df[9] = {0,0,0,0,0,0,0,0,0};
-            float mass = source->mass;
-            float fluid;
-            //check_valid(source);
-            float pressure=0;
-            size_t emptycount;
-            size_t fluidcount;
-            switch (source->flags) {
-                case GF_FLUID:
-                    for (size_t i=0; i<9; i++) {
-                        size_t o = rindex[i];
-                        int8_t dx = velocities[i][0];
-                        int8_t dy = velocities[i][1];
-                        gridfluid_cell_t *neigh = &GF_CELL(gf,x+dx,y+dy);
-                        switch(neigh->flags) {
-                            case GF_OBSTACLE:
-                                df[o] = source->df[i];
-                                break;
-                            case GF_FLUID:
-                            case GF_INTERFACE:
-                                mass += neigh->df[o];
-                                mass -= source->df[i];
-                                df[o] = neigh->df[o];
-                                break;
-                            default:
-                                break;
-                        }
-                        pressure += df[o];
-                        fluid = 1;
-                        //dest->mass = pressure;
+// Pull-streams a run of bulk cells [x0,x1) of row y. This is what
+// gridfluid_stream_span does for a fluid cell with only fluid neighbours,
+// direction by direction over the whole run instead of cell by cell; each
+// cell's mass still sees the same additions in the same order.
+static void gridfluid_stream_bulk(gridfluid_t gf, gridfluid_band_t *band, gridfluid_lattice_t *dst,
+                                  size_t y, size_t x0, size_t x1) {
+    const gridfluid_lattice_t *src = &gf->grid;
+    size_t c0 = GF_IDX(gf,x0,y);
+    size_t c1 = GF_IDX(gf,x1,y);
+    for (size_t c = c0; c < c1; c++) {
+        dst->mass[c] = src->mass[c];
+    }
+    for (size_t i=0; i<9; i++) {
+        size_t o = rindex[i];
+        ptrdiff_t off = gf->offset[i];
+        for (size_t c = c0; c < c1; c++) {
+            float in = df_get(src, o, c + off);
+            dst->mass[c] += in;
+            dst->mass[c] -= df_get(src, i, c);
+            df_put(dst, o, c, in);
+        }
+    }
+    for (size_t c = c0; c < c1; c++) {
+        dst->fluid[c] = 1;
+        band->total_mass += dst->mass[c];
+    }
+}
+
+// Pull-streams cells [x0,x1) of row y from grid into dst.
+static void gridfluid_stream_span(gridfluid_t gf, gridfluid_band_t *band, gridfluid_lattice_t *dst,
+                                  size_t y, size_t x0, size_t x1) {
+    const gridfluid_lattice_t *src = &gf->grid;
+    for (size_t c = GF_IDX(gf,x0,y); c < GF_IDX(gf,x1,y); c++) {
+        float sdf[9];
+        float df[9] = {0,0,0,0,0,0,0,0,0};
+        float mass = src->mass[c];
+        float fluid;
+        //check_valid(gf,src,c);
+        float pressure=0;
+        size_t emptycount;
+        size_t fluidcount;
+        switch (gf->flags[c]) {
+            case GF_FLUID:
+                load_df(src, c, sdf);
+                for (size_t i=0; i<9; i++) {
+                    size_t o = rindex[i];
+                    size_t n = c + gf->offset[i];
+                    switch(gf->flags[n]) {
+                        case GF_OBSTACLE:
+                            df[o] = sdf[i];
+                            break;
+                        case GF_FLUID:
+                        case GF_INTERFACE:
+                            mass += df_get(src, o, n);
+                            mass -= sdf[i];
+                            df[o] = df_get(src, o, n);
+                            break;
+                        default:
+                            break;
                     }
-                    break;
-                case GF_INTERFACE:
-                    neighcount(gf, x, y, &emptycount, &fluidcount);
-                    float eqdf[9];
-                    float oldpressure, ux, uy;
-                    float nx, ny;
-                    gridfluid_cell_normal(gf, x, y, &nx, &ny);
-                    gridfluid_cell_macro(source->df, &oldpressure, &ux, &uy);
-                    gridfluid_eq(gf->atmosphere, ux, uy, eqdf);
-                    for (size_t i=1; i<9; i++) {
-                        size_t o = rindex[i];
-                        int8_t dx = velocities[i][0];
-                        int8_t dy = velocities[i][1];
-                        size_t iemptycount, ifluidcount;
-                        gridfluid_cell_t *neigh = &GF_CELL(gf,x+dx,y+dy);
-                        switch(neigh->flags) {
-                            case GF_OBSTACLE:
-                                df[o] = source->df[i];
-                                break;
-                            case GF_FLUID:
-                                mass += neigh->df[o];
-                                mass -= source->df[i];
-                                df[o] = neigh->df[o];
-                                break;
-                            case GF_INTERFACE:
-                                df[o] = neigh->df[o];
-                                neighcount(gf, x+dx, y+dy, &iemptycount, &ifluidcount);
-                                float fluidratio = (source->fluid + neigh->fluid)/2;
-                                int tmp1 = emptycount == iemptycount && fluidcount == ifluidcount;
-                                float deltamass = 0;
-                                if (tmp1 || !emptycount || !ifluidcount)
-                                    deltamass += neigh->df[o];
-                                if (tmp1 || !iemptycount || !fluidcount)
-                                    deltamass -= source->df[i];
-                                mass += deltamass * fluidratio;
-                                break;
-                            case GF_EMPTY:
-                                df[o] = eqdf[i] + eqdf[o] - source->df[i];
-                                break;
-                            default:
-                                abort();
-                                break;
-                        }
-                        if (neigh->flags != GF_EMPTY && dot2f(nx, ny, dx, dy) > 0)
-                            df[o] = eqdf[i] + eqdf[o] - source->df[i];
-                        pressure += df[o];
-                        //if (df[o] < 0)
-                        //    abort();
+                    pressure += df[o];
+                    fluid = 1;
+                    //dest->mass = pressure;
+                }
+                break;
+            case GF_INTERFACE:
+                load_df(src, c, sdf);
+                neighcount(gf, c, &emptycount, &fluidcount);
+                float eqdf[9];
+                float oldpressure, ux, uy;
+                float nx, ny;
+                gridfluid_cell_normal(gf, c, &nx, &ny);
+                gridfluid_cell_macro(sdf, &oldpressure, &ux, &uy);
+                gridfluid_eq(gf->atmosphere, ux, uy, eqdf);
+                for (size_t i=1; i<9; i++) {
+                    size_t o = rindex[i];
+                    int8_t dx = velocities[i][0];
+                    int8_t dy = velocities[i][1];
+                    size_t iemptycount, ifluidcount;
+                    size_t n = c + gf->offset[i];
+                    gridfluid_state nflags = gf->flags[n];
+                    switch(nflags) {
+                        case GF_OBSTACLE:
+                            df[o] = sdf[i];
+                            break;
+                        case GF_FLUID:
+                            mass += df_get(src, o, n);
+                            mass -= sdf[i];
+                            df[o] = df_get(src, o, n);
+                            break;
+                        case GF_INTERFACE:
+                            df[o] = df_get(src, o, n);
+                            neighcount(gf, n, &iemptycount, &ifluidcount);
+                            float fluidratio = (src->fluid[c] + src->fluid[n])/2;
+                            int tmp1 = emptycount == iemptycount && fluidcount == ifluidcount;
+                            float deltamass = 0;
+                            if (tmp1 || !emptycount || !ifluidcount)
+                                deltamass += df_get(src, o, n);
+                            if (tmp1 || !iemptycount || !fluidcount)
+                                deltamass -= sdf[i];
+                            mass += deltamass * fluidratio;
+                            break;
+                        case GF_EMPTY:
+                            df[o] = eqdf[i] + eqdf[o] - sdf[i];
+                            break;
+                        default:
+                            abort();
+                            break;
                     }
-                    fluid = mass/pressure;
-                    break;
-                case GF_OBSTACLE:
-                case GF_EMPTY:
-                    fluid = 0;
-                    mass = 0;
-                    break;
-            }
-            gridfluid_cell_t *dest = &GF_NEXTCELL(gf,x,y);
-            update_cell(dest,df,flags,mass,fluid);
-            check_valid(dest);
-            gf->props->total_mass += dest->mass;
+                    if (nflags != GF_EMPTY && dot2f(nx, ny, dx, dy) > 0)
+                        df[o] = eqdf[i] + eqdf[o] - sdf[i];
+                    pressure += df[o];
+                    //if (df[o] < 0)
+                    //    abort();
+                }
+                fluid = mass/pressure;
+                break;
+            case GF_OBSTACLE:
+            case GF_EMPTY:
+            default:
+                fluid = 0;
+                mass = 0;
+                break;
         }
+        update_cell(gf,dst,c,df,mass,fluid);
+        band->total_mass += mass;
     }
 }
 
-static void gridfluid_collide(gridfluid_t gf) {
+// Equilibrium used by the collision kernels. Unlike gridfluid_eq it stays in
+// single precision and fixes the evaluation order, so the scalar and SIMD
+// kernels below produce bit-identical lattices on every dispatch target.
+static void gridfluid_collide_eq(float pressure, float ux, float uy, float *eq) {
+    float usqr = ux*ux + uy*uy;
+    for (size_t i=0; i<9; i++) {
+        float edotu = velocities[i][0]*ux + velocities[i][1]*uy;
+        eq[i] = weights[i] * (pressure + 3*edotu - 1.5f*usqr + 4.5f*edotu*edotu);
+    }
+}
+
+static void collide_mark_change(gridfluid_t gf, gridfluid_band_t *band, const gridfluid_lattice_t *lat, size_t i) {
+    float mass = lat->mass[i];
+    if (mass > 1 + change_fudge) {
+        gf->changeflags[i] = GF_CHANGE_FILLED;
+        band->filled++;
+        list_push(&band->changed, i);
+    }
+    if (mass < 0 - change_fudge) {
+        gf->changeflags[i] = GF_CHANGE_EMPTIED;
+        band->emptied++;
+        list_push(&band->changed, i);
+    }
+}
+
+// Folds one or more lanes of the kernels' running extrema into the band.
+static void band_fold(gridfluid_band_t *band, const float *max_pressure, const float *min_pressure,
+                      const float *max_usqr, const float *max_change, size_t lanes) {
+    for (size_t l = 0; l < lanes; l++) {
+        if (max_pressure[l] > band->max_pressure)
+            band->max_pressure = max_pressure[l];
+        if (min_pressure[l] < band->min_pressure)
+            band->min_pressure = min_pressure[l];
+        if (max_usqr[l] > band->max_usqr)
+            band->max_usqr = max_usqr[l];
+        if (max_change[l] > band->max_change)
+            band->max_change = max_change[l];
+    }
+}
+
+// Each kernel body takes constant bulk and track flags and is expanded for
+// each: the general kernel tests cell types, the bulk one knows every cell
+// is fluid, and only with track does it gather the density change that
+// sleeping tiles go by, so a scene that never sleeps does not pay for it.
+__attribute__((always_inline))
+static inline void collide_scalar_cells(gridfluid_t gf, gridfluid_band_t *band, gridfluid_lattice_t *lat, size_t begin, size_t end, int bulk, int track) {
+    const float omega = gf->omega;
     float pressure=0;
     float ux=0;
     float uy=0;
+    float df[9];
     float eq[9];
-    gf->filled = 0;
-    gf->emptied = 0;
-    memset(gf->changeflags, 0, gf->x * gf->y * sizeof(gridfluid_change_flag));
-    for (size_t i=0; i < gf->x * gf->y; i++) {
-        gridfluid_cell_t *cell = &gf->grid[i];
-        if (cell->flags != GF_FLUID && cell->flags != GF_INTERFACE) {
+    float max_pressure = band->max_pressure;
+    float min_pressure = band->min_pressure;
+    float max_usqr = band->max_usqr;
+    float max_change = band->max_change;
+    for (size_t i=begin; i < end; i++) {
+        uint8_t flags = bulk ? GF_FLUID : gf->flags[i];
+        if (flags != GF_FLUID && flags != GF_INTERFACE) {
             continue;
         }
-        gridfluid_cell_macro(cell->df, &pressure, &ux, &uy);
+        load_df(lat, i, df);
+        gridfluid_cell_macro(df, &pressure, &ux, &uy);
         if (pressure > 100000)
             abort();
+        // the reported velocity is the cell's own, without the forcing
+        float usqr = ux*ux + uy*uy;
         uy += gf->gravity;
-        gridfluid_eq(pressure, ux, uy, eq);
+        gridfluid_collide_eq(pressure, ux, uy, eq);
+        if (pressure > max_pressure)
+            max_pressure = pressure;
+        if (pressure < min_pressure)
+            min_pressure = pressure;
+        if (usqr > max_usqr)
+            max_usqr = usqr;
+        // the pressure the cell had after the last step's stream
+        float change = track ? fabsf(pressure - gf->props->pressure[i]) : 0;
+        if (change > max_change)
+            max_change = change;
+        float mass = lat->mass[i];
         gf->props->pressure[i] = pressure;
-        gf->props->mass[i] = cell->mass;
-        cell->fluid = cell->mass/pressure;
-        if (cell->flags == GF_INTERFACE && cell->mass > 1 + change_fudge) {
-            gf->changeflags[i] = GF_CHANGE_FILLED;
-            gf->filled++;
-        }
-        if (cell->flags == GF_INTERFACE && cell->mass < 0 - change_fudge) {
-            gf->changeflags[i] = GF_CHANGE_EMPTIED;
-            gf->emptied++;
-        }
+        gf->props->mass[i] = mass;
+        lat->fluid[i] = mass/pressure;
+        if (flags == GF_INTERFACE)
+            collide_mark_change(gf, band, lat, i);
         for (size_t j=0; j<9; j++) {
-            float f = cell->df[j];
+            float f = df[j];
             //float nf = f - omega * (f - eq[j]);
             float nf = f * (1-omega) + omega * eq[j];
             //if (nf < 0)
             //    abort();
-            cell->df[j] = nf;
+            df_put(lat, j, i, nf);
         }
     }
+    band->max_pressure = max_pressure;
+    band->min_pressure = min_pressure;
+    band->max_usqr = max_usqr;
+    band->max_change = max_change;
 }
 
-static void gridfluid_avg_macro(gridfluid_t gf, size_t x, size_t y, float *pressure, float *ux, float *uy) {
-    float tpressure = 0;
-    float tux = 0;
-    float tuy = 0;
-    size_t count = 0;
-    for (int dx = -1; dx <= 1; dx++) {
-        for (int dy = -1; dy <= 1; dy++) {
-            float ipressure;
-            float iux;
-            float iuy;
-            if (dx == 0 && dx == dy)
-                continue;
-            gridfluid_cell_t *cell = &GF_CELL(gf, x+dx, y+dy);
-            switch(cell->flags) {
-                case GF_FLUID:
-                case GF_INTERFACE:
-                    gridfluid_cell_macro(cell->df, &ipressure, &iux, &iuy);
-                    count++;
-                    tpressure += ipressure;
-                    tux += iux;
-                    tuy += iuy;
-                    break;
-                default:
-                    break;
-            }
-        }
-    }
-    if (count == 0)
-        return;
-    *pressure = tpressure / count;
-    *ux = tux / count;
-    *uy = tuy / count;
+static void collide_scalar(gridfluid_t gf, gridfluid_band_t *band, gridfluid_lattice_t *lat, size_t begin, size_t end) {
+    if (gf->sleep_steps)
+        collide_scalar_cells(gf, band, lat, begin, end, 0, 1);
+    else
+        collide_scalar_cells(gf, band, lat, begin, end, 0, 0);
 }
 
-static void distribmass(gridfluid_t gf, size_t x, size_t y) {
-    float partials[9] = {0,0,0,0,0,0,0};
-    float total = 0;
-    size_t count = 0;
-    float nx=0;
-    float ny=0;
-    gridfluid_cell_normal(gf, x, y, &nx, &ny);
-    gridfluid_change_flag change = gf->changeflags[x + y*gf->x];
-    gridfluid_cell_t *source = &GF_CELL(gf, x, y);
-    int mul = (change == GF_CHANGE_FILLED) ? 1 : -1;
-    float mass = 0;
-    float pressure, ux, uy;
-    if (change == GF_CHANGE_FILLED) {
-        gridfluid_cell_macro(source->df, &pressure, &ux, &uy);
-        mass = source->mass - pressure;
-    } else if (change == GF_CHANGE_EMPTIED) {
-        mass = source->mass;
-    }
-    for (size_t i=0; i<9; i++) {
-        int dx = velocities[i][0];
-        int dy = velocities[i][1];
-        if (dx == 0 && dx == dy)
-            continue;
-        gridfluid_cell_t *neigh = &GF_CELL(gf, x+dx, y+dy);
-        if (neigh->flags != GF_INTERFACE)
-            continue;
-        float n_e = dot2f(nx,ny,dx,dy) * mul;
-        if (n_e > 0) {
-            total += n_e;
-            partials[i] = n_e;
-            count++;
-        }
-
-    }
-    if (count == 0) {
-        return;
-    }
-    for (size_t i=0; i<9; i++) {
-        int dx = velocities[i][0];
-        int dy = velocities[i][1];
-        gridfluid_cell_t *neigh = &GF_CELL(gf, x+dx, y+dy);
-        gridfluid_cell_macro(neigh->df, &pressure, &ux, &uy);
-        if (dx == 0 && dx == dy) {
-            source->mass -= mass;
-            gf->props->total_mass -= mass;
-            source->fluid = source->mass/pressure;
-            check_valid(source);
-            continue;
-        }
-        if (neigh->flags != GF_INTERFACE)
-            continue;
-        gridfluid_cell_macro(neigh->df, &pressure, &ux, &uy);
-        float deltamass = mass * partials[i]/total;
-        neigh->mass += deltamass;
-        gf->props->total_mass += deltamass;
-        neigh->fluid = neigh->mass/pressure;
-        check_valid(neigh);
-    }
+static void collide_scalar_bulk(gridfluid_t gf, gridfluid_band_t *band, gridfluid_lattice_t *lat, size_t begin, size_t end) {
+    if (gf->sleep_steps)
+        collide_scalar_cells(gf, band, lat, begin, end, 1, 1);
+    else
+        collide_scalar_cells(gf, band, lat, begin, end, 1, 0);
 }
 
-static void gridfluid_cleanup(gridfluid_t gf) {
-    for (size_t x = 0; x < gf->x; x++) {
-        for (size_t y = 0; y < gf->y; y++) {
-            gridfluid_cell_t *cell = &GF_CELL(gf,x,y);
-            if (gf->changeflags[x + y*gf->x] != GF_CHANGE_FILLED)
-                continue;
-            fprintf(stderr, "Filled %zu,%zu\n", x, y);
-            fflush(stderr);
-            for (int dx = -1; dx <= 1; dx++) {
-                for (int dy = -1; dy <= 1; dy++) {
-                    gridfluid_cell_t *neigh = &GF_CELL(gf,x+dx,y+dy);
-                    if (neigh->flags == GF_INTERFACE && gf->changeflags[(x+dx)+(y+dy)*gf->x] == GF_CHANGE_EMPTIED )
-                        gf->changeflags[(x+dx)+(y+dy)*gf->x] = GF_CHANGE_NONE;
-                    if (neigh->flags != GF_EMPTY)
-                        continue;
-                    float pressure = 0;
-                    float ux = 0;
-                    float uy = 0;
-                    float eq[9];
-                    gridfluid_avg_macro(gf,x+dx,y+dy,&pressure,&ux,&uy);
-                    gridfluid_eq(pressure, ux, uy, eq);
-                    neigh->flags = GF_INTERFACE;
-                    neigh->fluid = neigh->mass/pressure;
-                    memcpy(neigh->df, eq, 9*sizeof(float));
-                    // neigh might not be valid here, until after mass is distributed
-                }
-            }
-            cell->flags = GF_FLUID;
-        }
-    }
-    for (size_t x = 0; x < gf->x; x++) {
-        for (size_t y = 0; y < gf->y; y++) {
-            gridfluid_cell_t *cell = &GF_CELL(gf,x,y);
-            if (gf->changeflags[x + y*gf->x] != GF_CHANGE_EMPTIED)
-                continue;
-            fprintf(stderr, "Emptied %zu,%zu\n", x, y);
-            fflush(stderr);
-            for (int dx = -1; dx <= 1; dx++) {
-                for (int dy = -1; dy <= 1; dy++) {
-                    gridfluid_cell_t *neigh = &GF_CELL(gf,x+dx,y+dy);
-                    if (neigh->flags != GF_FLUID)
-                        continue;
-                    neigh->flags = GF_INTERFACE;
-                }
-            }
-            cell->flags = GF_EMPTY;
-        }
-    }
-    for (size_t x = 0; x < gf->x; x++) {
-        for (size_t y = 0; y < gf->y; y++) {
-            gridfluid_cell_t *cell = &GF_CELL(gf,x,y);
-            if (gf->changeflags[x + y*gf->x] == GF_CHANGE_NONE)
-                continue;
-            distribmass(gf,x,y);
-            check_valid(cell);
-            gf->changeflags[x + y*gf->x] = GF_CHANGE_NONE;
-        }
-    }
-    for (size_t x = 0; x < gf->x; x++) {
-        for (size_t y = 0; y < gf->y; y++) {
-            gridfluid_cell_t *cell = &GF_CELL(gf,x,y);
-            check_valid(cell);
-        }
-    }
-}
+#ifdef GF_HAVE_X86_SIMD
 
+// The vector kernels mirror collide_scalar lane for lane: the macroscopic
+// sums, equilibrium and relaxation are evaluated in the same order, cells
+// that are neither fluid nor interface are masked out of every store, and
+// interface lanes fall back to collide_mark_change for the rare fill/empty.
+// The diagnostics extrema are kept per lane and folded into the band once
+// per call; max and min are exact, so the result matches the scalar path.
 
-gridfluid_t gridfluid_create_empty_scene(size_t x, size_t y) {
-    gridfluid_t gf = calloc(1, sizeof(struct gridfluid));
-    gf->props = calloc(1, sizeof(struct gridfluid_properties));
-    gf->x = x;
-    gf->y = y;
-    gf->gravity = 0.01;
-    gf->atmosphere = 1.0;
-    gf->grid = calloc(x*y, sizeof(gridfluid_cell_t));
-    gf->nextgrid = calloc(x*y, sizeof(gridfluid_cell_t));
-    gf->changeflags = calloc(x*y, sizeof(gridfluid_change_flag));
-    gf->props->x = x;
-    gf->props->y = y;
-    gf->props->pressure = calloc(x*y, sizeof(float));
-    gf->props->mass = calloc(x*y, sizeof(float));
-    for (size_t i = 1; i < x-1; i++) {
-        for (size_t j = 1; j < y-1; j++) {
-            GF_CELL(gf,i,j).flags = GF_EMPTY;
-            /*
-            gridfluid_set_fluid(gf, i, j);
-            if (i == x/3 || i < 4 || i >= x-4 || j < 4 || j >= y-4)
-                GF_CELL(gf,i,j).flags = GF_INTERFACE;
-            if (i > x/3 || i < 3 || i >= x-3 || j < 3 || j >= y-3)
-                GF_CELL(gf,i,j).flags = GF_EMPTY;
-            //GF_CELL(gf,i,j).flags = GF_EMPTY;
-            */
-        }
-    }
-    return(gf);
+__attribute__((target("sse2")))
+static __m128 sse2_blend(__m128 mask, __m128 old, __m128 new) {
+    return _mm_or_ps(_mm_and_ps(mask, new), _mm_andnot_ps(mask, old));
 }
 
-void gridfluid_free(gridfluid_t gf) {
-    free(gf->grid);
-    free(gf->nextgrid);
-    free(gf->changeflags);
-    free(gf->props->pressure);
-    free(gf->props->mass);
-    free(gf->props);
-    free(gf);
+// Distribution loads and stores. The load returns df j and leaves the value
+// as stored in *raw; the store writes nf to active lanes and puts raw back
+// in the rest, which for the 16-bit formats converts back exactly.
+
+__attribute__((target("sse2" GF_DF_TARGET)))
+static __m128 sse2_load_df(const gf_df_t *p, size_t j, __m128 *raw) {
+#if defined(GF_DF_FP16)
+    *raw = _mm_cvtph_ps(_mm_loadl_epi64((const __m128i *)p));
+#elif defined(GF_DF_BF16)
+    *raw = _mm_castsi128_ps(_mm_unpacklo_epi16(_mm_setzero_si128(), _mm_loadl_epi64((const __m128i *)p)));
+#else
+    *raw = _mm_loadu_ps(p);
+#endif
+#ifdef GF_DF_SHIFTED
+    return _mm_add_ps(*raw, _mm_set1_ps(weights[j]));
+#else
+    return *raw;
+#endif
 }
 
-void gridfluid_set_obstacle(gridfluid_t gf, size_t x, size_t y) {
-    GF_CELL(gf,x,y).flags = GF_OBSTACLE;
+__attribute__((target("sse2" GF_DF_TARGET)))
+static void sse2_store_df(gf_df_t *p, size_t j, __m128 active, __m128 raw, __m128 nf) {
+#ifdef GF_DF_SHIFTED
+    nf = _mm_sub_ps(nf, _mm_set1_ps(weights[j]));
+#endif
+    __m128 v = sse2_blend(active, raw, nf);
+#if defined(GF_DF_FP16)
+    _mm_storel_epi64((__m128i *)p, _mm_cvtps_ph(v, _MM_FROUND_TO_NEAREST_INT));
+#elif defined(GF_DF_BF16)
+    // round to nearest even; the arithmetic shift keeps the halves in
+    // int16 range so the saturating pack passes them through unchanged
+    __m128i u = _mm_castps_si128(v);
+    __m128i lsb = _mm_and_si128(_mm_srli_epi32(u, 16), _mm_set1_epi32(1));
+    u = _mm_add_epi32(u, _mm_add_epi32(lsb, _mm_set1_epi32(0x7fff)));
+    u = _mm_srai_epi32(u, 16);
+    _mm_storel_epi64((__m128i *)p, _mm_packs_epi32(u, u));
+#else
+    _mm_storeu_ps(p, v);
+#endif
 }
 
-void gridfluid_set_fluid(gridfluid_t gf, size_t x, size_t y) {
-    gridfluid_cell_t *cell = &GF_CELL(gf,x,y);
-    gridfluid_eq(1,0.00,0.00,cell->df);
-    cell->flags = GF_FLUID;
-    cell->mass = 1;
-    cell->fluid = 1;
-    for (int dx = -1; dx <= 1; dx++) {
-        for (int dy = -1; dy <= 1; dy++) {
-            if (dx == 0 && dx == dy)
-                continue;
-            gridfluid_cell_t *neigh = &GF_CELL(gf,x+dx,y+dy);
-            if (neigh->flags == GF_EMPTY) {
-                gridfluid_eq(0.9,0.00,0.00,neigh->df);
-                neigh->flags = GF_INTERFACE;
-                neigh->mass = 0.9;
-                neigh->fluid = 0.9;
-            }
-        }
-    }
+__attribute__((target("avx2" GF_DF_TARGET)))
+static __m256 avx2_load_df(const gf_df_t *p, size_t j, __m256 *raw) {
+#if defined(GF_DF_FP16)
+    *raw = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)p));
+#elif defined(GF_DF_BF16)
+    __m256i u = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)p));
+    *raw = _mm256_castsi256_ps(_mm256_slli_epi32(u, 16));
+#else
+    *raw = _mm256_loadu_ps(p);
+#endif
+#ifdef GF_DF_SHIFTED
+    return _mm256_add_ps(*raw, _mm256_set1_ps(weights[j]));
+#else
+    return *raw;
+#endif
 }
 
-void gridfluid_set_empty(gridfluid_t gf, size_t x, size_t y) {
-    GF_CELL(gf,x,y).flags = GF_EMPTY;
+__attribute__((target("avx2" GF_DF_TARGET)))
+static void avx2_store_df(gf_df_t *p, size_t j, __m256 active, __m256 raw, __m256 nf) {
+#ifdef GF_DF_SHIFTED
+    nf = _mm256_sub_ps(nf, _mm256_set1_ps(weights[j]));
+#endif
+    __m256 v = _mm256_blendv_ps(raw, nf, active);
+#if defined(GF_DF_FP16)
+    _mm_storeu_si128((__m128i *)p, _mm256_cvtps_ph(v, _MM_FROUND_TO_NEAREST_INT));
+#elif defined(GF_DF_BF16)
+    __m256i u = _mm256_castps_si256(v);
+    __m256i lsb = _mm256_and_si256(_mm256_srli_epi32(u, 16), _mm256_set1_epi32(1));
+    u = _mm256_add_epi32(u, _mm256_add_epi32(lsb, _mm256_set1_epi32(0x7fff)));
+    u = _mm256_srai_epi32(u, 16);
+    _mm_storeu_si128((__m128i *)p, _mm_packs_epi32(_mm256_castsi256_si128(u), _mm256_extracti128_si256(u, 1)));
+#else
+    _mm256_storeu_ps(p, v);
+#endif
 }
 
-void gridfluid_set_gravity(gridfluid_t gf, float g) {
-    gf->props->gravity = g;
+__attribute__((target("avx512f")))
+static __m512 avx512_load_df(const gf_df_t *p, size_t j, __m512 *raw) {
+#if defined(GF_DF_FP16)
+    *raw = _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i *)p));
+#elif defined(GF_DF_BF16)
+    __m512i u = _mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i *)p));
+    *raw = _mm512_castsi512_ps(_mm512_slli_epi32(u, 16));
+#else
+    *raw = _mm512_loadu_ps(p);
+#endif
+#ifdef GF_DF_SHIFTED
+    return _mm512_add_ps(*raw, _mm512_set1_ps(weights[j]));
+#else
+    return *raw;
+#endif
 }
 
-uint8_t gridfluid_get_type(gridfluid_t gf, size_t x, size_t y) {
-    return( GF_CELL(gf,x,y).flags );
+__attribute__((target("avx512f")))
+static void avx512_store_df(gf_df_t *p, size_t j, __mmask16 active, __m512 raw, __m512 nf) {
+#ifdef GF_DF_SHIFTED
+    nf = _mm512_sub_ps(nf, _mm512_set1_ps(weights[j]));
+    __m512 v = _mm512_mask_blend_ps(active, raw, nf);
+#if defined(GF_DF_FP16)
+    _mm256_storeu_si256((__m256i *)p, _mm512_cvtps_ph(v, _MM_FROUND_TO_NEAREST_INT));
+#else
+    __m512i u = _mm512_castps_si512(v);
+    __m512i lsb = _mm512_and_si512(_mm512_srli_epi32(u, 16), _mm512_set1_epi32(1));
+    u = _mm512_add_epi32(u, _mm512_add_epi32(lsb, _mm512_set1_epi32(0x7fff)));
+    _mm256_storeu_si256((__m256i *)p, _mm512_cvtepi32_epi16(_mm512_srli_epi32(u, 16)));
+#endif
+#else
+    (void)raw;
+    _mm512_mask_storeu_ps(p, active, nf);
+#endif
 }
 
-gridfluid_properties_t *gridfluid_get_properties(gridfluid_t gf) {
-    float pressure=0;
-    float ux=0;
-    float uy=0;
+__attribute__((target("sse2" GF_DF_TARGET), always_inline))
+static inline void collide_sse2_cells(gridfluid_t gf, gridfluid_band_t *band, gridfluid_lattice_t *lat, size_t begin, size_t end, int bulk, int track) {
+    const __m128i vfluid = _mm_set1_epi32(GF_FLUID);
+    const __m128i viface = _mm_set1_epi32(GF_INTERFACE);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128 vmax = _mm_set1_ps(100000);
+    const __m128 vgravity = _mm_set1_ps(gf->gravity);
+    const __m128 vomega = _mm_set1_ps(gf->omega);
+    const __m128 vkeep = _mm_set1_ps(1-gf->omega);
+    const __m128 three = _mm_set1_ps(3);
+    const __m128 k15 = _mm_set1_ps(1.5f);
+    const __m128 k45 = _mm_set1_ps(4.5f);
+    __m128 vmaxp = _mm_set1_ps(band->max_pressure);
+    __m128 vminp = _mm_set1_ps(band->min_pressure);
+    __m128 vmaxu = _mm_set1_ps(band->max_usqr);
+    __m128 vmaxc = _mm_set1_ps(band->max_change);
+    const __m128 vabs = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    size_t i = begin;
+    for (; i + 4 <= end; i += 4) {
+        __m128 isif = _mm_setzero_ps();
+        __m128 active = _mm_castsi128_ps(_mm_cmpeq_epi32(zero, zero));
+        if (!bulk) {
+            int32_t packed;
+            memcpy(&packed, gf->flags + i, sizeof(packed));
+            __m128i fl = _mm_cvtsi32_si128(packed);
+            fl = _mm_unpacklo_epi16(_mm_unpacklo_epi8(fl, zero), zero);
+            isif = _mm_castsi128_ps(_mm_cmpeq_epi32(fl, viface));
+            active = _mm_or_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(fl, vfluid)), isif);
+            if (!_mm_movemask_ps(active))
+                continue;
+        }
+        __m128 f[9], raw[9];
+        for (size_t j=0; j<9; j++) {
+            f[j] = sse2_load_df(lat->df[j] + i, j, &raw[j]);
+        }
+        __m128 p = f[0];
+        for (size_t j=1; j<9; j++) {
+            p = _mm_add_ps(p, f[j]);
+        }
+        __m128 ux = _mm_sub_ps(f[1], f[3]);
+        ux = _mm_sub_ps(_mm_sub_ps(_mm_add_ps(ux, f[5]), f[6]), f[7]);
+        ux = _mm_add_ps(ux, f[8]);
+        __m128 uy = _mm_sub_ps(f[2], f[4]);
+        uy = _mm_sub_ps(_mm_add_ps(_mm_add_ps(uy, f[5]), f[6]), f[7]);
+        uy = _mm_sub_ps(uy, f[8]);
+        if (_mm_movemask_ps(_mm_and_ps(active, _mm_cmpgt_ps(p, vmax))))
+            abort();
+        __m128 vsqr = _mm_add_ps(_mm_mul_ps(ux, ux), _mm_mul_ps(uy, uy));
+        uy = _mm_add_ps(uy, vgravity);
+
+        __m128 mass = _mm_loadu_ps(lat->mass + i);
+        float *pp = gf->props->pressure + i;
+        float *pm = gf->props->mass + i;
+        float *pf = lat->fluid + i;
+        __m128 oldp = _mm_loadu_ps(pp);
+        _mm_storeu_ps(pp, sse2_blend(active, oldp, p));
+        _mm_storeu_ps(pm, sse2_blend(active, _mm_loadu_ps(pm), mass));
+        _mm_storeu_ps(pf, sse2_blend(active, _mm_loadu_ps(pf), _mm_div_ps(mass, p)));
+
+        __m128 usqr = _mm_add_ps(_mm_mul_ps(ux, ux), _mm_mul_ps(uy, uy));
+        vmaxp = _mm_max_ps(vmaxp, sse2_blend(active, vmaxp, p));
+        vminp = _mm_min_ps(vminp, sse2_blend(active, vminp, p));
+        vmaxu = _mm_max_ps(vmaxu, sse2_blend(active, vmaxu, vsqr));
+        if (track)
+            vmaxc = _mm_max_ps(vmaxc, sse2_blend(active, vmaxc, _mm_and_ps(vabs, _mm_sub_ps(p, oldp))));
+        __m128 k = _mm_mul_ps(k15, usqr);
+        __m128 e[9];
+        e[0] = _mm_setzero_ps();
+        e[1] = ux;
+        e[2] = uy;
+        e[3] = _mm_sub_ps(e[0], ux);
+        e[4] = _mm_sub_ps(e[0], uy);
+        e[5] = _mm_add_ps(ux, uy);
+        e[6] = _mm_sub_ps(uy, ux);
+        e[7] = _mm_sub_ps(e[0], e[5]);
+        e[8] = _mm_sub_ps(ux, uy);
+        for (size_t j=0; j<9; j++) {
+            __m128 t = _mm_sub_ps(_mm_add_ps(p, _mm_mul_ps(three, e[j])), k);
+            t = _mm_add_ps(t, _mm_mul_ps(_mm_mul_ps(k45, e[j]), e[j]));
+            __m128 eq = _mm_mul_ps(_mm_set1_ps(weights[j]), t);
+            __m128 nf = _mm_add_ps(_mm_mul_ps(f[j], vkeep), _mm_mul_ps(vomega, eq));
+            sse2_store_df(lat->df[j] + i, j, active, raw[j], nf);
+        }
+
+        int ifmask = _mm_movemask_ps(isif);
+        for (size_t l=0; ifmask; l++, ifmask >>= 1) {
+            if (ifmask & 1)
+                collide_mark_change(gf, band, lat, i+l);
+        }
+    }
+    float maxp[4], minp[4], maxu[4], maxc[4];
+    _mm_storeu_ps(maxp, vmaxp);
+    _mm_storeu_ps(minp, vminp);
+    _mm_storeu_ps(maxu, vmaxu);
+    _mm_storeu_ps(maxc, vmaxc);
+    band_fold(band, maxp, minp, maxu, maxc, 4);
+    if (bulk)
+        collide_scalar_bulk(gf, band, lat, i, end);
+    else
+        collide_scalar(gf, band, lat, i, end);
+}
+
+__attribute__((target("avx2" GF_DF_TARGET), always_inline))
+static inline void collide_avx2_cells(gridfluid_t gf, gridfluid_band_t *band, gridfluid_lattice_t *lat, size_t begin, size_t end, int bulk, int track) {
+    const __m256i vfluid = _mm256_set1_epi32(GF_FLUID);
+    const __m256i viface = _mm256_set1_epi32(GF_INTERFACE);
+    const __m256 vmax = _mm256_set1_ps(100000);
+    const __m256 vgravity = _mm256_set1_ps(gf->gravity);
+    const __m256 vomega = _mm256_set1_ps(gf->omega);
+    const __m256 vkeep = _mm256_set1_ps(1-gf->omega);
+    const __m256 three = _mm256_set1_ps(3);
+    const __m256 k15 = _mm256_set1_ps(1.5f);
+    const __m256 k45 = _mm256_set1_ps(4.5f);
+    __m256 vmaxp = _mm256_set1_ps(band->max_pressure);
+    __m256 vminp = _mm256_set1_ps(band->min_pressure);
+    __m256 vmaxu = _mm256_set1_ps(band->max_usqr);
+    __m256 vmaxc = _mm256_set1_ps(band->max_change);
+    const __m256 vabs = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+    size_t i = begin;
+    for (; i + 8 <= end; i += 8) {
+        __m256 isif = _mm256_setzero_ps();
+        __m256 active = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+        if (!bulk) {
+            __m256i fl = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(gf->flags + i)));
+            isif = _mm256_castsi256_ps(_mm256_cmpeq_epi32(fl, viface));
+            active = _mm256_or_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(fl, vfluid)), isif);
+            if (!_mm256_movemask_ps(active))
+                continue;
+        }
+        __m256 f[9], raw[9];
+        for (size_t j=0; j<9; j++) {
+            f[j] = avx2_load_df(lat->df[j] + i, j, &raw[j]);
+        }
+        __m256 p = f[0];
+        for (size_t j=1; j<9; j++) {
+            p = _mm256_add_ps(p, f[j]);
+        }
+        __m256 ux = _mm256_sub_ps(f[1], f[3]);
+        ux = _mm256_sub_ps(_mm256_sub_ps(_mm256_add_ps(ux, f[5]), f[6]), f[7]);
+        ux = _mm256_add_ps(ux, f[8]);
+        __m256 uy = _mm256_sub_ps(f[2], f[4]);
+        uy = _mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(uy, f[5]), f[6]), f[7]);
+        uy = _mm256_sub_ps(uy, f[8]);
+        if (_mm256_movemask_ps(_mm256_and_ps(active, _mm256_cmp_ps(p, vmax, _CMP_GT_OQ))))
+            abort();
+        __m256 vsqr = _mm256_add_ps(_mm256_mul_ps(ux, ux), _mm256_mul_ps(uy, uy));
+        uy = _mm256_add_ps(uy, vgravity);
+
+        __m256 mass = _mm256_loadu_ps(lat->mass + i);
+        float *pp = gf->props->pressure + i;
+        float *pm = gf->props->mass + i;
+        float *pf = lat->fluid + i;
+        __m256 oldp = _mm256_loadu_ps(pp);
+        _mm256_storeu_ps(pp, _mm256_blendv_ps(oldp, p, active));
+        _mm256_storeu_ps(pm, _mm256_blendv_ps(_mm256_loadu_ps(pm), mass, active));
+        _mm256_storeu_ps(pf, _mm256_blendv_ps(_mm256_loadu_ps(pf), _mm256_div_ps(mass, p), active));
+
+        __m256 usqr = _mm256_add_ps(_mm256_mul_ps(ux, ux), _mm256_mul_ps(uy, uy));
+        vmaxp = _mm256_max_ps(vmaxp, _mm256_blendv_ps(vmaxp, p, active));
+        vminp = _mm256_min_ps(vminp, _mm256_blendv_ps(vminp, p, active));
+        vmaxu = _mm256_max_ps(vmaxu, _mm256_blendv_ps(vmaxu, vsqr, active));
+        if (track)
+            vmaxc = _mm256_max_ps(vmaxc, _mm256_blendv_ps(vmaxc, _mm256_and_ps(vabs, _mm256_sub_ps(p, oldp)), active));
+        __m256 k = _mm256_mul_ps(k15, usqr);
+        __m256 e[9];
+        e[0] = _mm256_setzero_ps();
+        e[1] = ux;
+        e[2] = uy;
+        e[3] = _mm256_sub_ps(e[0], ux);
+        e[4] = _mm256_sub_ps(e[0], uy);
+        e[5] = _mm256_add_ps(ux, uy);
+        e[6] = _mm256_sub_ps(uy, ux);
+        e[7] = _mm256_sub_ps(e[0], e[5]);
+        e[8] = _mm256_sub_ps(ux, uy);
+        for (size_t j=0; j<9; j++) {
+            __m256 t = _mm256_sub_ps(_mm256_add_ps(p, _mm256_mul_ps(three, e[j])), k);
+            t = _mm256_add_ps(t, _mm256_mul_ps(_mm256_mul_ps(k45, e[j]), e[j]));
+            __m256 eq = _mm256_mul_ps(_mm256_set1_ps(weights[j]), t);
+            __m256 nf = _mm256_add_ps(_mm256_mul_ps(f[j], vkeep), _mm256_mul_ps(vomega, eq));
+            avx2_store_df(lat->df[j] + i, j, active, raw[j], nf);
+        }
+
+        int ifmask = _mm256_movemask_ps(isif);
+        for (size_t l=0; ifmask; l++, ifmask >>= 1) {
+            if (ifmask & 1)
+                collide_mark_change(gf, band, lat, i+l);
+        }
+    }
+    float maxp[8], minp[8], maxu[8], maxc[8];
+    _mm256_storeu_ps(maxp, vmaxp);
+    _mm256_storeu_ps(minp, vminp);
+    _mm256_storeu_ps(maxu, vmaxu);
+    _mm256_storeu_ps(maxc, vmaxc);
+    band_fold(band, maxp, minp, maxu, maxc, 8);
+    if (bulk)
+        collide_scalar_bulk(gf, band, lat, i, end);
+    else
+        collide_scalar(gf, band, lat, i, end);
+}
+
+__attribute__((target("avx512f"), always_inline))
+static inline void collide_avx512_cells(gridfluid_t gf, gridfluid_band_t *band, gridfluid_lattice_t *lat, size_t begin, size_t end, int bulk, int track) {
+    const __m512i vfluid = _mm512_set1_epi32(GF_FLUID);
+    const __m512i viface = _mm512_set1_epi32(GF_INTERFACE);
+    const __m512 vmax = _mm512_set1_ps(100000);
+    const __m512 vgravity = _mm512_set1_ps(gf->gravity);
+    const __m512 vomega = _mm512_set1_ps(gf->omega);
+    const __m512 vkeep = _mm512_set1_ps(1-gf->omega);
+    const __m512 three = _mm512_set1_ps(3);
+    const __m512 k15 = _mm512_set1_ps(1.5f);
+    const __m512 k45 = _mm512_set1_ps(4.5f);
+    __m512 vmaxp = _mm512_set1_ps(band->max_pressure);
+    __m512 vminp = _mm512_set1_ps(band->min_pressure);
+    __m512 vmaxu = _mm512_set1_ps(band->max_usqr);
+    __m512 vmaxc = _mm512_set1_ps(band->max_change);
+    size_t i = begin;
+    for (; i + 16 <= end; i += 16) {
+        __mmask16 isif = 0;
+        __mmask16 active = 0xffff;
+        if (!bulk) {
+            __m512i fl = _mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i *)(gf->flags + i)));
+            isif = _mm512_cmpeq_epi32_mask(fl, viface);
+            active = _mm512_cmpeq_epi32_mask(fl, vfluid) | isif;
+            if (!active)
+                continue;
+        }
+        __m512 f[9], raw[9];
+        for (size_t j=0; j<9; j++) {
+            f[j] = avx512_load_df(lat->df[j] + i, j, &raw[j]);
+        }
+        __m512 p = f[0];
+        for (size_t j=1; j<9; j++) {
+            p = _mm512_add_ps(p, f[j]);
+        }
+        __m512 ux = _mm512_sub_ps(f[1], f[3]);
+        ux = _mm512_sub_ps(_mm512_sub_ps(_mm512_add_ps(ux, f[5]), f[6]), f[7]);
+        ux = _mm512_add_ps(ux, f[8]);
+        __m512 uy = _mm512_sub_ps(f[2], f[4]);
+        uy = _mm512_sub_ps(_mm512_add_ps(_mm512_add_ps(uy, f[5]), f[6]), f[7]);
+        uy = _mm512_sub_ps(uy, f[8]);
+        if (_mm512_mask_cmp_ps_mask(active, p, vmax, _CMP_GT_OQ))
+            abort();
+        __m512 vsqr = _mm512_add_ps(_mm512_mul_ps(ux, ux), _mm512_mul_ps(uy, uy));
+        uy = _mm512_add_ps(uy, vgravity);
+
+        __m512 mass = _mm512_loadu_ps(lat->mass + i);
+        __m512 oldp = _mm512_loadu_ps(gf->props->pressure + i);
+        _mm512_mask_storeu_ps(gf->props->pressure + i, active, p);
+        _mm512_mask_storeu_ps(gf->props->mass + i, active, mass);
+        _mm512_mask_storeu_ps(lat->fluid + i, active, _mm512_div_ps(mass, p));
+
+        __m512 usqr = _mm512_add_ps(_mm512_mul_ps(ux, ux), _mm512_mul_ps(uy, uy));
+        vmaxp = _mm512_mask_max_ps(vmaxp, active, vmaxp, p);
+        vminp = _mm512_mask_min_ps(vminp, active, vminp, p);
+        vmaxu = _mm512_mask_max_ps(vmaxu, active, vmaxu, vsqr);
+        if (track)
+            vmaxc = _mm512_mask_max_ps(vmaxc, active, vmaxc, _mm512_abs_ps(_mm512_sub_ps(p, oldp)));
+        __m512 k = _mm512_mul_ps(k15, usqr);
+        __m512 e[9];
+        e[0] = _mm512_setzero_ps();
+        e[1] = ux;
+        e[2] = uy;
+        e[3] = _mm512_sub_ps(e[0], ux);
+        e[4] = _mm512_sub_ps(e[0], uy);
+        e[5] = _mm512_add_ps(ux, uy);
+        e[6] = _mm512_sub_ps(uy, ux);
+        e[7] = _mm512_sub_ps(e[0], e[5]);
+        e[8] = _mm512_sub_ps(ux, uy);
+        for (size_t j=0; j<9; j++) {
+            __m512 t = _mm512_sub_ps(_mm512_add_ps(p, _mm512_mul_ps(three, e[j])), k);
+            t = _mm512_add_ps(t, _mm512_mul_ps(_mm512_mul_ps(k45, e[j]), e[j]));
+            __m512 eq = _mm512_mul_ps(_mm512_set1_ps(weights[j]), t);
+            __m512 nf = _mm512_add_ps(_mm512_mul_ps(f[j], vkeep), _mm512_mul_ps(vomega, eq));
+            avx512_store_df(lat->df[j] + i, j, active, raw[j], nf);
+        }
+
+        for (size_t l=0; isif; l++, isif >>= 1) {
+            if (isif & 1)
+                collide_mark_change(gf, band, lat, i+l);
+        }
+    }
+    float maxp[16], minp[16], maxu[16], maxc[16];
+    _mm512_storeu_ps(maxp, vmaxp);
+    _mm512_storeu_ps(minp, vminp);
+    _mm512_storeu_ps(maxu, vmaxu);
+    _mm512_storeu_ps(maxc, vmaxc);
+    band_fold(band, maxp, minp, maxu, maxc, 16);
+    if (bulk)
+        collide_scalar_bulk(gf, band, lat, i, end);
+    else
+        collide_scalar(gf, band, lat, i, end);
+}
+
+__attribute__((target("sse2" GF_DF_TARGET)))
+static void collide_sse2(gridfluid_t gf, gridfluid_band_t *band, gridfluid_lattice_t *lat, size_t begin, size_t end) {
+    if (gf->sleep_steps)
+        collide_sse2_cells(gf, band, lat, begin, end, 0, 1);
+    else
+        collide_sse2_cells(gf, band, lat, begin, end, 0, 0);
+}
+
+__attribute__((target("sse2" GF_DF_TARGET)))
+static void collide_sse2_bulk(gridfluid_t gf, gridfluid_band_t *band, gridfluid_lattice_t *lat, size_t begin, size_t end) {
+    if (gf->sleep_steps)
+        collide_sse2_cells(gf, band, lat, begin, end, 1, 1);
+    else
+        collide_sse2_cells(gf, band, lat, begin, end, 1, 0);
+}
+
+__attribute__((target("avx2" GF_DF_TARGET)))
+static void collide_avx2(gridfluid_t gf, gridfluid_band_t *band, gridfluid_lattice_t *lat, size_t begin, size_t end) {
+    if (gf->sleep_steps)
+        collide_avx2_cells(gf, band, lat, begin, end, 0, 1);
+    else
+        collide_avx2_cells(gf, band, lat, begin, end, 0, 0);
+}
+
+__attribute__((target("avx2" GF_DF_TARGET)))
+static void collide_avx2_bulk(gridfluid_t gf, gridfluid_band_t *band, gridfluid_lattice_t *lat, size_t begin, size_t end) {
+    if (gf->sleep_steps)
+        collide_avx2_cells(gf, band, lat, begin, end, 1, 1);
+    else
+        collide_avx2_cells(gf, band, lat, begin, end, 1, 0);
+}
+
+__attribute__((target("avx512f")))
+static void collide_avx512(gridfluid_t gf, gridfluid_band_t *band, gridfluid_lattice_t *lat, size_t begin, size_t end) {
+    if (gf->sleep_steps)
+        collide_avx512_cells(gf, band, lat, begin, end, 0, 1);
+    else
+        collide_avx512_cells(gf, band, lat, begin, end, 0, 0);
+}
+
+__attribute__((target("avx512f")))
+static void collide_avx512_bulk(gridfluid_t gf, gridfluid_band_t *band, gridfluid_lattice_t *lat, size_t begin, size_t end) {
+    if (gf->sleep_steps)
+        collide_avx512_cells(gf, band, lat, begin, end, 1, 1);
+    else
+        collide_avx512_cells(gf, band, lat, begin, end, 1, 0);
+}
+
+#endif
+
+static int simd_supported(gridfluid_simd simd) {
+#ifdef GF_HAVE_X86_SIMD
+    __builtin_cpu_init();
+#endif
+    switch (simd) {
+        case GF_SIMD_SCALAR:
+            return 1;
+#ifdef GF_HAVE_X86_SIMD
+#ifdef GF_DF_FP16
+        case GF_SIMD_SSE2:
+            return __builtin_cpu_supports("sse2") && __builtin_cpu_supports("f16c");
+        case GF_SIMD_AVX2:
+            return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("f16c");
+#else
+        case GF_SIMD_SSE2:
+            return __builtin_cpu_supports("sse2");
+        case GF_SIMD_AVX2:
+            return __builtin_cpu_supports("avx2");
+#endif
+        case GF_SIMD_AVX512:
+            return __builtin_cpu_supports("avx512f");
+#endif
+        default:
+            return 0;
+    }
+}
+
+static gridfluid_collide_fn collide_kernel(gridfluid_simd simd, int bulk) {
+    switch (simd) {
+#ifdef GF_HAVE_X86_SIMD
+        case GF_SIMD_SSE2:
+            return bulk ? collide_sse2_bulk : collide_sse2;
+        case GF_SIMD_AVX2:
+            return bulk ? collide_avx2_bulk : collide_avx2;
+        case GF_SIMD_AVX512:
+            return bulk ? collide_avx512_bulk : collide_avx512;
+#endif
+        default:
+            return bulk ? collide_scalar_bulk : collide_scalar;
+    }
+}
+
+static uint64_t trace_clock() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return( (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec );
+}
+
+static void emit(gridfluid_t gf, gridfluid_event_t *event) {
+    event->step = gf->step;
+    if (gf->event_cb)
+        gf->event_cb(event, gf->event_user);
+    // the solver never waits for the reader; a full ring drops the event
+    if (gf->events && !gfring_push(gf->events, event))
+        gf->dropped_events++;
+}
+
+static void emit_cell(gridfluid_t gf, gridfluid_event_type type, size_t c) {
+    gridfluid_event_t event = { .type = type };
+    event.x = c % gf->x;
+    event.y = c / gf->x;
+    emit(gf, &event);
+}
+
+static void emit_phase(gridfluid_t gf, gridfluid_phase phase, uint64_t start) {
+    gridfluid_event_t event = { .type = GF_EVENT_PHASE };
+    event.phase = phase;
+    event.nanoseconds = trace_clock() - start;
+    emit(gf, &event);
+}
+
+static int cmp_index(const void *a, const void *b) {
+    size_t ia = *(const size_t *)a;
+    size_t ib = *(const size_t *)b;
+    return( (ia > ib) - (ia < ib) );
+}
+
+static void gridfluid_run(gridfluid_t gf, gfpool_fn fn) {
+    if (gf->pool)
+        gfpool_run(gf->pool, fn, gf);
+    else
+        fn(gf, 0, 1);
+}
+
+static gridfluid_band_t *gridfluid_band(gridfluid_t gf, size_t worker, size_t nworkers) {
+    gridfluid_band_t *band = &gf->bands[worker];
+    size_t rows = gf->row1 - gf->row0;
+    band->y0 = gf->row0 + rows * worker / nworkers;
+    band->y1 = gf->row0 + rows * (worker+1) / nworkers;
+    return( band );
+}
+
+enum {
+    GF_SWEEP_STREAM = 1,
+    GF_SWEEP_COLLIDE = 2
+};
+
+// Streams cells [x0,x1) of row y into dst. Runs of at least GF_BULK_RUN
+// bulk cells go to the bulk stream, the cells between them to the general
+// one. Returns whether the whole span was one bulk run.
+static int gridfluid_stream_runs(gridfluid_t gf, gridfluid_band_t *band, gridfluid_lattice_t *dst,
+                                 size_t y, size_t x0, size_t x1) {
+    size_t start = x0;
+    size_t x = x0;
+    while (x < x1) {
+        size_t end = x;
+        while (end < x1 && GF_BULK(gf, GF_IDX(gf,end,y)))
+            end++;
+        if (end - x < GF_BULK_RUN) {
+            x = end + 1;
+            continue;
+        }
+        if (x > start)
+            gridfluid_stream_span(gf, band, dst, y, start, x);
+        gridfluid_stream_bulk(gf, band, dst, y, x, end);
+        if (x == x0 && end == x1)
+            return( 1 );
+        start = x = end;
+    }
+    if (x1 > start)
+        gridfluid_stream_span(gf, band, dst, y, start, x1);
+    return( 0 );
+}
+
+// Whether every cell of [x0,x1) in row y is bulk.
+static int gridfluid_bulk_span(gridfluid_t gf, size_t y, size_t x0, size_t x1) {
+    for (size_t x = x0; x < x1; x++) {
+        if (!GF_BULK(gf, GF_IDX(gf,x,y)))
+            return( 0 );
+    }
+    return( x1 - x0 >= GF_BULK_RUN );
+}
+
+// Streams cells [x0,x1) of row y into dst and/or collides them there. The
+// collide runs over the whole span, with the bulk kernel only if every cell
+// is bulk: splitting it at each run would leave each piece a scalar tail,
+// which costs more than the flag tests it saves.
+static void gridfluid_sweep_span(gridfluid_t gf, gridfluid_band_t *band, gridfluid_lattice_t *dst,
+                                 size_t y, size_t x0, size_t x1, int what) {
+    int bulk;
+    if (what & GF_SWEEP_STREAM)
+        bulk = gridfluid_stream_runs(gf, band, dst, y, x0, x1);
+    else
+        bulk = gridfluid_bulk_span(gf, y, x0, x1);
+    if (what & GF_SWEEP_COLLIDE)
+        (bulk ? gf->collide_bulk : gf->collide)(gf, band, dst, GF_IDX(gf,x0,y), GF_IDX(gf,x1,y));
+}
+
+static void gridfluid_sweep_spans(gridfluid_t gf, gridfluid_band_t *band, gridfluid_lattice_t *dst,
+                                  size_t y, size_t x0, size_t x1, int what) {
+    for (size_t x = x0; x < x1; x += GF_SPAN) {
+        size_t end = x + GF_SPAN < x1 ? x + GF_SPAN : x1;
+        gridfluid_sweep_span(gf, band, dst, y, x, end, what);
+    }
+}
+
+// Sweeps cells [x0,x1) of row y except those of sleeping tiles, which add
+// what they last had to the band's diagnostics instead. The activity of
+// the rest is kept per tile row for sleep_update: the largest density
+// change or velocity the collide saw in it.
+static void gridfluid_sweep_row(gridfluid_t gf, gridfluid_band_t *band, gridfluid_lattice_t *dst,
+                                size_t y, size_t x0, size_t x1, int what) {
+    if (!gf->sleep_steps) {
+        gridfluid_sweep_spans(gf, band, dst, y, x0, x1, what);
+        return;
+    }
+    const uint8_t *asleep = gf->asleep + (y - gf->row0) / GF_SLEEP_TILE * gf->sleep_nx;
+    for (size_t x = x0, end; x < x1; x = end) {
+        size_t t = (x - 1) / GF_SLEEP_TILE;
+        size_t start = 1 + t * GF_SLEEP_TILE;
+        end = start + GF_SLEEP_TILE < x1 ? start + GF_SLEEP_TILE : x1;
+        gridfluid_sleep_row_t *row = &gf->sleep_rows[y * gf->sleep_nx + t];
+        if (asleep[t]) {
+            // a tile row split between tiles of the sweep is added once
+            if (x != start)
+                continue;
+            if (what & GF_SWEEP_STREAM)
+                band->total_mass += row->mass;
+            if (what & GF_SWEEP_COLLIDE) {
+                float none = 0;
+                band_fold(band, &row->max_pressure, &row->min_pressure, &row->max_usqr, &none, 1);
+            }
+            continue;
+        }
+        float max_usqr = band->max_usqr;
+        band->max_usqr = 0;
+        band->max_change = 0;
+        gridfluid_sweep_spans(gf, band, dst, y, x, end, what);
+        if (what & GF_SWEEP_COLLIDE) {
+            float activity = fmaxf(band->max_change, sqrtf(band->max_usqr));
+            if (activity > row->activity)
+                row->activity = activity;
+        }
+        if (max_usqr > band->max_usqr)
+            band->max_usqr = max_usqr;
+    }
+}
+
+// In-place mode streams each row into a row-sized lattice of its band and
+// copies it over grid once no row still has to pull from the old one: that
+// is after row y+1 has been streamed. A band's first and last rows are also
+// pulled from by the neighbouring bands, so slots 0 and 1 hold them until
+// every band is done; the other slots are a ring over the rows of the
+// current tile row and the one above it.
+static gridfluid_lattice_t *band_row(gridfluid_band_t *band, size_t ring, size_t y) {
+    if (y == band->y0)
+        return( &band->rows[0] );
+    if (y + 1 == band->y1)
+        return( &band->rows[1] );
+    return( &band->rows[2 + y % ring] );
+}
+
+// Points view's planes at row, offset so that the cell indices of row y,
+// and only those, address it. The kernels take it like any other lattice.
+static void row_view(gridfluid_t gf, gridfluid_lattice_t *view, const gridfluid_lattice_t *row, size_t y) {
+    size_t base = GF_IDX(gf,0,y);
+    for (size_t i = 0; i<9; i++) {
+        view->df[i] = row->df[i] - base;
+    }
+    view->mass = row->mass - base;
+    view->fluid = row->fluid - base;
+    view->mapped = 0;
+}
+
+static void row_store_span(gridfluid_t gf, const gridfluid_lattice_t *row, size_t y, size_t x0, size_t x1) {
+    gridfluid_lattice_t *lat = &gf->grid;
+    size_t base = GF_IDX(gf,x0,y);
+    size_t n = x1 - x0;
+    for (size_t i = 0; i<9; i++) {
+        memcpy(lat->df[i] + base, row->df[i] + x0, n * sizeof(gf_df_t));
+    }
+    memcpy(lat->mass + base, row->mass + x0, n * sizeof(float));
+    memcpy(lat->fluid + base, row->fluid + x0, n * sizeof(float));
+}
+
+// Copies back the cells of row y the sweep streamed, which leaves out the
+// ghost cells at either end and the cells of sleeping tiles.
+static void row_store(gridfluid_t gf, const gridfluid_lattice_t *row, size_t y) {
+    if (!gf->sleep_steps) {
+        row_store_span(gf, row, y, 1, gf->x - 1);
+        return;
+    }
+    const uint8_t *asleep = gf->asleep + (y - gf->row0) / GF_SLEEP_TILE * gf->sleep_nx;
+    for (size_t t = 0; t < gf->sleep_nx; ) {
+        if (asleep[t]) {
+            t++;
+            continue;
+        }
+        size_t t1 = t + 1;
+        while (t1 < gf->sleep_nx && !asleep[t1])
+            t1++;
+        size_t x1 = 1 + t1 * GF_SLEEP_TILE;
+        row_store_span(gf, row, y, 1 + t * GF_SLEEP_TILE, x1 < gf->x - 1 ? x1 : gf->x - 1);
+        t = t1;
+    }
+}
+
+static void band_free_rows(gridfluid_band_t *band) {
+    for (size_t k = 0; k < band->nrows; k++) {
+        lattice_free(&band->rows[k]);
+    }
+    free(band->rows);
+    band->rows = NULL;
+    band->nrows = 0;
+}
+
+// Gives every band the row lattices an in-place sweep with the current
+// tiling needs.
+static void gridfluid_alloc_rows(gridfluid_t gf) {
+    size_t nrows = 2 + (gf->tile_x ? gf->tile_y : 1) + 1;
+    for (size_t i = 0; i < gf->nbands; i++) {
+        gridfluid_band_t *band = &gf->bands[i];
+        if (band->nrows >= nrows)
+            continue;
+        band_free_rows(band);
+        band->rows = calloc(nrows, sizeof(gridfluid_lattice_t));
+        if (!band->rows)
+            abort();
+        for (size_t k = 0; k < nrows; k++) {
+            if (!lattice_alloc(&band->rows[k], gf->x))
+                abort();
+        }
+        band->nrows = nrows;
+    }
+}
+
+// Writes back the rows the bands held for their neighbours.
+static void gridfluid_flush_rows(gridfluid_t gf) {
+    for (size_t i = 0; i < gf->nbands; i++) {
+        gridfluid_band_t *band = &gf->bands[i];
+        row_store(gf, &band->rows[0], band->y0);
+        if (band->y1 - band->y0 > 1)
+            row_store(gf, &band->rows[1], band->y1 - 1);
+    }
+}
+
+// Streams and/or collides one band of rows. The band is walked in tiles of
+// tile_x by tile_y cells (or whole rows when untiled), each tile row by row
+// so memory is touched in storage order. In the fused sweep each span of a
+// row is pulled from grid into nextgrid and immediately collided while it
+// is still in cache, so the distributions are read and written once per
+// step. Fill/empty changes are recorded by the collide kernel as it goes;
+// cleanup leaves every changeflag at GF_CHANGE_NONE, so there is nothing
+// to reset beforehand. Bands only read grid and only write their own rows
+// of nextgrid, so they need no synchronisation. In-place, the rows of
+// nextgrid are the band's row lattices instead, see band_row.
+static void gridfluid_sweep_band(gridfluid_t gf, gridfluid_band_t *band, int what) {
+    if (what & GF_SWEEP_STREAM)
+        band->total_mass = 0;
+    if (what & GF_SWEEP_COLLIDE) {
+        band->filled = 0;
+        band->emptied = 0;
+        band->changed.len = 0;
+        band->max_pressure = 0;
+        band->min_pressure = INFINITY;
+        band->max_usqr = 0;
+        band->max_change = 0;
+    }
+    // untiled, a tile is one full row of the cells inside the ghost ring
+    size_t inner = gf->x - 2;
+    size_t tile_x = gf->tile_x ? gf->tile_x : inner;
+    size_t tile_y = gf->tile_x ? gf->tile_y : 1;
+    int rows = gf->inplace && (what & GF_SWEEP_STREAM);
+    gridfluid_lattice_t *dst = gf->inplace ? &gf->grid : &gf->nextgrid;
+    gridfluid_lattice_t view;
+    for (size_t ty = band->y0; ty < band->y1; ty += tile_y) {
+        size_t ty1 = ty + tile_y < band->y1 ? ty + tile_y : band->y1;
+        for (size_t tx = 1; tx <= inner; tx += tile_x) {
+            size_t tx1 = tx + tile_x <= inner ? tx + tile_x : inner + 1;
+            for (size_t y = ty; y < ty1; y++) {
+                if (rows) {
+                    row_view(gf, &view, band_row(band, tile_y + 1, y), y);
+                    dst = &view;
+                }
+                gridfluid_sweep_row(gf, band, dst, y, tx, tx1, what);
+            }
+        }
+        // every row up to ty1-1 is streamed, so all but that one are final
+        if (rows) {
+            for (size_t y = ty > band->y0 + 1 ? ty - 1 : band->y0 + 1; y + 1 < ty1; y++) {
+                row_store(gf, band_row(band, tile_y + 1, y), y);
+            }
+        }
+    }
+    // tiles visit cells out of row-major order; restore it so cleanup
+    // converts cells in the same order whatever the tiling
+    if ((what & GF_SWEEP_COLLIDE) && gf->tile_x && gf->tile_x < inner)
+        qsort(band->changed.items, band->changed.len, sizeof(size_t), cmp_index);
+}
+
+static void gridfluid_fused_band(void *ctx, size_t worker, size_t nworkers) {
+    gridfluid_t gf = ctx;
+    gridfluid_sweep_band(gf, gridfluid_band(gf, worker, nworkers), GF_SWEEP_STREAM | GF_SWEEP_COLLIDE);
+}
+
+static void gridfluid_stream_band(void *ctx, size_t worker, size_t nworkers) {
+    gridfluid_t gf = ctx;
+    gridfluid_sweep_band(gf, gridfluid_band(gf, worker, nworkers), GF_SWEEP_STREAM);
+}
+
+static void gridfluid_collide_band(void *ctx, size_t worker, size_t nworkers) {
+    gridfluid_t gf = ctx;
+    gridfluid_sweep_band(gf, gridfluid_band(gf, worker, nworkers), GF_SWEEP_COLLIDE);
+}
+
+static void gridfluid_run_phase(gridfluid_t gf, gfpool_fn fn, gridfluid_phase phase) {
+    if (!gf->tracing) {
+        gridfluid_run(gf, fn);
+        return;
+    }
+    uint64_t start = trace_clock();
+    gridfluid_run(gf, fn);
+    emit_phase(gf, phase, start);
+}
+
+// Advances the lattice by one stream and collide. Unfused, the two run as
+// separate full passes; that costs an extra trip through memory and only
+// exists so the phases can be measured on their own.
+static void gridfluid_stream_collide(gridfluid_t gf) {
+    if (gf->inplace)
+        gridfluid_alloc_rows(gf);
+    if (gf->fused) {
+        gridfluid_run_phase(gf, gridfluid_fused_band, GF_PHASE_STREAM_COLLIDE);
+        if (gf->inplace)
+            gridfluid_flush_rows(gf);
+    } else {
+        gridfluid_run_phase(gf, gridfluid_stream_band, GF_PHASE_STREAM);
+        if (gf->inplace)
+            gridfluid_flush_rows(gf);
+        gridfluid_run_phase(gf, gridfluid_collide_band, GF_PHASE_COLLIDE);
+    }
+    gf->filled = 0;
+    gf->emptied = 0;
+    gf->changed.len = 0;
+    gridfluid_properties_t *props = gf->props;
+    props->max_pressure = 0;
+    props->min_pressure = INFINITY;
+    float max_usqr = 0;
+    for (size_t i = 0; i < gf->nbands; i++) {
+        gridfluid_band_t *band = &gf->bands[i];
+        props->total_mass += band->total_mass;
+        if (band->max_pressure > props->max_pressure)
+            props->max_pressure = band->max_pressure;
+        if (band->min_pressure < props->min_pressure)
+            props->min_pressure = band->min_pressure;
+        if (band->max_usqr > max_usqr)
+            max_usqr = band->max_usqr;
+        gf->filled += band->filled;
+        gf->emptied += band->emptied;
+        for (size_t k = 0; k < band->changed.len; k++) {
+            list_push(&gf->changed, band->changed.items[k]);
+        }
+    }
+    props->max_velocity = sqrtf(max_usqr);
+    gf->props_dirty = 0;
+    if (gf->inplace)
+        return;
+    gridfluid_lattice_t tmp = gf->grid;
+    gf->grid = gf->nextgrid;
+    gf->nextgrid = tmp;
+}
+
+static void gridfluid_avg_macro(gridfluid_t gf, size_t c, float *pressure, float *ux, float *uy) {
+    float tpressure = 0;
+    float tux = 0;
+    float tuy = 0;
+    size_t count = 0;
+    unsigned mask = GF_NMASK(gf, c, GF_FLUID) | GF_NMASK(gf, c, GF_INTERFACE);
+    while (mask) {
+        float ipressure;
+        float iux;
+        float iuy;
+        float df[9];
+        size_t i = scan_dir[__builtin_ctz(mask)];
+        mask &= mask-1;
+        load_df(&gf->grid, c + gf->offset[i], df);
+        gridfluid_cell_macro(df, &ipressure, &iux, &iuy);
+        count++;
+        tpressure += ipressure;
+        tux += iux;
+        tuy += iuy;
+    }
+    if (count == 0)
+        return;
+    *pressure = tpressure / count;
+    *ux = tux / count;
+    *uy = tuy / count;
+}
+
+// Adds a cell that cleanup turned from empty into interface to the
+// diagnostics the sweep gathered. Cells that emptied are not taken back
+// out: the extrema describe every cell that took part in the step.
+static void props_fold(gridfluid_t gf, size_t c, float pressure, float ux, float uy) {
+    gridfluid_properties_t *props = gf->props;
+    float velocity = sqrtf(ux*ux + uy*uy);
+    props->pressure[c] = pressure;
+    props->mass[c] = gf->grid.mass[c];
+    if (pressure > props->max_pressure)
+        props->max_pressure = pressure;
+    if (pressure < props->min_pressure)
+        props->min_pressure = pressure;
+    if (velocity > props->max_velocity)
+        props->max_velocity = velocity;
+}
+
+static void distribmass(gridfluid_t gf, size_t c) {
+    gridfluid_lattice_t *lat = &gf->grid;
+    float partials[9] = {0,0,0,0,0,0,0};
+    float total = 0;
+    size_t count = 0;
+    float nx=0;
+    float ny=0;
+    gridfluid_cell_normal(gf, c, &nx, &ny);
+    uint8_t imask = GF_NMASK(gf, c, GF_INTERFACE);
+    gridfluid_change_flag change = gf->changeflags[c];
+    int mul = (change == GF_CHANGE_FILLED) ? 1 : -1;
+    float mass = 0;
+    float pressure, ux, uy;
+    float df[9];
+    if (change == GF_CHANGE_FILLED) {
+        load_df(lat, c, df);
+        gridfluid_cell_macro(df, &pressure, &ux, &uy);
+        mass = lat->mass[c] - pressure;
+    } else if (change == GF_CHANGE_EMPTIED) {
+        mass = lat->mass[c];
+    }
+    for (size_t i=0; i<9; i++) {
+        int dx = velocities[i][0];
+        int dy = velocities[i][1];
+        if (dx == 0 && dx == dy)
+            continue;
+        if (!(imask & dir_bit[i]))
+            continue;
+        float n_e = dot2f(nx,ny,dx,dy) * mul;
+        if (n_e > 0) {
+            total += n_e;
+            partials[i] = n_e;
+            count++;
+        }
+
+    }
+    if (count == 0) {
+        return;
+    }
+    for (size_t i=0; i<9; i++) {
+        int dx = velocities[i][0];
+        int dy = velocities[i][1];
+        size_t n = ghost_target(gf, c + gf->offset[i]);
+        // what would go to an open side leaves the scene
+        if (n == SIZE_MAX)
+            continue;
+        load_df(lat, n, df);
+        gridfluid_cell_macro(df, &pressure, &ux, &uy);
+        if (dx == 0 && dx == dy) {
+            lat->mass[c] -= mass;
+            gf->props->mass[c] = lat->mass[c];
+            gf->props->total_mass -= mass;
+            lat->fluid[c] = lat->mass[c]/pressure;
+            check_valid(gf,lat,c);
+            continue;
+        }
+        if (!(imask & dir_bit[i]))
+            continue;
+        float deltamass = mass * partials[i]/total;
+        lat->mass[n] += deltamass;
+        gf->props->mass[n] = lat->mass[n];
+        gf->props->total_mass += deltamass;
+        lat->fluid[n] = lat->mass[n]/pressure;
+        check_valid(gf,lat,n);
+    }
+}
+
+// Cleanup converts the cells the sweep flagged as filled or emptied, in
+// three passes over the changed list: fills, empties, then the excess mass
+// of both. Only the changed list and the 3x3 neighbourhoods around it are
+// visited, so the cost follows the length of the free surface rather than
+// the domain.
+static void cleanup_fill(gridfluid_t gf) {
+    gridfluid_lattice_t *lat = &gf->grid;
+    const gridfluid_list_t *changed = &gf->changed;
+    for (size_t k = 0; k < changed->len; k++) {
+        size_t c = changed->items[k];
+        if (gf->changeflags[c] != GF_CHANGE_FILLED)
+            continue;
+        if (gf->tracing)
+            emit_cell(gf, GF_EVENT_FILLED, c);
+        // snapshot: converting neighbours below rewrites this cell's masks
+        uint8_t imask = GF_NMASK(gf, c, GF_INTERFACE);
+        uint8_t emask = GF_NMASK(gf, c, GF_EMPTY);
+        unsigned mask = imask | emask;
+        while (mask) {
+            unsigned bit = mask & -mask;
+            size_t i = scan_dir[__builtin_ctz(mask)];
+            mask &= mask-1;
+            size_t n = ghost_target(gf, c + gf->offset[i]);
+            if (n == SIZE_MAX)
+                continue;
+            if ((imask & bit) && gf->changeflags[n] == GF_CHANGE_EMPTIED )
+                gf->changeflags[n] = GF_CHANGE_NONE;
+            // a periodic ghost's cell may have been converted through
+            // another ghost already
+            if (!(emask & bit) || gf->flags[n] != GF_EMPTY)
+                continue;
+            float pressure = 0;
+            float ux = 0;
+            float uy = 0;
+            float eq[9];
+            gridfluid_avg_macro(gf,n,&pressure,&ux,&uy);
+            gridfluid_eq(pressure, ux, uy, eq);
+            set_flag(gf, n, GF_INTERFACE);
+            list_push(&gf->fresh, n);
+            lat->fluid[n] = lat->mass[n]/pressure;
+            store_df(lat, n, eq);
+            props_fold(gf, n, pressure, ux, uy);
+            // neigh might not be valid here, until after mass is distributed
+        }
+        set_flag(gf, c, GF_FLUID);
+    }
+}
+
+static void cleanup_empty(gridfluid_t gf) {
+    const gridfluid_list_t *changed = &gf->changed;
+    for (size_t k = 0; k < changed->len; k++) {
+        size_t c = changed->items[k];
+        if (gf->changeflags[c] != GF_CHANGE_EMPTIED)
+            continue;
+        if (gf->tracing)
+            emit_cell(gf, GF_EVENT_EMPTIED, c);
+        unsigned mask = GF_NMASK(gf, c, GF_FLUID);
+        while (mask) {
+            size_t i = scan_dir[__builtin_ctz(mask)];
+            mask &= mask-1;
+            size_t n = ghost_target(gf, c + gf->offset[i]);
+            if (n == SIZE_MAX || gf->flags[n] != GF_FLUID)
+                continue;
+            set_flag(gf, n, GF_INTERFACE);
+            list_push(&gf->fresh, n);
+        }
+        set_flag(gf, c, GF_EMPTY);
+    }
+}
+
+static void cleanup_distrib(gridfluid_t gf) {
+    gridfluid_lattice_t *lat = &gf->grid;
+    const gridfluid_list_t *changed = &gf->changed;
+    for (size_t k = 0; k < changed->len; k++) {
+        size_t c = changed->items[k];
+        if (gf->changeflags[c] == GF_CHANGE_NONE)
+            continue;
+        distribmass(gf, c);
+        check_valid(gf,lat,c);
+        gf->changeflags[c] = GF_CHANGE_NONE;
+    }
+}
+
+typedef void (*gridfluid_cleanup_fn)(gridfluid_t gf);
+
+static const gridfluid_cleanup_fn cleanup_passes[] = {
+    cleanup_fill,
+    cleanup_empty,
+    cleanup_distrib
+};
+
+// Partitioned mode. Each process holds its strip of the domain plus
+// GF_HALO rows of each neighbouring strip as an ordinary scene, and steps
+// only its own rows. Streaming a row reads the rows next to it, so before
+// the sweep every strip sends its edge rows to its neighbours' halos.
+//
+// Cleanup is what crosses strips: converting a cell rewrites its
+// neighbours and reads theirs. A single scene runs each pass over all of
+// the changed list in row order, which is strip order, so the passes are
+// handed down the strips like a baton. A strip's turn starts by taking the
+// rows around its top edge from the strip above, which just had its turn,
+// and the rows around its bottom edge from the strip below, as that left
+// them after its last turn. The turn ends by handing both back. Each
+// process only ever waits for its two neighbours, and the results are
+// those of the whole domain stepped as one scene.
+#define GF_HALO 2
+// a strip must be tall enough that the messages at its two ends do not
+// overlap
+#define GF_STRIP_MIN (2*GF_HALO)
+
+// Cells of row first (a global row) onwards, each plane in turn; flags
+// come last since they are applied through set_flag.
+typedef struct gridfluid_halo_msg {
+    uint64_t first;
+    uint64_t rows;
+} gridfluid_halo_msg_t;
+
+#define GF_HALO_PLANES 14
+
+// bytes a cell takes in a halo message
+#define GF_HALO_CELL (9*sizeof(gf_df_t) + 4*sizeof(float) + 2)
+
+// The planes a halo message carries besides flags, and their element sizes.
+static void halo_planes(gridfluid_t gf, char **planes, size_t *elem) {
+    for (size_t i = 0; i<9; i++) {
+        planes[i] = (char *)gf->grid.df[i];
+        elem[i] = sizeof(gf_df_t);
+    }
+    planes[9] = (char *)gf->grid.mass;
+    planes[10] = (char *)gf->grid.fluid;
+    planes[11] = (char *)gf->props->pressure;
+    planes[12] = (char *)gf->props->mass;
+    for (size_t i = 9; i < 13; i++) {
+        elem[i] = sizeof(float);
+    }
+    planes[13] = (char *)gf->changeflags;
+    elem[13] = 1;
+}
+
+// Sends rows [y0,y1) to the neighbour in dir.
+static void halo_send(gridfluid_t gf, int dir, size_t y0, size_t y1) {
+    char *planes[GF_HALO_PLANES];
+    size_t elem[GF_HALO_PLANES];
+    halo_planes(gf, planes, elem);
+    gridfluid_halo_msg_t *msg = gfhalo_send_begin(gf->halo, dir);
+    msg->first = gf->origin + y0;
+    msg->rows = y1 - y0;
+    char *p = (char *)(msg + 1);
+    size_t c0 = GF_IDX(gf,0,y0);
+    size_t n = (y1 - y0) * gf->x;
+    for (size_t i = 0; i < GF_HALO_PLANES; i++) {
+        memcpy(p, planes[i] + c0*elem[i], n*elem[i]);
+        p += n*elem[i];
+    }
+    memcpy(p, gf->flags + c0, n);
+    gfhalo_send_end(gf->halo, dir);
+}
+
+// Takes the next rows the neighbour in dir sent.
+static void halo_recv(gridfluid_t gf, int dir) {
+    char *planes[GF_HALO_PLANES];
+    size_t elem[GF_HALO_PLANES];
+    halo_planes(gf, planes, elem);
+    const gridfluid_halo_msg_t *msg = gfhalo_recv_begin(gf->halo, dir);
+    const char *p = (const char *)(msg + 1);
+    size_t c0 = GF_IDX(gf,0,msg->first - gf->origin);
+    size_t n = msg->rows * gf->x;
+    for (size_t i = 0; i < GF_HALO_PLANES; i++) {
+        memcpy(planes[i] + c0*elem[i], p, n*elem[i]);
+        p += n*elem[i];
+    }
+    for (size_t k = 0; k < n; k++) {
+        set_flag(gf, c0 + k, p[k]);
+    }
+    gfhalo_recv_end(gf->halo, dir);
+}
+
+// Before the sweep: the edge rows of every strip to its neighbours.
+static void partition_exchange(gridfluid_t gf) {
+    // past the ghost row, if any, the rows are the neighbours'
+    int up = gf->row0 > 1;
+    int down = gf->row1 + 1 < gf->y;
+    if (up)
+        halo_send(gf, GFHALO_UP, gf->row0, gf->row0 + GF_HALO);
+    if (down)
+        halo_send(gf, GFHALO_DOWN, gf->row1 - GF_HALO, gf->row1);
+    if (up)
+        halo_recv(gf, GFHALO_UP);
+    if (down)
+        halo_recv(gf, GFHALO_DOWN);
+}
+
+static void partition_cleanup(gridfluid_t gf) {
+    // past the ghost row, if any, the rows are the neighbours'
+    int up = gf->row0 > 1;
+    int down = gf->row1 + 1 < gf->y;
+    // the strip above takes its first turn after this one's sweep
+    if (up)
+        halo_send(gf, GFHALO_UP, gf->row0, gf->row0 + GF_HALO);
+    for (size_t k = 0; k < sizeof(cleanup_passes)/sizeof(cleanup_passes[0]); k++) {
+        if (up)
+            halo_recv(gf, GFHALO_UP);
+        if (down)
+            halo_recv(gf, GFHALO_DOWN);
+        cleanup_passes[k](gf);
+        if (down)
+            halo_send(gf, GFHALO_DOWN, gf->row1 - GF_HALO, gf->row1 + GF_HALO);
+        if (up)
+            halo_send(gf, GFHALO_UP, gf->row0 - GF_HALO, gf->row0 + GF_HALO);
+    }
+    // what the strip below did to this one's rows on its last turn
+    if (down)
+        halo_recv(gf, GFHALO_DOWN);
+}
+
+static void gridfluid_cleanup(gridfluid_t gf) {
+    gf->fresh.len = 0;
+    if (gf->halo) {
+        partition_cleanup(gf);
+        return;
+    }
+    for (size_t k = 0; k < sizeof(cleanup_passes)/sizeof(cleanup_passes[0]); k++) {
+        cleanup_passes[k](gf);
+    }
+}
+
+// Sleeping tiles. The rows a scene steps are cut into GF_SLEEP_TILE square
+// tiles. After each step a tile is active if the largest density change or
+// velocity the collide saw in it exceeds sleep_threshold, or if cleanup
+// converted one of its cells or moved mass into it. A tile with no active
+// tile round it for sleep_steps steps in a row falls asleep: the sweep
+// skips it, so its cells keep their distributions and its neighbours stream
+// from them unchanged. An active tile wakes the tiles round it for the next
+// step, before what it does can have crossed into them.
+
+static void sleep_wake_all(gridfluid_t gf) {
+    size_t n = gf->sleep_nx * gf->sleep_ny;
+    memset(gf->asleep, 0, n);
+    memset(gf->quiet, 0, n * sizeof(unsigned));
+    gf->sleep_wake = 0;
+}
+
+static void sleep_mark(gridfluid_t gf, size_t c) {
+    size_t x = c % gf->x;
+    size_t y = c / gf->x;
+    if (x == 0 || x + 1 >= gf->x || y < gf->row0 || y >= gf->row1)
+        return;
+    gf->active[(y - gf->row0) / GF_SLEEP_TILE * gf->sleep_nx + (x - 1) / GF_SLEEP_TILE] = 1;
+}
+
+// Puts tile (tx, ty) to sleep. Out of place, nextgrid gets its cells too,
+// so the tile reads the same whichever lattice the next steps swap in. Each
+// of its rows keeps what the sweep would add to the diagnostics.
+static void sleep_tile(gridfluid_t gf, size_t tx, size_t ty) {
+    size_t x0 = 1 + tx * GF_SLEEP_TILE;
+    size_t x1 = x0 + GF_SLEEP_TILE < gf->x - 1 ? x0 + GF_SLEEP_TILE : gf->x - 1;
+    size_t y0 = gf->row0 + ty * GF_SLEEP_TILE;
+    size_t y1 = y0 + GF_SLEEP_TILE < gf->row1 ? y0 + GF_SLEEP_TILE : gf->row1;
+    float pressure, ux, uy;
+    float df[9];
+    for (size_t y = y0; y < y1; y++) {
+        size_t c0 = GF_IDX(gf,x0,y);
+        size_t n = x1 - x0;
+        gridfluid_sleep_row_t *row = &gf->sleep_rows[y * gf->sleep_nx + tx];
+        if (!gf->inplace) {
+            for (size_t i = 0; i<9; i++) {
+                memcpy(gf->nextgrid.df[i] + c0, gf->grid.df[i] + c0, n * sizeof(gf_df_t));
+            }
+            memcpy(gf->nextgrid.mass + c0, gf->grid.mass + c0, n * sizeof(float));
+            memcpy(gf->nextgrid.fluid + c0, gf->grid.fluid + c0, n * sizeof(float));
+        }
+        row->mass = 0;
+        row->max_pressure = 0;
+        row->min_pressure = INFINITY;
+        row->max_usqr = 0;
+        for (size_t c = c0; c < c0 + n; c++) {
+            row->mass += gf->grid.mass[c];
+            if (gf->flags[c] != GF_FLUID && gf->flags[c] != GF_INTERFACE)
+                continue;
+            load_df(&gf->grid, c, df);
+            gridfluid_cell_macro(df, &pressure, &ux, &uy);
+            float usqr = ux*ux + uy*uy;
+            if (gf->props->pressure[c] > row->max_pressure)
+                row->max_pressure = gf->props->pressure[c];
+            if (gf->props->pressure[c] < row->min_pressure)
+                row->min_pressure = gf->props->pressure[c];
+            if (usqr > row->max_usqr)
+                row->max_usqr = usqr;
+        }
+    }
+    gf->asleep[ty * gf->sleep_nx + tx] = 1;
+}
+
+static void sleep_update(gridfluid_t gf) {
+    size_t nx = gf->sleep_nx;
+    size_t ny = gf->sleep_ny;
+    memset(gf->active, 0, nx * ny);
+    for (size_t y = gf->row0; y < gf->row1; y++) {
+        gridfluid_sleep_row_t *row = &gf->sleep_rows[y * nx];
+        uint8_t *active = gf->active + (y - gf->row0) / GF_SLEEP_TILE * nx;
+        for (size_t tx = 0; tx < nx; tx++) {
+            if (row[tx].activity > gf->sleep_threshold)
+                active[tx] = 1;
+            row[tx].activity = 0;
+        }
+    }
+    for (size_t i = 0; i < gf->changed.len; i++)
+        sleep_mark(gf, gf->changed.items[i]);
+    for (size_t i = 0; i < gf->fresh.len; i++)
+        sleep_mark(gf, gf->fresh.items[i]);
+    int wrap_x = gf->boundary[GF_SIDE_LEFT] == GF_BOUNDARY_PERIODIC;
+    int wrap_y = gf->boundary[GF_SIDE_TOP] == GF_BOUNDARY_PERIODIC;
+    for (size_t ty = 0; ty < ny; ty++) {
+        for (size_t tx = 0; tx < nx; tx++) {
+            size_t t = ty * nx + tx;
+            // the edge rows of a strip are read by the neighbouring
+            // process, which cannot wake them
+            int disturbed = gf->halo && (ty == 0 || ty + 1 == ny);
+            for (size_t dy = 0; dy < 3 && !disturbed; dy++) {
+                size_t y = ty + dy + ny - 1;
+                if (!wrap_y && (y < ny || y >= 2*ny))
+                    continue;
+                for (size_t dx = 0; dx < 3; dx++) {
+                    size_t x = tx + dx + nx - 1;
+                    if (!wrap_x && (x < nx || x >= 2*nx))
+                        continue;
+                    disturbed |= gf->active[y % ny * nx + x % nx];
+                }
+            }
+            if (disturbed) {
+                gf->quiet[t] = 0;
+                gf->asleep[t] = 0;
+            } else if (!gf->asleep[t] && ++gf->quiet[t] >= gf->sleep_steps) {
+                sleep_tile(gf, tx, ty);
+            }
+        }
+    }
+}
+
+void gridfluid_set_sleep(gridfluid_t gf, float threshold, unsigned steps) {
+    free(gf->asleep);
+    free(gf->active);
+    free(gf->quiet);
+    free(gf->sleep_rows);
+    gf->asleep = NULL;
+    gf->active = NULL;
+    gf->quiet = NULL;
+    gf->sleep_rows = NULL;
+    gf->sleep_steps = threshold > 0 ? steps : 0;
+    if (!gf->sleep_steps)
+        return;
+    gf->sleep_threshold = threshold;
+    gf->sleep_nx = (gf->x - 2 + GF_SLEEP_TILE - 1) / GF_SLEEP_TILE;
+    gf->sleep_ny = (gf->row1 - gf->row0 + GF_SLEEP_TILE - 1) / GF_SLEEP_TILE;
+    size_t n = gf->sleep_nx * gf->sleep_ny;
+    gf->asleep = calloc(n, sizeof(uint8_t));
+    gf->active = calloc(n, sizeof(uint8_t));
+    gf->quiet = calloc(n, sizeof(unsigned));
+    gf->sleep_rows = calloc(gf->y * gf->sleep_nx, sizeof(gridfluid_sleep_row_t));
+    if (!gf->asleep || !gf->active || !gf->quiet || !gf->sleep_rows)
+        abort();
+}
+
+size_t gridfluid_get_awake(gridfluid_t gf) {
+    size_t awake = (gf->x - 2) * (gf->row1 - gf->row0);
+    if (!gf->sleep_steps || gf->sleep_wake)
+        return( awake );
+    for (size_t ty = 0; ty < gf->sleep_ny; ty++) {
+        size_t h = gf->row1 - gf->row0 - ty * GF_SLEEP_TILE;
+        for (size_t tx = 0; tx < gf->sleep_nx; tx++) {
+            size_t w = gf->x - 2 - tx * GF_SLEEP_TILE;
+            if (gf->asleep[ty * gf->sleep_nx + tx])
+                awake -= (w < GF_SLEEP_TILE ? w : GF_SLEEP_TILE) * (h < GF_SLEEP_TILE ? h : GF_SLEEP_TILE);
+        }
+    }
+    return( awake );
+}
+
+gridfluid_t gridfluid_create_empty_scene(size_t x, size_t y) {
+    gridfluid_t gf = calloc(1, sizeof(struct gridfluid));
+    if (!gf)
+        abort();
+    gf->props = &gf->properties;
+    gf->x = x;
+    gf->y = y;
+    gf->row0 = 1;
+    gf->row1 = y - 1;
+    for (size_t i = 0; i<9; i++) {
+        gf->offset[i] = (ptrdiff_t)velocities[i][0] + (ptrdiff_t)velocities[i][1]*(ptrdiff_t)x;
+    }
+    gf->atmosphere = 1.0;
+    gridfluid_set_gravity(gf, 0.01);
+    gridfluid_set_omega(gf, 0.50);
+    gridfluid_storage_t st;
+    if (!storage_alloc(&st, x*y))
+        abort();
+    storage_bind(gf, &st);
+    gf->sleep_wake = 1;
+    gf->props_dirty = 1;
+    gf->props->x = x;
+    gf->props->y = y;
+    gridfluid_set_simd(gf, GF_SIMD_AUTO);
+    gridfluid_set_threads(gf, 1);
+    gf->fused = 1;
+    for (size_t i = 1; i < x-1; i++) {
+        for (size_t j = 1; j < y-1; j++) {
+            gf->flags[GF_IDX(gf,i,j)] = GF_EMPTY;
+            /*
+            gridfluid_set_fluid(gf, i, j);
+            if (i == x/3 || i < 4 || i >= x-4 || j < 4 || j >= y-4)
+                gf->flags[GF_IDX(gf,i,j)] = GF_INTERFACE;
+            if (i > x/3 || i < 3 || i >= x-3 || j < 3 || j >= y-3)
+                gf->flags[GF_IDX(gf,i,j)] = GF_EMPTY;
+            //gf->flags[GF_IDX(gf,i,j)] = GF_EMPTY;
+            */
+        }
+    }
+    nmask_rebuild(gf);
+    return(gf);
+}
+
+gridfluid_t gridfluid_create_partition(size_t x, size_t y, const char *name, size_t rank, size_t nranks) {
+    if (rank >= nranks || y / nranks < GF_STRIP_MIN) {
+        errno = EINVAL;
+        return NULL;
+    }
+    size_t y0 = y * rank / nranks;
+    size_t y1 = y * (rank+1) / nranks;
+    size_t top = rank > 0 ? GF_HALO : 0;
+    size_t bottom = rank+1 < nranks ? GF_HALO : 0;
+    gridfluid_t gf = gridfluid_create_empty_scene(x, top + (y1 - y0) + bottom);
+    gf->origin = y0 - top;
+    // the domain's first and last rows are ghost rows
+    gf->row0 = rank > 0 ? top : 1;
+    gf->row1 = top + (y1 - y0) - (rank+1 == nranks);
+    if (nranks > 1) {
+        size_t bytes = sizeof(gridfluid_halo_msg_t) + 2*GF_HALO * x * GF_HALO_CELL;
+        gf->halo = gfhalo_open(name, rank, nranks, bytes);
+        if (!gf->halo) {
+            int err = errno;
+            gridfluid_free(gf);
+            errno = err;
+            return NULL;
+        }
+    }
+    return(gf);
+}
+
+void gridfluid_get_partition(gridfluid_t gf, size_t *origin, size_t *y0, size_t *y1) {
+    *origin = gf->origin;
+    *y0 = gf->row0;
+    *y1 = gf->row1;
+}
+
+void gridfluid_free(gridfluid_t gf) {
+    gfhalo_close(gf->halo);
+    gfpool_free(gf->pool);
+    gfring_free(gf->events);
+    for (size_t i = 0; i < gf->nbands; i++) {
+        list_free(&gf->bands[i].changed);
+        band_free_rows(&gf->bands[i]);
+    }
+    free(gf->bands);
+    list_free(&gf->changed);
+    list_free(&gf->fresh);
+    list_free(&gf->ghost);
+    free(gf->asleep);
+    free(gf->active);
+    free(gf->quiet);
+    free(gf->sleep_rows);
+    storage_free(gf);
+    free(gf);
+}
+
+int gridfluid_set_obstacle(gridfluid_t gf, size_t x, size_t y) {
+    if (is_ghost(gf, x, y))
+        return 0;
+    set_flag(gf, GF_IDX(gf,x,y), GF_OBSTACLE);
+    gf->sleep_wake = 1;
+    gf->props_dirty = 1;
+    return 1;
+}
+
+int gridfluid_set_fluid(gridfluid_t gf, size_t x, size_t y) {
+    gridfluid_lattice_t *lat = &gf->grid;
+    size_t c = GF_IDX(gf,x,y);
+    float df[9];
+    if (is_ghost(gf, x, y))
+        return 0;
+    gridfluid_eq(1,0.00,0.00,df);
+    store_df(lat, c, df);
+    set_flag(gf, c, GF_FLUID);
+    lat->mass[c] = 1;
+    lat->fluid[c] = 1;
+    gf->sleep_wake = 1;
+    gf->props_dirty = 1;
+    unsigned mask = GF_NMASK(gf, c, GF_EMPTY);
+    while (mask) {
+        size_t i = scan_dir[__builtin_ctz(mask)];
+        mask &= mask-1;
+        size_t n = ghost_target(gf, c + gf->offset[i]);
+        if (n == SIZE_MAX || gf->flags[n] != GF_EMPTY)
+            continue;
+        gridfluid_eq(0.9,0.00,0.00,df);
+        store_df(lat, n, df);
+        set_flag(gf, n, GF_INTERFACE);
+        lat->mass[n] = 0.9;
+        lat->fluid[n] = 0.9;
+    }
+    return 1;
+}
+
+int gridfluid_set_empty(gridfluid_t gf, size_t x, size_t y) {
+    if (is_ghost(gf, x, y))
+        return 0;
+    set_flag(gf, GF_IDX(gf,x,y), GF_EMPTY);
+    gf->sleep_wake = 1;
+    gf->props_dirty = 1;
+    return 1;
+}
+
+// Bulk edits write the cells of a block plane by plane, without going
+// through set_flag, and then settle the block in one pass: see bulk_settle.
+typedef struct gridfluid_rect {
+    size_t x0;
+    size_t y0;
+    size_t x1;
+    size_t y1;
+} gridfluid_rect_t;
+
+// A cell at rest with density pressure, packed the way the lattice stores
+// it, so a bulk edit computes it once and copies it.
+typedef struct gridfluid_rest {
+    gf_df_t df[9];
+    float mass;
+} gridfluid_rest_t;
+
+static void rest_init(gridfluid_rest_t *rest, float pressure) {
+    float df[9];
+    gridfluid_lattice_t one;
+    gridfluid_eq(pressure, 0.00, 0.00, df);
+    for (size_t i = 0; i<9; i++) {
+        one.df[i] = &rest->df[i];
+        df_put(&one, i, 0, df[i]);
+    }
+    rest->mass = pressure;
+}
+
+static void rest_put(gridfluid_lattice_t *lat, size_t c0, size_t c1, const gridfluid_rest_t *rest) {
+    for (size_t i = 0; i<9; i++) {
+        gf_df_t *plane = lat->df[i];
+        for (size_t c = c0; c < c1; c++) {
+            plane[c] = rest->df[i];
+        }
+    }
+    for (size_t c = c0; c < c1; c++) {
+        lat->mass[c] = rest->mass;
+        lat->fluid[c] = rest->mass;
+    }
+}
+
+// Clips the w by h block at (x, y) to the cells the setters edit. Returns 0
+// if none are left.
+static int edit_rect(gridfluid_t gf, size_t x, size_t y, size_t w, size_t h, gridfluid_rect_t *r) {
+    size_t top = ghost_row(gf, 0);
+    size_t bottom = gf->y - ghost_row(gf, gf->y - 1);
+    r->x0 = x > 1 ? x : 1;
+    r->y0 = y > top ? y : top;
+    r->x1 = x < gf->x - 1 && w < gf->x - 1 - x ? x + w : gf->x - 1;
+    r->y1 = y < bottom && h < bottom - y ? y + h : bottom;
+    return( r->x0 < r->x1 && r->y0 < r->y1 );
+}
+
+// Across a periodic side an edge cell's neighbours are at the far edge,
+// which the block need not reach. With the ghosts showing the new states,
+// the cells along the edges are settled again.
+static void bulk_settle_edges(gridfluid_t gf, const gridfluid_rest_t *iface) {
+    ghost_fill(gf);
+    for (size_t y = 1; y + 1 < gf->y; y++) {
+        int edge = ghost_row(gf, y-1) || ghost_row(gf, y+1);
+        for (size_t x = 1; x + 1 < gf->x; x += edge || x + 2 == gf->x ? 1 : gf->x - 3) {
+            size_t c = GF_IDX(gf,x,y);
+            if (gf->flags[c] != GF_EMPTY || !GF_NMASK(gf, c, GF_FLUID))
+                continue;
+            set_flag(gf, c, GF_INTERFACE);
+            rest_put(&gf->grid, c, c+1, iface);
+        }
+    }
+    ghost_fill(gf);
+}
+
+// Ends every bulk edit of block r: each empty cell next to fluid, in the
+// block or the ring round it, becomes an interface cell the way
+// gridfluid_set_fluid makes its neighbours. Only empty cells change and
+// only into interface cells, so one pass in any order settles the block.
+// The masks of the cells that changed and of their neighbours are then
+// rebuilt at once.
+static void bulk_settle(gridfluid_t gf, const gridfluid_rect_t *r) {
+    gridfluid_rest_t iface;
+    rest_init(&iface, 0.9);
+    // the rows a strip holds at its very ends lack neighbours on one side
+    // and are overwritten by the step anyway
+    size_t y0 = r->y0 > 1 ? r->y0 - 1 : 1;
+    size_t y1 = r->y1 + 1 < gf->y - 1 ? r->y1 + 1 : gf->y - 1;
+    size_t x0 = r->x0 > 1 ? r->x0 - 1 : 1;
+    size_t x1 = r->x1 + 1 < gf->x - 1 ? r->x1 + 1 : gf->x - 1;
+    for (size_t y = y0; y < y1; y++) {
+        for (size_t c = GF_IDX(gf,x0,y); c < GF_IDX(gf,x1,y); c++) {
+            if (gf->flags[c] != GF_EMPTY)
+                continue;
+            for (size_t i=1; i<9; i++) {
+                if (gf->flags[c + gf->offset[i]] == GF_FLUID) {
+                    gf->flags[c] = GF_INTERFACE;
+                    rest_put(&gf->grid, c, c+1, &iface);
+                    break;
+                }
+            }
+        }
+    }
+    nmask_rebuild_rect(gf, x0 - 1, y0 - 1, x1 + 1, y1 + 1);
+    if (gf->ghost.len)
+        bulk_settle_edges(gf, &iface);
+    gf->sleep_wake = 1;
+    gf->props_dirty = 1;
+}
+
+int gridfluid_fill_rect(gridfluid_t gf, size_t x, size_t y, size_t w, size_t h, gridfluid_state state) {
+    gridfluid_rect_t r;
+    if (state != GF_OBSTACLE && state != GF_EMPTY && state != GF_FLUID)
+        return 0;
+    if (!edit_rect(gf, x, y, w, h, &r))
+        return 1;
+    gridfluid_rest_t full;
+    rest_init(&full, 1);
+    for (size_t row = r.y0; row < r.y1; row++) {
+        size_t c0 = GF_IDX(gf,r.x0,row);
+        size_t c1 = GF_IDX(gf,r.x1,row);
+        memset(gf->flags + c0, state, c1 - c0);
+        if (state == GF_FLUID)
+            rest_put(&gf->grid, c0, c1, &full);
+    }
+    bulk_settle(gf, &r);
+    return 1;
+}
+
+int gridfluid_apply_mask(gridfluid_t gf, size_t x, size_t y, size_t w, size_t h, const uint8_t *mask) {
+    gridfluid_rect_t r;
+    for (size_t i = 0; i < w*h; i++) {
+        if (mask[i] != GF_OBSTACLE && mask[i] != GF_EMPTY && mask[i] != GF_FLUID && mask[i] != GF_MASK_KEEP)
+            return 0;
+    }
+    if (!edit_rect(gf, x, y, w, h, &r))
+        return 1;
+    gridfluid_rest_t full;
+    rest_init(&full, 1);
+    for (size_t row = r.y0; row < r.y1; row++) {
+        const uint8_t *m = mask + (row - y) * w + (r.x0 - x);
+        size_t c0 = GF_IDX(gf,r.x0,row);
+        size_t n = r.x1 - r.x0;
+        // a run of equal cells at a time, written like gridfluid_fill_rect
+        for (size_t i = 0, j; i < n; i = j) {
+            for (j = i + 1; j < n && m[j] == m[i]; j++)
+                ;
+            if (m[i] == GF_MASK_KEEP)
+                continue;
+            memset(gf->flags + c0 + i, m[i], j - i);
+            if (m[i] == GF_FLUID)
+                rest_put(&gf->grid, c0 + i, c0 + j, &full);
+        }
+    }
+    bulk_settle(gf, &r);
+    return 1;
+}
+
+int gridfluid_set_simd(gridfluid_t gf, gridfluid_simd simd) {
+    if (simd == GF_SIMD_AUTO) {
+        simd = GF_SIMD_AVX512;
+        while (!simd_supported(simd))
+            simd--;
+    } else if (!simd_supported(simd)) {
+        return 0;
+    }
+    gf->simd = simd;
+    gf->collide = collide_kernel(simd, 0);
+    gf->collide_bulk = collide_kernel(simd, 1);
+    return 1;
+}
+
+gridfluid_simd gridfluid_get_simd(gridfluid_t gf) {
+    return( gf->simd );
+}
+
+// One plane moved by gridfluid_place: cells of elem bytes copied from
+// 'from' to 'to', or just zeroed at 'to' when from is NULL.
+typedef struct gridfluid_move {
+    const void *from;
+    void *to;
+    size_t elem;
+} gridfluid_move_t;
+
+typedef struct gridfluid_placement {
+    gridfluid_t gf;
+    gridfluid_move_t moves[5 + 2*GF_LATTICE_PLANES];
+    size_t nmoves;
+} gridfluid_placement_t;
+
+static void place_plane(gridfluid_placement_t *place, const void *from, void *to, size_t elem) {
+    gridfluid_move_t *move = &place->moves[place->nmoves++];
+    move->from = from;
+    move->to = to;
+    move->elem = elem;
+}
+
+static void place_lattice(gridfluid_placement_t *place, const gridfluid_lattice_t *from, void *block) {
+    gridfluid_lattice_t to;
+    lattice_bind(&to, block, place->gf->x * place->gf->y);
+    for (size_t i = 0; i<9; i++) {
+        place_plane(place, from ? from->df[i] : NULL, to.df[i], sizeof(gf_df_t));
+    }
+    place_plane(place, from ? from->mass : NULL, to.mass, sizeof(float));
+    place_plane(place, from ? from->fluid : NULL, to.fluid, sizeof(float));
+}
+
+static void gridfluid_place_band(void *ctx, size_t worker, size_t nworkers) {
+    gridfluid_placement_t *place = ctx;
+    gridfluid_t gf = place->gf;
+    // the rows gridfluid_band gives this worker, and any halo rows next
+    // to them
+    size_t rows = gf->row1 - gf->row0;
+    size_t c0 = GF_IDX(gf, 0, worker ? gf->row0 + rows * worker / nworkers : 0);
+    size_t c1 = GF_IDX(gf, 0, worker+1 < nworkers ? gf->row0 + rows * (worker+1) / nworkers : gf->y);
+    for (size_t k = 0; k < place->nmoves; k++) {
+        const gridfluid_move_t *move = &place->moves[k];
+        char *to = (char *)move->to + c0*move->elem;
+        if (move->from)
+            memcpy(to, (const char *)move->from + c0*move->elem, (c1-c0)*move->elem);
+        else
+            memset(to, 0, (c1-c0)*move->elem);
+    }
+}
+
+// Moves the scene to a fresh arena, each worker of pool writing its own
+// band's rows first so the kernel puts those pages on the worker's node.
+// Without a pool the calling thread moves all of it. nextgrid is only
+// touched, its contents are dead between steps, and not at all in in-place
+// mode.
+static int gridfluid_place(gridfluid_t gf, gfpool_t pool) {
+    size_t n = gf->x * gf->y;
+    gridfluid_storage_t st;
+    if (!storage_alloc(&st, n))
+        return 0;
+    gridfluid_placement_t place;
+    place.gf = gf;
+    place.nmoves = 0;
+    place_plane(&place, gf->flags, st.flags, sizeof(uint8_t));
+    place_plane(&place, gf->nmask, st.nmask, sizeof(uint32_t));
+    place_plane(&place, gf->changeflags, st.changeflags, sizeof(uint8_t));
+    place_plane(&place, gf->props->pressure, st.pressure, sizeof(float));
+    place_plane(&place, gf->props->mass, st.mass, sizeof(float));
+    place_lattice(&place, &gf->grid, st.lattice[0]);
+    if (!gf->inplace)
+        place_lattice(&place, NULL, st.lattice[1]);
+    if (pool)
+        gfpool_run(pool, gridfluid_place_band, &place);
+    else
+        gridfluid_place_band(&place, 0, 1);
+    storage_free(gf);
+    storage_bind(gf, &st);
+    gf->placed = pool ? gfpool_size(pool) : 1;
+    // nextgrid no longer holds the sleeping tiles
+    gf->sleep_wake = 1;
+    return 1;
+}
+
+int gridfluid_set_threads(gridfluid_t gf, size_t n) {
+    if (n == 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        n = online > 0 ? online : 1;
+    }
+    if (n > gf->row1 - gf->row0)
+        n = gf->row1 - gf->row0;
+    gridfluid_band_t *bands = calloc(n, sizeof(gridfluid_band_t));
+    if (!bands)
+        return 0;
+    gfpool_t pool = NULL;
+    if (n > 1) {
+        pool = gfpool_create(n);
+        if (!pool) {
+            free(bands);
+            return 0;
+        }
+        n = gfpool_size(pool);
+        if (n != gf->placed && !gridfluid_place(gf, pool)) {
+            gfpool_free(pool);
+            free(bands);
+            return 0;
+        }
+    }
+    gfpool_free(gf->pool);
+    for (size_t i = 0; i < gf->nbands; i++) {
+        list_free(&gf->bands[i].changed);
+        band_free_rows(&gf->bands[i]);
+    }
+    free(gf->bands);
+    gf->pool = pool;
+    gf->bands = bands;
+    gf->nbands = n;
+    return 1;
+}
+
+size_t gridfluid_get_threads(gridfluid_t gf) {
+    return( gf->nbands );
+}
+
+void gridfluid_set_fused(gridfluid_t gf, int fused) {
+    gf->fused = fused;
+}
+
+void gridfluid_set_inplace(gridfluid_t gf, int inplace) {
+    size_t n = gf->x * gf->y;
+    gf->inplace = inplace != 0;
+    gf->sleep_wake = 1;
+    if (!gf->inplace)
+        return;
+    if (gf->nextgrid.mapped) {
+        lattice_free(&gf->nextgrid);
+        lattice_bind(&gf->nextgrid, lattice_spare(gf), n);
+        gf->nextgrid.mapped = 0;
+    }
+    // nextgrid holds nothing between steps, so its pages can go
+    gfarena_discard(gf->arena, gf->nextgrid.df[0], GF_LATTICE_BYTES(n));
+}
+
+void gridfluid_set_tiling(gridfluid_t gf, size_t tile_x, size_t tile_y) {
+    gf->tile_x = tile_x;
+    gf->tile_y = tile_y ? tile_y : 1;
+}
+
+void gridfluid_set_gravity(gridfluid_t gf, float g) {
+    gf->gravity = g;
+    gf->props->gravity = g;
+    gf->props_dirty = 1;
+    gf->sleep_wake = 1;
+}
+
+void gridfluid_set_omega(gridfluid_t gf, float omega) {
+    gf->omega = omega;
+    gf->sleep_wake = 1;
+}
+
+int gridfluid_set_boundary(gridfluid_t gf, gridfluid_side side, gridfluid_boundary type) {
+    if (side > GF_SIDE_BOTTOM || type > GF_BOUNDARY_OPEN)
+        return 0;
+    // a strip's rows wrap round to another process's
+    if (type == GF_BOUNDARY_PERIODIC && side >= GF_SIDE_TOP && (gf->row0 != 1 || gf->row1 + 1 != gf->y))
+        return 0;
+    // sides pair up as left/right and top/bottom
+    gridfluid_side opposite = side ^ 1;
+    if (type == GF_BOUNDARY_PERIODIC)
+        gf->boundary[opposite] = GF_BOUNDARY_PERIODIC;
+    else if (gf->boundary[opposite] == GF_BOUNDARY_PERIODIC)
+        gf->boundary[opposite] = GF_BOUNDARY_WALL;
+    gf->boundary[side] = type;
+    ghost_build(gf);
+    gf->sleep_wake = 1;
+    gf->props_dirty = 1;
+    return 1;
+}
+
+gridfluid_boundary gridfluid_get_boundary(gridfluid_t gf, gridfluid_side side) {
+    return( gf->boundary[side] );
+}
+
+const char *gridfluid_df_format(void) {
+#if defined(GF_DF_FP16)
+    return( "fp16" );
+#elif defined(GF_DF_BF16)
+    return( "bf16" );
+#else
+    return( "fp32" );
+#endif
+}
+
+uint64_t gridfluid_get_step(gridfluid_t gf) {
+    return( gf->step );
+}
+
+uint8_t gridfluid_get_type(gridfluid_t gf, size_t x, size_t y) {
+    return( gf->flags[GF_IDX(gf,x,y)] );
+}
+
+static void gridfluid_properties_band(void *ctx, size_t worker, size_t nworkers) {
+    gridfluid_t gf = ctx;
+    gridfluid_band_t *band = gridfluid_band(gf, worker, nworkers);
+    float pressure=0;
+    float ux=0;
+    float uy=0;
     float max_pressure = 0;
     float min_pressure = INFINITY;
     float max_usqr = 0;
-    for (size_t i=0; i < gf->x * gf->y; i++) {
-        gridfluid_cell_t *cell = &gf->grid[i];
-        if (cell->flags != GF_FLUID && cell->flags != GF_INTERFACE) {
-            continue;
+    float df[9];
+    // the ghost cells are not part of the scene
+    for (size_t y = band->y0; y < band->y1; y++) {
+        for (size_t i=GF_IDX(gf,1,y); i < GF_IDX(gf,gf->x-1,y); i++) {
+            if (gf->flags[i] != GF_FLUID && gf->flags[i] != GF_INTERFACE) {
+                continue;
+            }
+            load_df(&gf->grid, i, df);
+            gridfluid_cell_macro(df, &pressure, &ux, &uy);
+            float usqr = ux*ux + uy*uy;
+            gf->props->pressure[i] = pressure;
+            gf->props->mass[i] = gf->grid.mass[i];
+            if (pressure > max_pressure)
+                max_pressure = pressure;
+            if (pressure < min_pressure)
+                min_pressure = pressure;
+            if (usqr > max_usqr)
+                max_usqr = usqr;
         }
-        gridfluid_cell_macro(cell->df, &pressure, &ux, &uy);
-        float usqr = ux*ux + uy*uy;
-        gf->props->pressure[i] = pressure;
-        gf->props->mass[i] = cell->mass;
-        if (pressure > max_pressure)
-            max_pressure = pressure;
-        if (pressure < min_pressure)
-            min_pressure = pressure;
-        if (usqr > max_usqr)
-            max_usqr = usqr;
+    }
+    band->max_pressure = max_pressure;
+    band->min_pressure = min_pressure;
+    band->max_usqr = max_usqr;
+}
+
+// The sweep gathers the diagnostics as it collides, so after a step this is
+// free. Only when the scene has been edited since (or never stepped) are
+// they recomputed from the lattice, with the same definitions: pressure is
+// the cell density, velocity that of its distributions without the gravity
+// forcing the collide adds.
+gridfluid_properties_t *gridfluid_get_properties(gridfluid_t gf) {
+    float max_pressure = 0;
+    float min_pressure = INFINITY;
+    float max_usqr = 0;
+    uint64_t start = gf->tracing ? trace_clock() : 0;
+    if (!gf->props_dirty) {
+        if (gf->tracing)
+            emit_phase(gf, GF_PHASE_PROPERTIES, start);
+        return( gf->props );
+    }
+    gridfluid_run(gf, gridfluid_properties_band);
+    for (size_t i = 0; i < gf->nbands; i++) {
+        gridfluid_band_t *band = &gf->bands[i];
+        if (band->max_pressure > max_pressure)
+            max_pressure = band->max_pressure;
+        if (band->min_pressure < min_pressure)
+            min_pressure = band->min_pressure;
+        if (band->max_usqr > max_usqr)
+            max_usqr = band->max_usqr;
     }
     gf->props->min_pressure = min_pressure;
     gf->props->max_pressure = max_pressure;
     gf->props->max_velocity = sqrtf(max_usqr);
+    gf->props_dirty = 0;
+    if (gf->tracing)
+        emit_phase(gf, GF_PHASE_PROPERTIES, start);
     return( gf->props );
 }
 
 void gridfluid_debug(gridfluid_t gf) {
     gf->props->total_mass = 0;
-    for (size_t x = 0; x < gf->x; x++) {
-        for (size_t y = 0; y < gf->y; y++) {
-            gf->props->total_mass += GF_CELL(gf,x,y).mass;
+    // ghost cells repeat other cells' mass
+    for (size_t y = gf->row0; y < gf->row1; y++) {
+        for (size_t x = 1; x + 1 < gf->x; x++) {
+            gf->props->total_mass += gf->grid.mass[GF_IDX(gf,x,y)];
         }
     }
     printf("total mass: %f           \n", gf->props->total_mass);
@@ -547,11 +2890,491 @@ void gridfluid_debug(gridfluid_t gf) {
 
 void gridfluid_step(gridfluid_t gf) {
     gf->props->total_mass = 0;
-    gridfluid_stream(gf);
-    gridfluid_cell_t *tmp = gf->grid;
-    gf->grid = gf->nextgrid;
-    gf->nextgrid = tmp;
-    gridfluid_collide(gf);
-    gridfluid_cleanup(gf);
-    printf("lol");
+    gf->step++;
+    if (gf->halo)
+        partition_exchange(gf);
+    ghost_fill(gf);
+    // an edit may have touched any tile
+    if (gf->sleep_steps && gf->sleep_wake)
+        sleep_wake_all(gf);
+    gridfluid_stream_collide(gf);
+    // the sweep only wrote the interior
+    ghost_fill(gf);
+    if (!gf->tracing) {
+        gridfluid_cleanup(gf);
+    } else {
+        uint64_t start = trace_clock();
+        gridfluid_cleanup(gf);
+        emit_phase(gf, GF_PHASE_CLEANUP, start);
+    }
+    if (gf->sleep_steps)
+        sleep_update(gf);
+}
+
+void gridfluid_set_event_callback(gridfluid_t gf, gridfluid_event_cb cb, void *user) {
+    gf->event_cb = cb;
+    gf->event_user = user;
+    gf->tracing = gf->event_cb || gf->events;
+}
+
+int gridfluid_set_event_ring(gridfluid_t gf, size_t capacity) {
+    gfring_t ring = NULL;
+    if (capacity) {
+        ring = gfring_create(sizeof(gridfluid_event_t), capacity);
+        if (!ring)
+            return 0;
+    }
+    gfring_free(gf->events);
+    gf->events = ring;
+    gf->dropped_events = 0;
+    gf->tracing = gf->event_cb || gf->events;
+    return 1;
+}
+
+size_t gridfluid_drain_events(gridfluid_t gf, gridfluid_event_t *events, size_t max) {
+    size_t n = 0;
+    if (!gf->events)
+        return 0;
+    while (n < max && gfring_pop(gf->events, &events[n]))
+        n++;
+    return( n );
+}
+
+size_t gridfluid_dropped_events(gridfluid_t gf) {
+    return( gf->dropped_events );
+}
+
+// Scenes of an ensemble in the order they step: grouped by shape, then cut
+// into one contiguous batch per worker holding about the same number of
+// cells. Scenes of the same shape run back to back on one worker through
+// the same kernels and scratch sizes, instead of interleaving with other
+// shapes across workers.
+struct gridfluid_ensemble {
+    gfpool_t pool;
+    size_t nworkers;
+    gridfluid_t *scenes;
+    size_t len;
+    size_t cap;
+    // scene indices in stepping order, and where each worker's batch starts
+    // in it; batch[nworkers] == len
+    size_t *order;
+    size_t *batch;
+    // scenes were added since order was built
+    int dirty;
+    // per stepping slot: the batches changed, so the worker moves that
+    // scene on its next step
+    uint8_t *rehome;
+    size_t steps;
+};
+
+gridfluid_ensemble_t gridfluid_ensemble_create(size_t threads) {
+    if (threads == 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = online > 0 ? online : 1;
+    }
+    gridfluid_ensemble_t ens = calloc(1, sizeof(struct gridfluid_ensemble));
+    if (!ens)
+        return NULL;
+    if (threads > 1) {
+        ens->pool = gfpool_create(threads);
+        if (!ens->pool) {
+            free(ens);
+            return NULL;
+        }
+        threads = gfpool_size(ens->pool);
+    }
+    ens->nworkers = threads;
+    ens->batch = calloc(threads+1, sizeof(size_t));
+    if (!ens->batch) {
+        gfpool_free(ens->pool);
+        free(ens);
+        return NULL;
+    }
+    return(ens);
+}
+
+void gridfluid_ensemble_free(gridfluid_ensemble_t ens) {
+    if (!ens)
+        return;
+    gfpool_free(ens->pool);
+    for (size_t i = 0; i < ens->len; i++) {
+        gridfluid_free(ens->scenes[i]);
+    }
+    free(ens->scenes);
+    free(ens->order);
+    free(ens->rehome);
+    free(ens->batch);
+    free(ens);
+}
+
+int gridfluid_ensemble_add(gridfluid_ensemble_t ens, gridfluid_t gf) {
+    // the ensemble's workers are the parallelism; a scene's own pool
+    // would only compete with them
+    if (!gridfluid_set_threads(gf, 1))
+        return 0;
+    if (ens->len == ens->cap) {
+        // a failed grow keeps what did grow, but cap only counts once all
+        // of them have
+        size_t cap = ens->cap ? ens->cap*2 : 64;
+        gridfluid_t *scenes = realloc(ens->scenes, cap*sizeof(gridfluid_t));
+        if (!scenes)
+            return 0;
+        ens->scenes = scenes;
+        size_t *order = realloc(ens->order, cap*sizeof(size_t));
+        if (!order)
+            return 0;
+        ens->order = order;
+        uint8_t *rehome = realloc(ens->rehome, cap*sizeof(uint8_t));
+        if (!rehome)
+            return 0;
+        ens->rehome = rehome;
+        ens->cap = cap;
+    }
+    ens->scenes[ens->len++] = gf;
+    ens->dirty = 1;
+    return 1;
+}
+
+size_t gridfluid_ensemble_size(gridfluid_ensemble_t ens) {
+    return( ens->len );
+}
+
+gridfluid_t gridfluid_ensemble_scene(gridfluid_ensemble_t ens, size_t i) {
+    return( ens->scenes[i] );
+}
+
+typedef struct gridfluid_shape_key {
+    size_t x;
+    size_t y;
+    size_t index;
+} gridfluid_shape_key_t;
+
+static int cmp_shape(const void *a, const void *b) {
+    const gridfluid_shape_key_t *ka = a;
+    const gridfluid_shape_key_t *kb = b;
+    if (ka->x != kb->x)
+        return ka->x < kb->x ? -1 : 1;
+    if (ka->y != kb->y)
+        return ka->y < kb->y ? -1 : 1;
+    return( (ka->index > kb->index) - (ka->index < kb->index) );
+}
+
+static void ensemble_batch(gridfluid_ensemble_t ens) {
+    ens->dirty = 0;
+    // no scenes, so every batch stays empty
+    if (ens->len == 0)
+        return;
+    gridfluid_shape_key_t *keys = malloc(ens->len*sizeof(gridfluid_shape_key_t));
+    if (!keys)
+        abort();
+    size_t total = 0;
+    for (size_t i = 0; i < ens->len; i++) {
+        keys[i].x = ens->scenes[i]->x;
+        keys[i].y = ens->scenes[i]->y;
+        keys[i].index = i;
+        total += keys[i].x * keys[i].y;
+    }
+    qsort(keys, ens->len, sizeof(gridfluid_shape_key_t), cmp_shape);
+    for (size_t i = 0; i < ens->len; i++) {
+        ens->order[i] = keys[i].index;
+    }
+    free(keys);
+    // worker w takes scenes until its batch reaches its share of the cells
+    size_t k = 0;
+    size_t cells = 0;
+    for (size_t w = 0; w < ens->nworkers; w++) {
+        ens->batch[w] = k;
+        size_t share = total * (w+1) / ens->nworkers;
+        while (k < ens->len && cells < share) {
+            gridfluid_t gf = ens->scenes[ens->order[k++]];
+            cells += gf->x * gf->y;
+        }
+    }
+    ens->batch[ens->nworkers] = ens->len;
+    memset(ens->rehome, ens->nworkers > 1, ens->len);
+}
+
+static void gridfluid_ensemble_band(void *ctx, size_t worker, size_t nworkers) {
+    gridfluid_ensemble_t ens = ctx;
+    for (size_t k = ens->batch[worker]; k < ens->batch[worker+1]; k++) {
+        gridfluid_t gf = ens->scenes[ens->order[k]];
+        // one try per rebatch: the flag is cleared whether or not the move
+        // succeeds, so a failed one leaves the scene where it was instead
+        // of being retried on every step
+        if (ens->rehome[k]) {
+            ens->rehome[k] = 0;
+            gridfluid_place(gf, NULL);
+        }
+        // all steps of one scene at once, while it is in this core's cache
+        for (size_t s = 0; s < ens->steps; s++) {
+            gridfluid_step(gf);
+        }
+    }
+}
+
+void gridfluid_ensemble_step(gridfluid_ensemble_t ens, size_t steps) {
+    if (ens->dirty)
+        ensemble_batch(ens);
+    ens->steps = steps;
+    if (ens->pool)
+        gfpool_run(ens->pool, gridfluid_ensemble_band, ens);
+    else
+        gridfluid_ensemble_band(ens, 0, 1);
+}
+
+// Checkpoint layout, all sections page aligned:
+//     0                header, padded to GF_FILE_ALIGN
+//     lattice_offset   the GF_LATTICE_PLANES planes of the current lattice,
+//                      df planes in the build's storage format (df_format),
+//                      spaced GF_PLANE_BYTES apart as in memory
+//     flags_offset     one state byte per cell
+// Values are stored in native byte order; byte_order tells a foreign file
+// apart. The second lattice, masks and lists are derived, so not saved.
+// Version 1 files packed the planes back to back; they are refused.
+#define GF_FILE_MAGIC "GFLUID\r\n"
+#define GF_FILE_VERSION 2
+#define GF_FILE_ALIGN 4096
+#define GF_FILE_BYTE_ORDER 0x01020304u
+
+typedef struct gridfluid_file_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint64_t x;
+    uint64_t y;
+    uint64_t step;
+    uint64_t lattice_offset;
+    uint64_t flags_offset;
+    uint32_t planes;
+    float gravity;
+    float atmosphere;
+    float omega;
+    uint32_t df_format;
+    // gridfluid_boundary per gridfluid_side
+    uint8_t boundary[4];
+} gridfluid_file_header_t;
+
+// df_format values
+enum { GF_FILE_DF_FP32, GF_FILE_DF_FP16, GF_FILE_DF_BF16 };
+#if defined(GF_DF_FP16)
+#define GF_FILE_DF GF_FILE_DF_FP16
+#elif defined(GF_DF_BF16)
+#define GF_FILE_DF GF_FILE_DF_BF16
+#else
+#define GF_FILE_DF GF_FILE_DF_FP32
+#endif
+
+static uint64_t file_align(uint64_t n) {
+    return( (n + GF_FILE_ALIGN - 1) / GF_FILE_ALIGN * GF_FILE_ALIGN );
+}
+
+static int write_at(int fd, const void *buf, size_t len, off_t off) {
+    const char *p = buf;
+    while (len) {
+        ssize_t n = pwrite(fd, p, len, off);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return 0;
+        }
+        p += n;
+        off += n;
+        len -= n;
+    }
+    return 1;
+}
+
+static int read_at(int fd, void *buf, size_t len, off_t off) {
+    char *p = buf;
+    while (len) {
+        ssize_t n = pread(fd, p, len, off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            if (n == 0)
+                errno = EINVAL;
+            return 0;
+        }
+        p += n;
+        off += n;
+        len -= n;
+    }
+    return 1;
+}
+
+// Periodic sides come in opposite pairs, as gridfluid_set_boundary sets them.
+static int file_boundary_ok(const uint8_t *boundary) {
+    for (size_t i = 0; i < 4; i++) {
+        if (boundary[i] > GF_BOUNDARY_OPEN)
+            return 0;
+        if ((boundary[i] == GF_BOUNDARY_PERIODIC) != (boundary[i^1] == GF_BOUNDARY_PERIODIC))
+            return 0;
+    }
+    return 1;
+}
+
+// Makes the rename of a file in the directory of path durable.
+static int sync_dir(const char *path) {
+    const char *slash = strrchr(path, '/');
+    char *dir = slash ? strndup(path, slash == path ? 1 : slash - path) : strdup(".");
+    if (!dir)
+        return 0;
+    int fd = open(dir, O_RDONLY | O_DIRECTORY);
+    free(dir);
+    if (fd < 0)
+        return 0;
+    int ok = !fsync(fd);
+    int err = errno;
+    close(fd);
+    errno = err;
+    return ok;
+}
+
+// The file is written next to path, synced to disk and renamed over it, so
+// a checkpoint interrupted part way, even by a power loss, leaves the
+// previous one intact.
+int gridfluid_save(gridfluid_t gf, const char *path) {
+    size_t n = gf->x * gf->y;
+    size_t lattice_bytes = GF_LATTICE_BYTES(n);
+    char header[GF_FILE_ALIGN];
+    gridfluid_file_header_t h;
+    // the file has no room for the strip, and would load as a scene of its
+    // own
+    if (gf->halo) {
+        errno = EINVAL;
+        return 0;
+    }
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, GF_FILE_MAGIC, sizeof(h.magic));
+    h.version = GF_FILE_VERSION;
+    h.byte_order = GF_FILE_BYTE_ORDER;
+    h.x = gf->x;
+    h.y = gf->y;
+    h.step = gf->step;
+    h.lattice_offset = GF_FILE_ALIGN;
+    h.flags_offset = file_align(h.lattice_offset + lattice_bytes);
+    h.planes = GF_LATTICE_PLANES;
+    h.gravity = gf->gravity;
+    h.atmosphere = gf->atmosphere;
+    h.omega = gf->omega;
+    h.df_format = GF_FILE_DF;
+    for (size_t i = 0; i < 4; i++) {
+        h.boundary[i] = gf->boundary[i];
+    }
+    memset(header, 0, sizeof(header));
+    memcpy(header, &h, sizeof(h));
+
+    size_t len = strlen(path);
+    char *tmp = malloc(len + 5);
+    if (!tmp)
+        return 0;
+    memcpy(tmp, path, len);
+    memcpy(tmp + len, ".tmp", 5);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        free(tmp);
+        return 0;
+    }
+    int ok = write_at(fd, header, sizeof(header), 0)
+        && write_at(fd, gf->grid.df[0], lattice_bytes, h.lattice_offset)
+        && write_at(fd, gf->flags, n, h.flags_offset)
+        && !fsync(fd);
+    int err = errno;
+    if (close(fd) && ok) {
+        ok = 0;
+        err = errno;
+    }
+    if (ok && rename(tmp, path)) {
+        ok = 0;
+        err = errno;
+    }
+    // the new file is in place either way; only its durability is unknown
+    if (ok && !sync_dir(path)) {
+        free(tmp);
+        return 0;
+    }
+    if (!ok)
+        unlink(tmp);
+    free(tmp);
+    errno = err;
+    return ok;
+}
+
+// The lattice is mapped copy-on-write straight from the file, so loading
+// costs a header and flags read however large the grid is, and pages come
+// in as the first step touches them. Returns NULL with errno set if the
+// file cannot be read or is not a checkpoint this build understands.
+gridfluid_t gridfluid_load(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    gridfluid_file_header_t h;
+    struct stat st;
+    if (!read_at(fd, &h, sizeof(h), 0) || fstat(fd, &st)) {
+        close(fd);
+        return NULL;
+    }
+    size_t n = h.x * h.y;
+    size_t lattice_bytes = GF_LATTICE_BYTES(n);
+    if (memcmp(h.magic, GF_FILE_MAGIC, sizeof(h.magic))
+        || h.version != GF_FILE_VERSION
+        || h.byte_order != GF_FILE_BYTE_ORDER || h.planes != GF_LATTICE_PLANES
+        || h.df_format != GF_FILE_DF
+        || !file_boundary_ok(h.boundary)
+        || h.x < 3 || h.y < 3 || n / h.x != h.y
+        || h.lattice_offset % GF_FILE_ALIGN || h.flags_offset < h.lattice_offset + lattice_bytes
+        || (uint64_t)st.st_size < h.flags_offset + n) {
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    gridfluid_t gf = gridfluid_create_empty_scene(h.x, h.y);
+    gf->step = h.step;
+    gridfluid_set_gravity(gf, h.gravity);
+    gf->atmosphere = h.atmosphere;
+    gridfluid_set_omega(gf, h.omega);
+    if (!read_at(fd, gf->flags, n, h.flags_offset)) {
+        int err = errno;
+        close(fd);
+        gridfluid_free(gf);
+        errno = err;
+        return NULL;
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (gf->flags[i] > GF_INTERFACE) {
+            close(fd);
+            gridfluid_free(gf);
+            errno = EINVAL;
+            return NULL;
+        }
+    }
+    // mmap needs a page-aligned offset; on systems with pages larger than
+    // the file's alignment the lattice is read instead
+    void *planes = MAP_FAILED;
+    if (h.lattice_offset % sysconf(_SC_PAGESIZE) == 0)
+        planes = mmap(NULL, lattice_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, h.lattice_offset);
+    int ok = 1;
+    if (planes != MAP_FAILED) {
+        lattice_bind(&gf->grid, planes, n);
+        gf->grid.mapped = lattice_bytes;
+    } else {
+        ok = read_at(fd, gf->grid.df[0], lattice_bytes, h.lattice_offset);
+    }
+    if (!ok) {
+        int err = errno;
+        close(fd);
+        gridfluid_free(gf);
+        errno = err;
+        return NULL;
+    }
+    close(fd);
+    nmask_rebuild(gf);
+    for (size_t i = 0; i < 4; i++) {
+        gf->boundary[i] = h.boundary[i];
+    }
+    ghost_build(gf);
+    gf->sleep_wake = 1;
+    gf->props_dirty = 1;
+    return gf;
 }
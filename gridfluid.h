@@ -13,8 +13,66 @@ typedef enum e_gridfluid_state {
     GF_INTERFACE
 } gridfluid_state;
 
+// Instruction sets the collision kernel can be dispatched to. GF_SIMD_AUTO
+// picks the widest one the running CPU supports; all of them produce
+// bit-identical results.
+typedef enum e_gridfluid_simd {
+    GF_SIMD_AUTO,
+    GF_SIMD_SCALAR,
+    GF_SIMD_SSE2,
+    GF_SIMD_AVX2,
+    GF_SIMD_AVX512
+} gridfluid_simd;
+
+// Sides of the grid; y grows downwards, the way gravity pulls.
+typedef enum e_gridfluid_side {
+    GF_SIDE_LEFT,
+    GF_SIDE_RIGHT,
+    GF_SIDE_TOP,
+    GF_SIDE_BOTTOM
+} gridfluid_side;
+
+typedef enum e_gridfluid_boundary {
+    GF_BOUNDARY_WALL,
+    GF_BOUNDARY_PERIODIC,
+    GF_BOUNDARY_OPEN
+} gridfluid_boundary;
+
 typedef struct gridfluid *gridfluid_t;
+typedef struct gridfluid_ensemble *gridfluid_ensemble_t;
+
+typedef enum e_gridfluid_event_type {
+    GF_EVENT_FILLED,
+    GF_EVENT_EMPTIED,
+    GF_EVENT_PHASE
+} gridfluid_event_type;
 
+typedef enum e_gridfluid_phase {
+    GF_PHASE_STREAM_COLLIDE,
+    GF_PHASE_CLEANUP,
+    GF_PHASE_PROPERTIES,
+    // only reported when the sweep is unfused
+    GF_PHASE_STREAM,
+    GF_PHASE_COLLIDE
+} gridfluid_phase;
+
+// An interface cell filling or emptying (x, y), or the wall-clock time one
+// phase of the solver took (phase, nanoseconds). step is the number of
+// gridfluid_step calls made so far.
+typedef struct gridfluid_event {
+    gridfluid_event_type type;
+    uint64_t step;
+    size_t x;
+    size_t y;
+    gridfluid_phase phase;
+    uint64_t nanoseconds;
+} gridfluid_event_t;
+
+typedef void (*gridfluid_event_cb)(const gridfluid_event_t *event, void *user);
+
+// Pressure is a cell's density, and max_velocity the largest speed of the
+// fluid and interface cells' distributions, without the gravity forcing.
+// After a step they are as the step's collide saw them.
 typedef struct gridfluid_properties {
     size_t x;
     size_t y;
@@ -31,16 +89,140 @@ gridfluid_t gridfluid_create_empty_scene(size_t x, size_t y);
 
 void gridfluid_free(gridfluid_t gf);
 
-void gridfluid_set_obstacle(gridfluid_t gf, size_t x, size_t y);
-void gridfluid_set_fluid(gridfluid_t gf, size_t x, size_t y);
-void gridfluid_set_empty(gridfluid_t gf, size_t x, size_t y);
+// Partitioned mode: nranks processes on one node step an x by y domain
+// together, each owning a strip of about y/nranks rows (at least 4).
+// Process rank gets a scene holding its strip plus the two rows on either
+// side of it, which it keeps in sync with its neighbours' through the POSIX
+// shared memory object name (see gfhalo.h). All of them must call
+// gridfluid_step equally often; each step waits on the neighbours, and
+// the lattice comes out as if the domain were one scene. Returns NULL with
+// errno set on failure.
+gridfluid_t gridfluid_create_partition(size_t x, size_t y, const char *name, size_t rank, size_t nranks);
+// Row r of a partition's scene is row origin + r of the domain; it steps
+// rows [y0, y1). Build the scene by making the domain's edits that fall on
+// any row it holds, in the same order; the step overwrites the rows outside
+// [y0, y1) from the neighbours. Properties and events cover its own rows.
+// A partition's scene cannot be checkpointed: gridfluid_save fails on it
+// with EINVAL.
+void gridfluid_get_partition(gridfluid_t gf, size_t *origin, size_t *y0, size_t *y1);
+
+// The outer ring of cells is a ghost layer standing in for what lies past
+// each side. It is never stepped, and the properties leave it out.
+// Each setter returns 1, or 0 without changing anything if (x, y) is on
+// the ghost ring, whose cells follow the boundaries instead.
+int gridfluid_set_obstacle(gridfluid_t gf, size_t x, size_t y);
+int gridfluid_set_fluid(gridfluid_t gf, size_t x, size_t y);
+int gridfluid_set_empty(gridfluid_t gf, size_t x, size_t y);
+// Bulk edits of the w by h block at (x, y), clipped to the cells the setters
+// reach. They write the block whole and then classify it and the ring round
+// it in one pass, so filling a scene costs a few passes over memory instead
+// of a neighbour update per cell. The result is that of the setters called
+// cell by cell, except that any empty cell left next to fluid becomes an
+// interface cell, and that a cell made an obstacle keeps its own lattice,
+// not that of the interface cell a neighbour's gridfluid_set_fluid may have
+// made it first. gridfluid_fill_rect sets every cell to state, and returns
+// 0 if that is GF_INTERFACE, which the edits derive themselves.
+int gridfluid_fill_rect(gridfluid_t gf, size_t x, size_t y, size_t w, size_t h, gridfluid_state state);
+// Sets each cell of the block from mask, w bytes a row: GF_OBSTACLE,
+// GF_EMPTY, GF_FLUID, or GF_MASK_KEEP to leave the cell as it is. Returns 0,
+// changing nothing, if the mask holds any other value.
+#define GF_MASK_KEEP 0xff
+int gridfluid_apply_mask(gridfluid_t gf, size_t x, size_t y, size_t w, size_t h, const uint8_t *mask);
 void gridfluid_set_gravity(gridfluid_t gf, float g);
+// BGK relaxation rate of the collision, 0.5 by default; saved in checkpoints
+void gridfluid_set_omega(gridfluid_t gf, float omega);
+// What the ghost cells of a side hold. A wall (the default) is an obstacle.
+// A periodic side joins the opposite one, so it is always set on both: set
+// on one side it is set on the other too, and setting either to anything
+// else turns the other into a wall. An open side repeats the cells next to
+// it, so fluid flows out freely and the mass it carries leaves the scene.
+// Set boundaries before filling the scene: gridfluid_set_fluid next to a
+// periodic side turns the empty cells across it into interface cells.
+// Saved in checkpoints. Returns 0 for a periodic top or bottom of a
+// partition's strip, or for an unknown side or type.
+int gridfluid_set_boundary(gridfluid_t gf, gridfluid_side side, gridfluid_boundary type);
+gridfluid_boundary gridfluid_get_boundary(gridfluid_t gf, gridfluid_side side);
+// returns 0 and leaves the current kernel in place if the CPU lacks simd
+int gridfluid_set_simd(gridfluid_t gf, gridfluid_simd simd);
+gridfluid_simd gridfluid_get_simd(gridfluid_t gf);
+// Runs the step and property passes on n threads (0 = one per online CPU),
+// each owning a band of rows. Reductions are combined in band order, so a
+// scene evolves identically for a given thread count. A new thread count
+// moves the scene's storage so each thread's rows are first touched, and
+// so placed in memory, by that thread. Returns 0 on failure.
+int gridfluid_set_threads(gridfluid_t gf, size_t n);
+size_t gridfluid_get_threads(gridfluid_t gf);
+// Walks each band of the step in tile_x by tile_y blocks so a tile and its
+// one-cell halo stay cache resident on wide grids. tile_x == 0 (the default)
+// walks whole rows. Tiling does not change the lattice the step produces.
+void gridfluid_set_tiling(gridfluid_t gf, size_t tile_x, size_t tile_y);
+// With fused == 0 the step streams the whole lattice before colliding it,
+// as two timed phases. Same results, more memory traffic: for profiling.
+void gridfluid_set_fused(gridfluid_t gf, int fused);
+// With inplace != 0 the step streams the lattice onto itself instead of
+// into a second copy, whose pages are released; that nearly halves the
+// memory a scene takes. Each band keeps a few rows of scratch. Same results.
+void gridfluid_set_inplace(gridfluid_t gf, int inplace);
+// Lets the parts of the scene that have come to rest sleep. The scene is
+// cut into 32x32 tiles, and a tile none of whose cells changed density or
+// moved faster than threshold for steps steps in a row, and whose
+// neighbours did not either, is skipped by the step until something stirs
+// next to it or one of its cells fills, empties or takes mass. A sleeping
+// tile is frozen as it was, which is exact for a tile truly at rest and
+// otherwise off by about threshold, so results differ from those of a scene
+// that never sleeps. steps == 0 or threshold <= 0 (the default) keeps every
+// tile awake. Edits, gravity, omega and storage changes wake every tile.
+// Not saved in checkpoints.
+void gridfluid_set_sleep(gridfluid_t gf, float threshold, unsigned steps);
+// number of cells the next step will sweep, every one unless tiles sleep
+size_t gridfluid_get_awake(gridfluid_t gf);
 uint8_t gridfluid_get_type(gridfluid_t gf, size_t x, size_t y);
+// number of gridfluid_step calls made so far, carried across save/load
+uint64_t gridfluid_get_step(gridfluid_t gf);
+// how this build stores distributions: "fp32", "fp16" or "bf16"
+const char *gridfluid_df_format(void);
 gridfluid_properties_t *gridfluid_get_properties(gridfluid_t gf);
 
 void gridfluid_step(gridfluid_t gf);
+
+// Events are only produced while a callback or a ring is attached; with
+// neither, tracing costs one branch per phase.
+// The callback runs synchronously on the thread calling the solver.
+void gridfluid_set_event_callback(gridfluid_t gf, gridfluid_event_cb cb, void *user);
+// Buffers events in a lock-free ring of the given capacity (0 detaches it)
+// that one other thread may drain while the solver runs. Events that do
+// not fit are dropped and counted rather than stalling the step.
+int gridfluid_set_event_ring(gridfluid_t gf, size_t capacity);
+size_t gridfluid_drain_events(gridfluid_t gf, gridfluid_event_t *events, size_t max);
+size_t gridfluid_dropped_events(gridfluid_t gf);
 void gridfluid_debug(gridfluid_t gf);
 
+// Checkpoints the scene to path. Returns 0 on failure, with errno set;
+// EINVAL for a partition's scene.
+int gridfluid_save(gridfluid_t gf, const char *path);
+// Restores a scene written by gridfluid_save, or returns NULL with errno
+// set, EINVAL for a file of another layout, build or byte order. The
+// lattice is mapped from the file rather than read.
+gridfluid_t gridfluid_load(const char *path);
+
+// An ensemble owns many independent scenes, each with its own parameters,
+// and steps them in parallel on n threads (0 = one per online CPU). Each
+// scene runs whole on one thread; scenes of the same shape are batched onto
+// the same thread, and a scene is moved to the thread stepping it the first
+// time it steps there. Results are those of stepping each scene alone.
+gridfluid_ensemble_t gridfluid_ensemble_create(size_t threads);
+// frees the scenes too
+void gridfluid_ensemble_free(gridfluid_ensemble_t ens);
+// Hands gf to the ensemble as scene number gridfluid_ensemble_size() - 1
+// and sets it to one thread. Returns 0 on failure, leaving gf to the caller.
+int gridfluid_ensemble_add(gridfluid_ensemble_t ens, gridfluid_t gf);
+size_t gridfluid_ensemble_size(gridfluid_ensemble_t ens);
+// Scenes may be read and edited between ensemble steps, but not given more
+// threads. Event callbacks run on the ensemble thread stepping the scene.
+gridfluid_t gridfluid_ensemble_scene(gridfluid_ensemble_t ens, size_t i);
+// advances every scene by steps steps
+void gridfluid_ensemble_step(gridfluid_ensemble_t ens, size_t steps);
+
 #pragma GCC visibility pop
 
 #endif
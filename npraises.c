@@ -1,10 +1,11 @@
 #include <npraises.h>
 #include <termios.h>
-#define _BSD_SOURCE
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
+#include <errno.h>
 #include <term.h>
 
 uint8_t rgb_f(float r, float g, float b) {
@@ -27,12 +28,147 @@ uint8_t gray_f(float v) {
     return( ansi );
 }
 
+// Escape sequences resolved from terminfo once, in setup_screen (or on
+// first use). Colours are looked up in tables; cursor moves are formatted
+// directly when the terminal uses the ANSI forms, which is every terminal
+// anyone runs this in, and through tiparm otherwise. The tables hold
+// copies of whatever length terminfo gives.
+static char *fg_seq[256];
+static char *bg_seq[256];
+static size_t fg_len[256];
+static size_t bg_len[256];
+static int ansi_cup;
+static int ansi_cuf;
+static int esc_ready;
+
+static char *esc_keep(char *old, const char *s, size_t *len) {
+    *len = s ? strlen(s) : 0;
+    char *copy = realloc(old, *len + 1);
+    if (!copy)
+        abort();
+    memcpy(copy, s ? s : "", *len + 1);
+    return( copy );
+}
+
+static void esc_setup() {
+    for (int c = 0; c < 256; c++) {
+        fg_seq[c] = esc_keep(fg_seq[c], tiparm(set_a_foreground, c), &fg_len[c]);
+        bg_seq[c] = esc_keep(bg_seq[c], tiparm(set_a_background, c), &bg_len[c]);
+    }
+    ansi_cup = cursor_address && !strcmp(cursor_address, "\033[%i%p1%d;%p2%dH");
+    ansi_cuf = parm_right_cursor && !strcmp(parm_right_cursor, "\033[%p1%dC");
+    esc_ready = 1;
+}
+
+static size_t fmt_uint(char *buf, unsigned v) {
+    char tmp[10];
+    size_t n = 0;
+    do {
+        tmp[n++] = '0' + v % 10;
+        v /= 10;
+    } while (v);
+    for (size_t i = 0; i < n; i++) {
+        buf[i] = tmp[n-1-i];
+    }
+    return( n );
+}
+
+// The sequences themselves, of any length. The cursor moves are formatted
+// into buf, of ESC_MAX bytes, in the ANSI forms, and are otherwise tiparm's
+// result, good until its next call.
+static const char *seq_fg(uint8_t c, size_t *len) {
+    if (!esc_ready)
+        esc_setup();
+    *len = fg_len[c];
+    return( fg_seq[c] );
+}
+
+static const char *seq_bg(uint8_t c, size_t *len) {
+    if (!esc_ready)
+        esc_setup();
+    *len = bg_len[c];
+    return( bg_seq[c] );
+}
+
+static const char *seq_curs_xy(char *buf, unsigned x, unsigned y, size_t *len) {
+    if (!esc_ready)
+        esc_setup();
+    if (!ansi_cup) {
+        const char *s = tiparm(cursor_address, (int)y, (int)x);
+        *len = s ? strlen(s) : 0;
+        return( s );
+    }
+    // cup counts from 1
+    size_t n = 0;
+    buf[n++] = '\033';
+    buf[n++] = '[';
+    n += fmt_uint(buf + n, y + 1);
+    buf[n++] = ';';
+    n += fmt_uint(buf + n, x + 1);
+    buf[n++] = 'H';
+    *len = n;
+    return( buf );
+}
+
+static const char *seq_right(char *buf, unsigned n, size_t *len) {
+    if (!esc_ready)
+        esc_setup();
+    if (!ansi_cuf) {
+        const char *s = parm_right_cursor ? tiparm(parm_right_cursor, (int)n) : NULL;
+        *len = s ? strlen(s) : 0;
+        return( s );
+    }
+    size_t l = 0;
+    buf[l++] = '\033';
+    buf[l++] = '[';
+    l += fmt_uint(buf + l, n);
+    buf[l++] = 'C';
+    *len = l;
+    return( buf );
+}
+
+// copies s into buf unless it is too long for it
+static size_t esc_copy(char *buf, const char *s, size_t len) {
+    if (len > ESC_MAX)
+        return( 0 );
+    memmove(buf, s, len);
+    return( len );
+}
+
+size_t esc_fg(char *buf, uint8_t c) {
+    size_t len;
+    const char *s = seq_fg(c, &len);
+    return( esc_copy(buf, s, len) );
+}
+
+size_t esc_bg(char *buf, uint8_t c) {
+    size_t len;
+    const char *s = seq_bg(c, &len);
+    return( esc_copy(buf, s, len) );
+}
+
+size_t esc_curs_xy(char *buf, unsigned x, unsigned y) {
+    size_t len;
+    const char *s = seq_curs_xy(buf, x, y, &len);
+    return( esc_copy(buf, s, len) );
+}
+
+size_t esc_right(char *buf, unsigned n) {
+    size_t len;
+    const char *s = seq_right(buf, n, &len);
+    return( esc_copy(buf, s, len) );
+}
+
 void set_fg(uint8_t c) {
-    putp(tiparm(set_a_foreground, c));
+    size_t len;
+    const char *s = seq_fg(c, &len);
+    fwrite(s, 1, len, stdout);
 }
 
 void set_bg(uint8_t c) {
-    putp(tiparm(set_a_background, c));
+    size_t len;
+    const char *s = seq_bg(c, &len);
+    fwrite(s, 1, len, stdout);
 }
 
 void clear() {
@@ -59,6 +195,7 @@ int setup_screen() {
         return 0;
     }
     setupterm( "xterm-256color", 1, (int*)0 );
+    esc_setup();
     putp(clear_screen);
     putp(enter_ca_mode);
     putp(orig_pair);
@@ -73,6 +210,150 @@ void cleanup_screen() {
     tcsetattr (0, TCSANOW, &term_settings);
 }
 
-void curs_xy(uint8_t x, uint8_t y) {
-    putp(tiparm(tigetstr("cup"), y, x));
+void curs_xy(unsigned x, unsigned y) {
+    char buf[ESC_MAX];
+    size_t len;
+    const char *s = seq_curs_xy(buf, x, y, &len);
+    fwrite(s, 1, len, stdout);
+}
+
+typedef struct {
+    char glyph[4];
+    uint8_t fg;
+    uint8_t bg;
+} frame_cell_t;
+
+struct frame {
+    size_t w;
+    size_t h;
+    frame_cell_t *cells;
+    // what the terminal shows; an empty glyph never matches a cell
+    frame_cell_t *shown;
+    char *out;
+    size_t len;
+    size_t cap;
+};
+
+frame_t frame_create(size_t w, size_t h) {
+    frame_t fb = calloc(1, sizeof(struct frame));
+    if (!fb)
+        return( NULL );
+    fb->w = w;
+    fb->h = h;
+    fb->cells = calloc(w*h, sizeof(frame_cell_t));
+    fb->shown = calloc(w*h, sizeof(frame_cell_t));
+    if (!fb->cells || !fb->shown) {
+        frame_free(fb);
+        return( NULL );
+    }
+    return( fb );
+}
+
+void frame_free(frame_t fb) {
+    if (!fb)
+        return;
+    free(fb->cells);
+    free(fb->shown);
+    free(fb->out);
+    free(fb);
+}
+
+void frame_put(frame_t fb, size_t x, size_t y, const char *glyph, uint8_t fg, uint8_t bg) {
+    if (x >= fb->w || y >= fb->h)
+        return;
+    frame_cell_t *cell = &fb->cells[x + y*fb->w];
+    size_t n = strnlen(glyph, sizeof(cell->glyph));
+    memset(cell->glyph, 0, sizeof(cell->glyph));
+    memcpy(cell->glyph, glyph, n);
+    cell->fg = fg;
+    cell->bg = bg;
+}
+
+void frame_invalidate(frame_t fb) {
+    memset(fb->shown, 0, fb->w * fb->h * sizeof(frame_cell_t));
+}
+
+static void frame_reserve(frame_t fb, size_t n) {
+    if (fb->len + n > fb->cap) {
+        size_t cap = fb->cap ? fb->cap : 4096;
+        while (cap < fb->len + n)
+            cap *= 2;
+        char *out = realloc(fb->out, cap);
+        if (!out)
+            abort();
+        fb->out = out;
+        fb->cap = cap;
+    }
+}
+
+static void frame_emit(frame_t fb, const char *s, size_t n) {
+    if (!n)
+        return;
+    frame_reserve(fb, n);
+    memcpy(fb->out + fb->len, s, n);
+    fb->len += n;
+}
+
+void frame_flush(frame_t fb) {
+    // the terminal state is unknown on entry: other output may have moved
+    // the cursor or changed colours since the last flush
+    size_t cx = SIZE_MAX;
+    size_t cy = SIZE_MAX;
+    int fg = -1;
+    int bg = -1;
+    fb->len = 0;
+    for (size_t y = 0; y < fb->h; y++) {
+        for (size_t x = 0; x < fb->w; x++) {
+            frame_cell_t *cell = &fb->cells[x + y*fb->w];
+            frame_cell_t *shown = &fb->shown[x + y*fb->w];
+            if (!memcmp(cell, shown, sizeof(frame_cell_t)))
+                continue;
+            const char *s;
+            size_t n = 0;
+            if (y != cy || x != cx) {
+                char move[ESC_MAX];
+                if (y == cy && x > cx)
+                    s = seq_right(move, x - cx, &n);
+                if (!n)
+                    s = seq_curs_xy(move, x, y, &n);
+                frame_emit(fb, s, n);
+            }
+            // a space only shows its background and a full block only its
+            // foreground, so the other colour is left as it is
+            int blank = !strncmp(cell->glyph, " ", sizeof(cell->glyph));
+            int solid = !strncmp(cell->glyph, "█", sizeof(cell->glyph));
+            if (!blank && cell->fg != fg) {
+                s = seq_fg(cell->fg, &n);
+                frame_emit(fb, s, n);
+                fg = cell->fg;
+            }
+            if (!solid && cell->bg != bg) {
+                s = seq_bg(cell->bg, &n);
+                frame_emit(fb, s, n);
+                bg = cell->bg;
+            }
+            frame_emit(fb, cell->glyph, strnlen(cell->glyph, sizeof(cell->glyph)));
+            *shown = *cell;
+            cx = x + 1;
+            cy = y;
+        }
+    }
+    if (!fb->len)
+        return;
+    // anything already queued through stdio has to reach the terminal first
+    fflush(stdout);
+    size_t off = 0;
+    while (off < fb->len) {
+        ssize_t n = write(1, fb->out + off, fb->len - off);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("write");
+            // shown already holds this frame, but the terminal may have got
+            // any part of it
+            frame_invalidate(fb);
+            return;
+        }
+        off += n;
+    }
 }
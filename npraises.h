@@ -1,9 +1,10 @@
 #ifndef NPRAISES_H_INCLUDED
 #define NPRAISES_H_INCLUDED
 
-#define _BSD_SOURCE
+#define _DEFAULT_SOURCE
 #include <unistd.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <term.h>
 
 #pragma GCC visibility push(default)
@@ -22,7 +23,40 @@ int setup_screen();
 
 void cleanup_screen();
 
-void curs_xy(uint8_t x, uint8_t y);
+void curs_xy(unsigned x, unsigned y);
+
+// The sequences behind set_fg, set_bg and curs_xy, written into a caller's
+// buffer of at least ESC_MAX bytes. They return the number of bytes
+// written, or 0 if the terminal's sequence is longer than ESC_MAX, which
+// set_fg, set_bg, curs_xy and frame_flush still send whole; esc_right
+// returns 0 too if the terminal has no relative move.
+#define ESC_MAX 32
+
+size_t esc_fg(char *buf, uint8_t c);
+
+size_t esc_bg(char *buf, uint8_t c);
+
+size_t esc_curs_xy(char *buf, unsigned x, unsigned y);
+
+size_t esc_right(char *buf, unsigned n);
+
+// A grid of character cells drawn at the top left of the screen. Cells are
+// set with frame_put; frame_flush sends only the cells that differ from
+// what the previous flush left on screen, in a single write. After a
+// failed write the next flush redraws everything.
+typedef struct frame *frame_t;
+
+frame_t frame_create(size_t w, size_t h);
+
+void frame_free(frame_t fb);
+
+// glyph is a single UTF-8 character
+void frame_put(frame_t fb, size_t x, size_t y, const char *glyph, uint8_t fg, uint8_t bg);
+
+// forgets what is on screen, so the next flush redraws every cell
+void frame_invalidate(frame_t fb);
+
+void frame_flush(frame_t fb);
 
 #pragma GCC visibility pop
 
@@ -1,127 +1,246 @@
+// Interactive demo. The solver runs on its own thread and publishes
+// snapshots of the scene through a triple buffer; this thread draws the
+// latest one at its own pace and sends the solver commands over a ring, so
+// neither a slow terminal nor the keyboard holds up the other side.
+//
+// space runs and pauses, s steps once, d shows the debug cursor and h / j /
+// k / l move it, q quits.
+
 #include "npraises.h"
 #include "gridfluid.h"
+#include "gfring.h"
+#include "gftriple.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <assert.h>
 #include <stdbool.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <time.h>
+
+typedef enum e_command {
+    CMD_STEP,
+    CMD_RUN,
+    CMD_QUIT
+} command_t;
+
+// What the view shows of the scene after one step; the arrays hold x*y
+// row-major cells.
+typedef struct snapshot {
+    uint64_t step;
+    float total_mass;
+    float min_pressure;
+    float max_pressure;
+    float max_velocity;
+    uint8_t *flags;
+    float *pressure;
+    float *mass;
+} snapshot_t;
+
+typedef struct sim {
+    gridfluid_t gf;
+    size_t x;
+    size_t y;
+    snapshot_t snaps[3];
+    gftriple_t view;
+    // commands from the view, with one post per command
+    gfring_t commands;
+    sem_t pending;
+} sim_t;
+
+static void snapshot_take(sim_t *sim) {
+    snapshot_t *snap = gftriple_back(sim->view);
+    gridfluid_properties_t *props = gridfluid_get_properties(sim->gf);
+    size_t n = sim->x * sim->y;
+    snap->step = gridfluid_get_step(sim->gf);
+    snap->total_mass = props->total_mass;
+    snap->min_pressure = props->min_pressure;
+    snap->max_pressure = props->max_pressure;
+    snap->max_velocity = props->max_velocity;
+    for (size_t y = 0; y < sim->y; y++) {
+        for (size_t x = 0; x < sim->x; x++) {
+            snap->flags[x + y*sim->x] = gridfluid_get_type(sim->gf, x, y);
+        }
+    }
+    memcpy(snap->pressure, props->pressure, n * sizeof(float));
+    memcpy(snap->mass, props->mass, n * sizeof(float));
+    gftriple_publish(sim->view);
+}
+
+// The solver thread. Running, it steps flat out and only takes a snapshot
+// once the view has taken the last one; paused, it sleeps until a command
+// comes in.
+static void *solve(void *arg) {
+    sim_t *sim = arg;
+    bool running = false;
+    bool quit = false;
+    uint64_t shown = gridfluid_get_step(sim->gf);
+    command_t cmd;
+    while (!quit) {
+        if (!running)
+            sem_wait(&sim->pending);
+        while (gfring_pop(sim->commands, &cmd)) {
+            switch (cmd) {
+                case CMD_STEP:
+                    gridfluid_step(sim->gf);
+                    break;
+                case CMD_RUN:
+                    running = !running;
+                    break;
+                case CMD_QUIT:
+                    quit = true;
+                    break;
+            }
+        }
+        if (running && !quit)
+            gridfluid_step(sim->gf);
+        if (gridfluid_get_step(sim->gf) != shown && (!running || !gftriple_unread(sim->view))) {
+            snapshot_take(sim);
+            shown = gridfluid_get_step(sim->gf);
+        }
+    }
+    return NULL;
+}
 
-void render(gridfluid_t gf) {
-    gridfluid_properties_t *props = gridfluid_get_properties(gf);
-    float maxp = props->max_pressure;
-    float minp = props->min_pressure;
+static void send(sim_t *sim, command_t cmd) {
+    // the solver drains the ring every step, so a full one empties soon
+    while (!gfring_push(sim->commands, &cmd))
+        sched_yield();
+    sem_post(&sim->pending);
+}
+
+void render(const snapshot_t *snap, size_t w, size_t h, frame_t fb) {
+    float maxp = snap->max_pressure;
+    float minp = snap->min_pressure;
     float pressure;
-    char *draw = " ";
-    set_bg(rgb_f(0,0,0));
-    for (int x=0; x < props->x; x++) {
-        for (int y=0; y < props->y; y++) {
-            curs_xy(x,y);
-            switch(gridfluid_get_type(gf,x,y)) {
+    uint8_t c;
+    for (size_t y=0; y < h; y++) {
+        for (size_t x=0; x < w; x++) {
+            switch(snap->flags[x + y*w]) {
                 case GF_OBSTACLE:
-                    set_fg(rgb_f(1,1,1));
-                    set_bg(rgb_f(1,1,1));
-                    draw = "█";
+                    frame_put(fb, x, y, "█", rgb_f(1,1,1), rgb_f(1,1,1));
                     break;
                 case GF_EMPTY:
-                    set_fg(rgb_f(0,0,0));
-                    set_bg(rgb_f(0,0,0));
-                    draw = "█";
+                    frame_put(fb, x, y, " ", rgb_f(0,0,0), rgb_f(0,0,0));
                     break;
                 case GF_FLUID:
-                    pressure = props->pressure[x + y*props->x];
-                    set_fg(rgb_f(0,0,0.2 + 0.8*(pressure-minp)/(maxp-minp)));
-                    set_bg(rgb_f(0,0,0.2 + 0.8*(pressure-minp)/(maxp-minp)));
+                    pressure = snap->pressure[x + y*w];
+                    c = rgb_f(0,0,0.2 + 0.8*(pressure-minp)/(maxp-minp));
+                    frame_put(fb, x, y, " ", c, c);
                     break;
                 case GF_INTERFACE:
-                    pressure = props->pressure[x + y*props->x];
-                    set_fg(rgb_f(0,0,0.2 + 0.8*(pressure-minp)/(maxp-minp)));
-                    set_bg(rgb_f(0,0,0));
-                    draw = "I";
+                    pressure = snap->pressure[x + y*w];
+                    c = rgb_f(0,0,0.2 + 0.8*(pressure-minp)/(maxp-minp));
+                    frame_put(fb, x, y, "I", c, rgb_f(0,0,0));
                     break;
             }
-            printf("%s", draw);
         }
     }
 }
 
+static double seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return( ts.tv_sec + ts.tv_nsec * 1e-9 );
+}
+
 int main() {
     size_t scene_x = 40;
     size_t scene_y = 20;
     gridfluid_t gf = gridfluid_create_empty_scene(scene_x, scene_y);
     //gridfluid_set_obstacle(gf,5,7);
-    for (size_t i=9; i<40; i++) {
-        gridfluid_set_obstacle(gf,i,12);
-    }
+    gridfluid_fill_rect(gf,9,12,31,1,GF_OBSTACLE);
     gridfluid_set_gravity(gf, 0.01);
-    for (size_t fy = 3; fy < 10; fy++) {
-        for (size_t fx = 4; fx < 7; fx++) {
-            gridfluid_set_fluid(gf,fx, fy);
-        }
-    }
-    for (size_t fy = 3; fy < 5; fy++) {
-        for (size_t fx = 4; fx < 20; fx++) {
-            gridfluid_set_fluid(gf,fx, fy);
-        }
-    }
+    gridfluid_fill_rect(gf,4,3,3,7,GF_FLUID);
+    gridfluid_fill_rect(gf,4,3,16,2,GF_FLUID);
     /*
     assert(gridfluid_get_type(gf,5,7) == GF_OBSTACLE);
     */
+
+    sim_t sim;
+    sim.gf = gf;
+    sim.x = scene_x;
+    sim.y = scene_y;
+    for (size_t i = 0; i < 3; i++) {
+        snapshot_t *snap = &sim.snaps[i];
+        snap->flags = calloc(scene_x * scene_y, sizeof(uint8_t));
+        snap->pressure = calloc(scene_x * scene_y, sizeof(float));
+        snap->mass = calloc(scene_x * scene_y, sizeof(float));
+        if (!snap->flags || !snap->pressure || !snap->mass)
+            abort();
+    }
+    sim.view = gftriple_create(&sim.snaps[0], &sim.snaps[1], &sim.snaps[2]);
+    sim.commands = gfring_create(sizeof(command_t), 64);
+    if (!sim.view || !sim.commands || sem_init(&sim.pending, 0, 0))
+        abort();
+    // the view starts from the scene as built
+    snapshot_take(&sim);
+
     if (!setup_screen()) {
         printf("Failed to setup screen; exiting\n");
         return(1);
     }
+    frame_t fb = frame_create(scene_x, scene_y);
+    pthread_t solver;
+    if (pthread_create(&solver, NULL, solve, &sim)) {
+        cleanup_screen();
+        printf("Failed to start the solver; exiting\n");
+        return(1);
+    }
 
+    const struct timespec tick = { 0, 20000000 };
     ssize_t len;
     unsigned char buf[1];
     int running = 1;
-    unsigned int step_count = 0;
-    unsigned int steps_per_frame = 1;
-    gridfluid_properties_t *props;
     size_t debug_x = scene_x/6;
     size_t debug_y = scene_y/2;
+    // steps per second, measured over about half a second
+    double rate = 0;
+    double rate_start = seconds();
+    uint64_t rate_step = 0;
 
-    bool simulating = false;
     bool debugging = false;
     while (running) {
-        if (simulating) {
-            for (size_t i = 0; i < simulating * steps_per_frame; i++) {
-                curs_xy(10,31);
-                gridfluid_step(gf);
-                step_count++;
-            }
-            render(gf);
+        const snapshot_t *snap = gftriple_latest(sim.view);
+        double now = seconds();
+        if (now - rate_start >= 0.5) {
+            rate = (snap->step - rate_step) / (now - rate_start);
+            rate_start = now;
+            rate_step = snap->step;
+        }
+        render(snap, scene_x, scene_y, fb);
+        if (debugging) {
+            // the cell is drawn again by the next frame once the marker moves on
+            frame_put(fb, debug_x, debug_y, "█", rgb_f(1,0,0), rgb_f(0,0,0));
         }
-        props = gridfluid_get_properties(gf);
-        float maxp = props->max_pressure;
-        float minp = props->min_pressure;
-        float maxv = props->max_velocity;
+        frame_flush(fb);
         set_fg(rgb_f(1,1,1));
         set_bg(rgb_f(0,0,0));
 
         curs_xy(10,25);
-        printf("min pressure: %f     ", minp);
+        printf("min pressure: %f     ", snap->min_pressure);
         curs_xy(10,26);
-        printf("max pressure: %f     ", maxp);
+        printf("max pressure: %f     ", snap->max_pressure);
         curs_xy(10,27);
-        printf("max velocity: %f     ", maxv);
+        printf("max velocity: %f     ", snap->max_velocity);
         curs_xy(10,28);
-        printf("total mass: %f     ", props->total_mass);
+        printf("total mass: %f     ", snap->total_mass);
         curs_xy(10,29);
-        printf("step count: %d", step_count);
+        printf("step count: %llu, %.0f steps/s     ", (unsigned long long)snap->step, rate);
         curs_xy(10,30);
         printf("debugging: %s", debugging ? "on ": "off");
         if (debugging) {
-            float mass = props->mass[debug_x + debug_y * scene_x];
-            float pressure = props->pressure[debug_x + debug_y * scene_x];
+            float mass = snap->mass[debug_x + debug_y * scene_x];
+            float pressure = snap->pressure[debug_x + debug_y * scene_x];
             curs_xy(50,10);
-            printf("x: %zu, y: %zu", debug_x, debug_y);
+            printf("x: %zu, y: %zu   ", debug_x, debug_y);
             curs_xy(50,11);
             printf("mass: %f, pressure: %f", mass, pressure);
-            curs_xy(debug_x, debug_y);
-            set_fg(rgb_f(1,0,0));
-            printf("█");
-            set_fg(rgb_f(1,1,1));
         }
         curs_xy(10,31);
+        fflush(stdout);
 
         len = read(0, buf, 1);
         if (len == -1) {
@@ -133,37 +252,50 @@ int main() {
                     running = 0;
                     break;
                 case 's':
-                    gridfluid_step(gf);
-                    step_count++;
-                    render(gf);
+                    send(&sim, CMD_STEP);
                     break;
                 case 'd':
                     debugging = debugging ? false : true;
                     break;
                 case 'h':
-                    debug_x--;
+                    if (debug_x > 0)
+                        debug_x--;
                     break;
                 case 'j':
-                    debug_y++;
+                    if (debug_y + 1 < scene_y)
+                        debug_y++;
                     break;
                 case 'k':
-                    debug_y--;
+                    if (debug_y > 0)
+                        debug_y--;
                     break;
                 case 'l':
-                    debug_x++;
+                    if (debug_x + 1 < scene_x)
+                        debug_x++;
                     break;
                 case ' ':
-                    simulating = simulating ? false : true;
+                    send(&sim, CMD_RUN);
                     break;
                 default:
                     printf("read: %3u        ", buf[0]);
                     break;
             }
-            //clear();
-            //render(gf);
+        } else {
+            nanosleep(&tick, NULL);
         }
     }
+    send(&sim, CMD_QUIT);
+    pthread_join(solver, NULL);
     cleanup_screen();
+    frame_free(fb);
+    gftriple_free(sim.view);
+    gfring_free(sim.commands);
+    sem_destroy(&sim.pending);
+    for (size_t i = 0; i < 3; i++) {
+        free(sim.snaps[i].flags);
+        free(sim.snaps[i].pressure);
+        free(sim.snaps[i].mass);
+    }
     gridfluid_free(gf);
     return 0;
 }
@@ -0,0 +1,145 @@
+// Microbenchmark for the order in which the lattice is traversed.
+//
+// The first half times a bare D2Q9 pull-stream over structure-of-arrays
+// planes, walked column-major (the order the solver used to sweep in),
+// row-major, and in tiles. The second half times gridfluid_step on a
+// half-filled tank with tiling off and with a few tile shapes.
+//
+//     tilebench [width] [height] [steps]
+
+#define _POSIX_C_SOURCE 200809L
+#include "gridfluid.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static const int ex[9] = { 0, 1, 0, -1, 0, 1, -1, -1, 1 };
+static const int ey[9] = { 0, 0, 1, 0, -1, 1, 1, -1, -1 };
+
+static const size_t tiles[][2] = {
+    {64, 16}, {256, 16}, {256, 64}, {1024, 8}
+};
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return( ts.tv_sec + ts.tv_nsec * 1e-9 );
+}
+
+static void pull(float **src, float **dst, size_t w, size_t x, size_t y) {
+    for (size_t i = 0; i < 9; i++) {
+        dst[i][x + y*w] = src[i][(x - ex[i]) + (y - ey[i])*w];
+    }
+}
+
+static void sweep_columns(float **src, float **dst, size_t w, size_t h) {
+    for (size_t x = 1; x < w-1; x++) {
+        for (size_t y = 1; y < h-1; y++) {
+            pull(src, dst, w, x, y);
+        }
+    }
+}
+
+static void sweep_rows(float **src, float **dst, size_t w, size_t h) {
+    for (size_t y = 1; y < h-1; y++) {
+        for (size_t x = 1; x < w-1; x++) {
+            pull(src, dst, w, x, y);
+        }
+    }
+}
+
+static void sweep_tiles(float **src, float **dst, size_t w, size_t h, size_t tw, size_t th) {
+    for (size_t ty = 1; ty < h-1; ty += th) {
+        size_t ty1 = ty + th < h-1 ? ty + th : h-1;
+        for (size_t tx = 1; tx < w-1; tx += tw) {
+            size_t tx1 = tx + tw < w-1 ? tx + tw : w-1;
+            for (size_t y = ty; y < ty1; y++) {
+                for (size_t x = tx; x < tx1; x++) {
+                    pull(src, dst, w, x, y);
+                }
+            }
+        }
+    }
+}
+
+static void report(const char *name, double seconds, size_t cells, size_t steps) {
+    printf("  %-24s %8.2f MLUPS\n", name, cells * (double)steps / seconds / 1e6);
+}
+
+static void bench_sweeps(size_t w, size_t h, size_t steps) {
+    float *a[9];
+    float *b[9];
+    for (size_t i = 0; i < 9; i++) {
+        a[i] = calloc(w*h, sizeof(float));
+        b[i] = calloc(w*h, sizeof(float));
+        if (!a[i] || !b[i]) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+    }
+    size_t cells = (w-2) * (h-2);
+    char name[64];
+    double t;
+
+    printf("pull-stream, %zux%zu:\n", w, h);
+    t = now();
+    for (size_t s = 0; s < steps; s++)
+        sweep_columns(s & 1 ? b : a, s & 1 ? a : b, w, h);
+    report("column-major", now() - t, cells, steps);
+    t = now();
+    for (size_t s = 0; s < steps; s++)
+        sweep_rows(s & 1 ? b : a, s & 1 ? a : b, w, h);
+    report("row-major", now() - t, cells, steps);
+    for (size_t k = 0; k < sizeof(tiles)/sizeof(tiles[0]); k++) {
+        snprintf(name, sizeof(name), "tiled %zux%zu", tiles[k][0], tiles[k][1]);
+        t = now();
+        for (size_t s = 0; s < steps; s++)
+            sweep_tiles(s & 1 ? b : a, s & 1 ? a : b, w, h, tiles[k][0], tiles[k][1]);
+        report(name, now() - t, cells, steps);
+    }
+    for (size_t i = 0; i < 9; i++) {
+        free(a[i]);
+        free(b[i]);
+    }
+}
+
+static gridfluid_t tank(size_t w, size_t h) {
+    gridfluid_t gf = gridfluid_create_empty_scene(w, h);
+    gridfluid_fill_rect(gf, 1, h/2, w-2, h-1 - h/2, GF_FLUID);
+    return( gf );
+}
+
+static void bench_step(size_t w, size_t h, size_t steps, size_t tw, size_t th) {
+    char name[64];
+    gridfluid_t gf = tank(w, h);
+    gridfluid_set_tiling(gf, tw, th);
+    // one step first so setup work is not timed
+    gridfluid_step(gf);
+    double t = now();
+    for (size_t s = 0; s < steps; s++)
+        gridfluid_step(gf);
+    t = now() - t;
+    if (tw)
+        snprintf(name, sizeof(name), "tiled %zux%zu", tw, th);
+    else
+        snprintf(name, sizeof(name), "rows");
+    report(name, t, w*h, steps);
+    gridfluid_free(gf);
+}
+
+int main(int argc, char **argv) {
+    size_t w = argc > 1 ? strtoul(argv[1], NULL, 10) : 4096;
+    size_t h = argc > 2 ? strtoul(argv[2], NULL, 10) : 256;
+    size_t steps = argc > 3 ? strtoul(argv[3], NULL, 10) : 20;
+    if (w < 3 || h < 3) {
+        fprintf(stderr, "usage: %s [width] [height] [steps]\n", argv[0]);
+        return 1;
+    }
+    bench_sweeps(w, h, steps);
+    printf("gridfluid_step, %zux%zu:\n", w, h);
+    bench_step(w, h, steps, 0, 0);
+    for (size_t k = 0; k < sizeof(tiles)/sizeof(tiles[0]); k++) {
+        bench_step(w, h, steps, tiles[k][0], tiles[k][1]);
+    }
+    return 0;
+}